@@ -9,6 +9,30 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/mm.h>
+#include <linux/interrupt.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/overflow.h>
+#include <linux/io.h>
+#include <linux/dma-mapping.h>
+#include <linux/genalloc.h>
+#include <linux/kref.h>
+#include <linux/srcu.h>
+#include <linux/idr.h>
+#include <linux/dma-buf.h>
+#include <linux/iosys-map.h>
+#include <linux/dma-fence.h>
+#include <linux/sync_file.h>
+#include <linux/workqueue.h>
+#include <linux/file.h>
+
+#include "gray_drv.h"
 
 #define DRIVER_NAME "Gray-gpu"
 #define DRIVER_DESC "Gray GPU Driver for Learning purpose"
@@ -16,183 +40,741 @@
 #define GRAY_GPU_VENDOR_ID    0x1122
 #define GRAY_GPU_DEVICE_ID    0x1122
 
-//Register offset
-#define REG_DEVICE_ID       0x00
-#define REG_STATUS          0x04
-#define REG_CONTROL         0x08
-#define REG_FB_ADDR         0x0C
-#define REG_FB_WIDTH        0x10
-#define REG_FB_HEIGHT       0x14
-#define REG_FB_BPP          0x18
-#define REG_FB_ENABLE       0x1C
-#define REG_FB_PITCH        0x20
-#define REG_CURSOR_X        0x24
-#define REG_CURSOR_Y        0x28
-#define REG_CURSOR_ENABLE   0x2C
-#define REG_CURSOR_HOTSPOT_X 0x30
-#define REG_CURSOR_HOTSPOT_Y 0x34
-#define REG_CURSOR_UPLOAD   0x38
-#define REG_FB_COUNT        0x3C   
-#define REG_FB_CURRENT      0x40  
-#define REG_FB_NEXT         0x44 
-#define REG_PAGE_FLIP       0x48  
-#define REG_FLIP_PENDING    0x4C  
-#define REG_VBLANK_COUNT    0x50 
-
-//Control register bits
-#define CTRL_RESET	(1<<0)
-#define CTRL_ENABLE	(1<<1)
-
-//Status register bits
-#define STATUS_READY	(1<<0)
-#define STATUS_VBLANK	(1<<1)
-#define STATUS_CURSOR_LOADED (1 << 2)
-
-//Character device
-#define GRAY_GPU_MINOR		0
+//Events delivered to userspace through read()/poll()
+#define GRAY_GPU_EVENT_VBLANK		(1<<0)
+#define GRAY_GPU_EVENT_FLIP_COMPLETE	(1<<1)
+#define GRAY_GPU_EVENT_ALL		(GRAY_GPU_EVENT_VBLANK | GRAY_GPU_EVENT_FLIP_COMPLETE)
+#define GRAY_GPU_EVENT_QUEUE_LEN	64
+
+//Page flip with fences (0x1017)
+#define GRAY_GPU_FLIP_BO		(1<<0)	/* target is a buffer object handle */
+#define GRAY_GPU_FLIP_IN_FENCE		(1<<1)	/* wait for in_fence before flipping */
+#define GRAY_GPU_FLIP_OUT_FENCE		(1<<2)	/* return a fence signalled once on screen */
+#define GRAY_GPU_FLIP_FLAGS		(GRAY_GPU_FLIP_BO | GRAY_GPU_FLIP_IN_FENCE | \
+					 GRAY_GPU_FLIP_OUT_FENCE)
+
+//Atomic commit (0x1019): (property, value) pairs, each property at most once
+#define GRAY_GPU_PROP_MODE_WIDTH	0	/* a new mode needs FB_INDEX or FB_BO too */
+#define GRAY_GPU_PROP_MODE_HEIGHT	1
+#define GRAY_GPU_PROP_MODE_PITCH	2	/* bytes, defaults to width * 4 */
+#define GRAY_GPU_PROP_FB_INDEX		3	/* scan out a legacy framebuffer */
+#define GRAY_GPU_PROP_FB_BO		4	/* scan out a buffer object handle */
+#define GRAY_GPU_PROP_DISPLAY_ENABLE	5
+#define GRAY_GPU_PROP_CURSOR_X		6
+#define GRAY_GPU_PROP_CURSOR_Y		7
+#define GRAY_GPU_PROP_CURSOR_ENABLE	8
+#define GRAY_GPU_PROP_CURSOR_HOTSPOT_X	9
+#define GRAY_GPU_PROP_CURSOR_HOTSPOT_Y	10
+#define GRAY_GPU_PROP_COUNT		11
+#define GRAY_GPU_ATOMIC_TEST_ONLY	(1<<0)	/* validate, apply nothing */
+#define GRAY_GPU_ATOMIC_MAX_DW		32	/* ring dwords one commit needs at most */
+
+//Overlay planes (0x101A)
+#define GRAY_GPU_OVERLAY_ENABLE		(1<<0)	/* show it, otherwise it is hidden */
+#define GRAY_GPU_OVERLAY_FLAGS		GRAY_GPU_OVERLAY_ENABLE
+
+//Character device, one minor per PCI function
+#define GRAY_GPU_MAX_DEVICES	16
 #define GRAY_GPU_NAME		"gray-gpu"
 
-struct gray_gpu_device {
-	struct pci_dev *pdev;
-	void __iomem *registers;
-	void __iomem *vram;
-	size_t vram_size;
-
-	//Framebuffer info
-	uint32_t fb_width;
-	uint32_t fb_height;
-	uint32_t fb_bpp;
-	uint32_t fb_pitch;
-	uint32_t fb_size;
- 
-	/* Cursor info */
-	uint32_t cursor_x;
-	uint32_t cursor_y;
-	uint32_t cursor_enabled;
-	uint32_t cursor_hotspot_x;
-	uint32_t cursor_hotspot_y;
-
-	//Multiple Framebuffer state
-	uint32_t fb_count;
-	uint32_t fb_current;
-	uint32_t fb_next;
-	uint32_t flip_pending;
-	uint32_t vblank_count;
-	uint32_t fb_addresses[4];
-
-	//Character device
-	struct cdev cdev;
-	dev_t devt;
-	struct class *class;
-	struct device *device;
+/* One record per event, read() returns whole records */
+struct gray_gpu_event {
+	uint32_t type;		/* GRAY_GPU_EVENT_* */
+	uint32_t fb_index;	/* flip complete: framebuffer now on screen */
+	uint64_t sequence;	/* vblank counter when the event happened */
+	uint64_t timestamp_ns;	/* CLOCK_MONOTONIC */
 };
 
-static struct gray_gpu_device *gray_gpu_dev = NULL;
+/* Per-open state */
+struct gray_gpu_file {
+	struct gray_gpu_device *gpu;
+	struct list_head link;		/* gpu->clients */
+
+	/* Event queue, protected by gpu->lock, head/tail are free running */
+	uint32_t event_mask;
+	struct gray_gpu_event events[GRAY_GPU_EVENT_QUEUE_LEN];
+	unsigned int ev_head;
+	unsigned int ev_tail;
+	unsigned int ev_dropped;	/* since the last 0x101C */
+	wait_queue_head_t event_wq;
+	struct eventfd_ctx *eventfd;
+
+	/* Buffer object handles, bo_lock protects the idr */
+	struct idr bos;
+	struct mutex bo_lock;
+};
+
+/* Ring fence, signalled from the cmd-done irq once its seqno completes */
+struct gray_gpu_fence {
+	struct dma_fence base;
+	struct list_head link;		/* gpu->fence_pending */
+};
 
-static inline void gray_gpu_write_reg(struct gray_gpu_device *gpu, u32 offset, u32 value)
+/* A flip parked until its in-fence signals */
+struct gray_gpu_fenced_flip {
+	struct dma_fence_cb cb;
+	struct work_struct work;
+	struct list_head link;		/* gpu->fenced_flips or ready_flips, gpu->lock */
+	struct gray_gpu_device *gpu;
+	struct gray_gpu_flip flip;
+	struct dma_fence *in;
+};
+
+/*
+ * Shared by every Gray GPU: one chrdev region and class, and an idr mapping
+ * minors to devices. Probe reserves a minor with a NULL entry and only
+ * publishes the device once it is fully set up, so open never sees half a
+ * device.
+ */
+static dev_t gray_gpu_devt;
+static struct class *gray_gpu_class;
+static DEFINE_IDR(gray_gpu_idr);
+static DEFINE_MUTEX(gray_gpu_idr_lock);
+DEFINE_STATIC_SRCU(gray_gpu_unplug_srcu);
+
+static int gray_gpu_init_vram(struct gray_gpu_device *gpu)
 {
-	iowrite32(value, gpu->registers + offset);
+	gpu->legacy_size = 0;
+	gpu->vram_base = pci_resource_start(gpu->pdev, 1);
+
+	gpu->vram_pool = gen_pool_create(PAGE_SHIFT, -1);
+	if (!gpu->vram_pool)
+		return -ENOMEM;
+
+	if (gen_pool_add(gpu->vram_pool, gpu->vram_base, gpu->vram_usable, -1)) {
+		gen_pool_destroy(gpu->vram_pool);
+		gpu->vram_pool = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
 }
 
-static inline u32 gray_gpu_read_reg(struct gray_gpu_device *gpu, u32 offset)
+/* Drop the PTEs of every file mapping below size, they refault on demand */
+static void gray_gpu_zap_mappings(struct gray_gpu_device *gpu, uint32_t size)
 {
-	return ioread32(gpu->registers + offset);
+	struct inode *inode = READ_ONCE(gpu->mapping_inode);
+
+	if (inode)
+		unmap_mapping_range(inode->i_mapping, 0, size, 1);
 }
 
-static int gray_gpu_setup_framebuffer(struct gray_gpu_device *gpu, uint32_t width, uint32_t height, uint32_t bpp)
+/*
+ * The legacy framebuffers sit at fixed offsets from 0, so the whole range
+ * is reserved in the pool; vram_lock held. Fails if buffer objects are in
+ * the way, leaving the old reservation in place. Mappings of the old range
+ * are zapped when it changes, the fault handler checks the new size.
+ */
+static int gray_gpu_reserve_legacy(struct gray_gpu_device *gpu, uint32_t size)
+{
+	struct genpool_data_fixed fixed = { .offset = 0 };
+	uint32_t old = gpu->legacy_size;
+	int ret = 0;
+
+	size = PAGE_ALIGN(size);
+	if (old)
+		gen_pool_free(gpu->vram_pool, gpu->vram_base, old);
+	gpu->legacy_size = 0;
+
+	if (gen_pool_alloc_algo(gpu->vram_pool, size, gen_pool_fixed_alloc, &fixed)) {
+		gpu->legacy_size = size;
+	} else {
+		if (old && gen_pool_alloc_algo(gpu->vram_pool, old, gen_pool_fixed_alloc, &fixed))
+			gpu->legacy_size = old;
+		ret = -ENOSPC;
+	}
+
+	if (old && gpu->legacy_size != old)
+		gray_gpu_zap_mappings(gpu, old);
+
+	return ret;
+}
+
+/* Last reference: every buffer object is gone, so the pool is empty */
+static void gray_gpu_device_release(struct kref *ref)
+{
+	struct gray_gpu_device *gpu = container_of(ref, struct gray_gpu_device, ref);
+
+	if (gpu->vram_pool)
+		gen_pool_destroy(gpu->vram_pool);
+	if (gpu->mapping_inode)
+		iput(gpu->mapping_inode);
+	kfree(gpu);
+}
+
+static void gray_gpu_device_put(struct gray_gpu_device *gpu)
+{
+	kref_put(&gpu->ref, gray_gpu_device_release);
+}
+
+/* The probe reference, dropped after the irqs and BAR mappings are released */
+static void gray_gpu_device_put_devm(void *data)
+{
+	gray_gpu_device_put(data);
+}
+
+/*
+ * Hardware access from file operations runs inside an SRCU read section,
+ * remove waits for those in flight after setting unplugged. Sections may
+ * nest, an ioctl can fault on a mapping of this device. Returns false
+ * once the device is gone; pair with gray_gpu_exit().
+ */
+static bool gray_gpu_enter(struct gray_gpu_device *gpu, int *idx)
+{
+	*idx = srcu_read_lock(&gray_gpu_unplug_srcu);
+	if (READ_ONCE(gpu->unplugged)) {
+		srcu_read_unlock(&gray_gpu_unplug_srcu, *idx);
+		return false;
+	}
+	return true;
+}
+
+static void gray_gpu_exit(int idx)
+{
+	srcu_read_unlock(&gray_gpu_unplug_srcu, idx);
+}
+
+static void gray_gpu_bo_release(struct kref *ref)
+{
+	struct gray_gpu_bo *bo = container_of(ref, struct gray_gpu_bo, ref);
+	struct gray_gpu_device *gpu = bo->gpu;
+
+	/* genalloc is lockless, this is safe from the flip irq */
+	gen_pool_free(gpu->vram_pool, gpu->vram_base + bo->offset, bo->size);
+	kfree(bo);
+	gray_gpu_device_put(gpu);
+}
+
+void gray_gpu_bo_put(struct gray_gpu_bo *bo)
+{
+	if (bo)
+		kref_put(&bo->ref, gray_gpu_bo_release);
+}
+
+/* Signal and drop a completion fence, if there is one */
+static void gray_gpu_fence_signal(struct dma_fence **fence, int error)
+{
+	if (!*fence)
+		return;
+
+	if (error)
+		dma_fence_set_error(*fence, error);
+	dma_fence_signal(*fence);
+	dma_fence_put(*fence);
+	*fence = NULL;
+}
+
+/* The armed flip reached the screen: it now owns the scanout reference */
+static void gray_gpu_flip_latched(struct gray_gpu_device *gpu)
+{
+	gray_gpu_bo_put(gpu->scanout_bo);
+	gpu->scanout_bo = gpu->armed_bo;
+	gpu->armed_bo = NULL;
+	gray_gpu_fence_signal(&gpu->armed_done, 0);
+}
+
+/* Drop a flip that will never be armed */
+static void gray_gpu_flip_cancel(struct gray_gpu_flip *flip, int error)
+{
+	gray_gpu_fence_signal(&flip->done, error);
+	gray_gpu_bo_put(flip->bo);
+	flip->bo = NULL;
+}
+
+/* The flip queue has room again, feed fenced flips waiting for it; gpu->lock held */
+static void gray_gpu_kick_ready_flips(struct gray_gpu_device *gpu)
+{
+	if (!list_empty(&gpu->ready_flips))
+		schedule_work(&gpu->ready_work);
+}
+
+static const char *gray_gpu_fence_driver_name(struct dma_fence *fence)
+{
+	return GRAY_GPU_NAME;
+}
+
+static const char *gray_gpu_ring_timeline_name(struct dma_fence *fence)
+{
+	return "ring";
+}
+
+static const char *gray_gpu_flip_timeline_name(struct dma_fence *fence)
+{
+	return "flip";
+}
+
+/*
+ * No .signaled callback: ring fences are only ever signalled from the
+ * cmd-done irq, so fence_lock never has to take gpu->lock.
+ */
+static const struct dma_fence_ops gray_gpu_ring_fence_ops = {
+	.get_driver_name = gray_gpu_fence_driver_name,
+	.get_timeline_name = gray_gpu_ring_timeline_name,
+};
+
+static const struct dma_fence_ops gray_gpu_flip_fence_ops = {
+	.get_driver_name = gray_gpu_fence_driver_name,
+	.get_timeline_name = gray_gpu_flip_timeline_name,
+};
+
+/*
+ * In-fences and mailbox retargets let flips complete out of submission
+ * order, so each flip fence gets a context of its own.
+ */
+static struct dma_fence *gray_gpu_flip_fence_create(struct gray_gpu_device *gpu)
+{
+	struct dma_fence *fence;
+
+	fence = kzalloc(sizeof(*fence), GFP_KERNEL);
+	if (!fence)
+		return NULL;
+
+	dma_fence_init(fence, &gray_gpu_flip_fence_ops, &gpu->fence_lock,
+		       dma_fence_context_alloc(1), 1);
+	return fence;
+}
+
+/* Allocate a cleared VRAM range, returned with one reference */
+struct gray_gpu_bo *gray_gpu_bo_alloc(struct gray_gpu_device *gpu, uint32_t size)
+{
+	struct gray_gpu_bo *bo;
+	unsigned long addr;
+
+	if (!size || size > gpu->vram_usable)
+		return ERR_PTR(-EINVAL);
+
+	bo = kzalloc(sizeof(*bo), GFP_KERNEL);
+	if (!bo)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&bo->ref);
+	bo->gpu = gpu;
+	bo->size = PAGE_ALIGN(size);
+
+	mutex_lock(&gpu->vram_lock);
+	addr = gen_pool_alloc(gpu->vram_pool, bo->size);
+	mutex_unlock(&gpu->vram_lock);
+	if (!addr) {
+		kfree(bo);
+		return ERR_PTR(-ENOSPC);
+	}
+	bo->offset = addr - gpu->vram_base;
+	kref_get(&gpu->ref);
+
+	/* Do not hand out what the previous owner left behind */
+	memset_io(gpu->vram + bo->offset, 0, bo->size);
+
+	return bo;
+}
+
+/* Give the file a handle on bo, taking over the caller's reference */
+static int gray_gpu_bo_add_handle(struct gray_gpu_file *gfile, struct gray_gpu_bo *bo)
+{
+	int id;
+
+	mutex_lock(&gfile->bo_lock);
+	id = idr_alloc(&gfile->bos, bo, 1, GRAY_GPU_MAX_BOS + 1, GFP_KERNEL);
+	mutex_unlock(&gfile->bo_lock);
+	if (id < 0)
+		gray_gpu_bo_put(bo);
+
+	return id;
+}
+
+static int gray_gpu_bo_create(struct gray_gpu_file *gfile, uint32_t size, uint32_t *handle,
+			      uint32_t *offset)
+{
+	struct gray_gpu_bo *bo;
+	int id;
+
+	bo = gray_gpu_bo_alloc(gfile->gpu, size);
+	if (IS_ERR(bo))
+		return PTR_ERR(bo);
+
+	*offset = bo->offset;
+	id = gray_gpu_bo_add_handle(gfile, bo);
+	if (id < 0)
+		return id;
+
+	*handle = id;
+	return 0;
+}
+
+static int gray_gpu_bo_destroy(struct gray_gpu_file *gfile, uint32_t handle)
+{
+	struct gray_gpu_bo *bo;
+
+	mutex_lock(&gfile->bo_lock);
+	bo = idr_remove(&gfile->bos, handle);
+	mutex_unlock(&gfile->bo_lock);
+	if (!bo)
+		return -ENOENT;
+
+	/* A flip still using it keeps the VRAM until it leaves the screen */
+	gray_gpu_bo_put(bo);
+	return 0;
+}
+
+/* Look up a handle and take a reference */
+static struct gray_gpu_bo *gray_gpu_bo_get(struct gray_gpu_file *gfile, uint32_t handle)
+{
+	struct gray_gpu_bo *bo;
+
+	mutex_lock(&gfile->bo_lock);
+	bo = idr_find(&gfile->bos, handle);
+	if (bo)
+		kref_get(&bo->ref);
+	mutex_unlock(&gfile->bo_lock);
+
+	return bo;
+}
+
+/* Drop the driver's own references; files still holding objects keep the pool */
+static void gray_gpu_fini_vram(struct gray_gpu_device *gpu)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	while (gpu->flip_q_head != gpu->flip_q_tail) {
+		gray_gpu_flip_cancel(&gpu->flip_queue[gpu->flip_q_head % GRAY_GPU_FLIP_QUEUE_LEN],
+				     -ENODEV);
+		gpu->flip_q_head++;
+	}
+	gray_gpu_bo_put(gpu->armed_bo);
+	gray_gpu_fence_signal(&gpu->armed_done, -ENODEV);
+	gpu->ring_flip_seq = 0;
+	gray_gpu_bo_put(gpu->scanout_bo);
+	gpu->armed_bo = NULL;
+	gpu->scanout_bo = NULL;
+	for (i = 1; i < gpu->num_heads; i++) {
+		gray_gpu_bo_put(gpu->heads[i].armed_bo);
+		gray_gpu_bo_put(gpu->heads[i].scanout_bo);
+		gpu->heads[i].armed_bo = NULL;
+		gpu->heads[i].scanout_bo = NULL;
+	}
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	mutex_lock(&gpu->mode_lock);
+	for (i = 0; i < GRAY_GPU_MAX_OVERLAYS; i++) {
+		gray_gpu_bo_put(gpu->overlay_bo[i]);
+		gpu->overlay_bo[i] = NULL;
+	}
+	mutex_unlock(&gpu->mode_lock);
+
+	/* Buffer objects still open keep the pool until the last reference */
+	if (gpu->legacy_size)
+		gen_pool_free(gpu->vram_pool, gpu->vram_base, gpu->legacy_size);
+	gpu->legacy_size = 0;
+}
+
+static int gray_gpu_bo_release_handle(int id, void *p, void *data)
+{
+	gray_gpu_bo_put(p);
+	return 0;
+}
+
+/* Publish new scanout geometry; mode_lock held, lock is taken for the flip path */
+static void gray_gpu_store_mode(struct gray_gpu_device *gpu, uint32_t width, uint32_t height,
+				uint32_t bpp, uint32_t pitch)
 {
+	unsigned long flags;
+
+	spin_lock_irqsave(&gpu->lock, flags);
 	gpu->fb_width = width;
 	gpu->fb_height = height;
 	gpu->fb_bpp = bpp;
-	gpu->fb_pitch = width * (bpp /  8);
-	gpu->fb_size = gpu->fb_pitch * height;
+	gpu->fb_pitch = pitch;
+	gpu->fb_size = pitch * height;
+	spin_unlock_irqrestore(&gpu->lock, flags);
+}
 
-	if(gpu->fb_size > gpu->vram_size){
+static int gray_gpu_setup_framebuffer(struct gray_gpu_device *gpu, uint32_t width, uint32_t height, uint32_t bpp)
+{
+	uint32_t pitch, size;
+	u64 total;
+	int ret;
+
+	/* A wrapped size would reserve less than the device scans out */
+	if(check_mul_overflow(width, bpp / 8, &pitch) || check_mul_overflow(pitch, height, &size)){
+		return -EINVAL;
+	}
+
+	mutex_lock(&gpu->mode_lock);
+	total = (u64)size * max_t(uint32_t, gpu->fb_count, 1);
+	if(total > gpu->vram_usable){
+		mutex_unlock(&gpu->mode_lock);
 		dev_err(&gpu->pdev->dev, "Framebuffer too large for VRAM\n");
 		return -EINVAL;
 	}
 
+	mutex_lock(&gpu->vram_lock);
+	ret = gray_gpu_reserve_legacy(gpu, total);
+	mutex_unlock(&gpu->vram_lock);
+	if(ret){
+		mutex_unlock(&gpu->mode_lock);
+		dev_err(&gpu->pdev->dev, "Framebuffer overlaps buffer objects\n");
+		return ret;
+	}
+
+	gray_gpu_store_mode(gpu, width, height, bpp, pitch);
+
 	//Configure device 
 	gray_gpu_write_reg(gpu, REG_FB_WIDTH, width);
 	gray_gpu_write_reg(gpu, REG_FB_HEIGHT, height);
 	gray_gpu_write_reg(gpu, REG_FB_BPP, bpp);
-	gray_gpu_write_reg(gpu, REG_FB_PITCH, gpu->fb_pitch);
+	gray_gpu_write_reg(gpu, REG_FB_PITCH, pitch);
 	gray_gpu_write_reg(gpu, REG_FB_ADDR, 0) ;//Framebuffer at vram offset 0
+	mutex_unlock(&gpu->mode_lock);
 	
-	dev_info(&gpu->pdev->dev, "Framebuffer: %dx%d@%dbpp, pitch=%d, size=%d\n", width, height, bpp, gpu->fb_pitch, gpu->fb_size);
+	dev_info(&gpu->pdev->dev, "Framebuffer: %dx%d@%dbpp, pitch=%d, size=%d\n", width, height, bpp, pitch, size);
 
 	return 0;
 }
 
-
-static void gray_gpu_enable_display(struct gray_gpu_device *gpu, bool enable)
+/*
+ * Scanout geometry for buffer object flips, the legacy reservation is left
+ * alone. The device latches it with the next flip, not straight away, so
+ * the buffer on screen keeps its own stride until the new one replaces it.
+ */
+void gray_gpu_set_mode(struct gray_gpu_device *gpu, unsigned int head, uint32_t width,
+		       uint32_t height, uint32_t pitch)
 {
-	gray_gpu_write_reg(gpu, REG_FB_ENABLE, enable? 1:0);
-	dev_info(&gpu->pdev->dev, "Display %s\n", enable? "enabled" : "disabled");
+	struct gray_gpu_head *h = &gpu->heads[head];
+
+	mutex_lock(&gpu->mode_lock);
+	if (head) {
+		if (h->fb_width != width || h->fb_height != height || h->fb_pitch != pitch) {
+			h->fb_width = width;
+			h->fb_height = height;
+			h->fb_pitch = pitch;
+
+			gray_gpu_write_reg(gpu, REG_HEAD(head, REG_FB_NEXT_SIZE), (height << 16) | width);
+			gray_gpu_write_reg(gpu, REG_HEAD(head, REG_FB_NEXT_PITCH), pitch);
+		}
+	} else if (gpu->fb_width != width || gpu->fb_height != height || gpu->fb_pitch != pitch ||
+		   gpu->fb_bpp != 32) {
+		gray_gpu_store_mode(gpu, width, height, 32, pitch);
+
+		gray_gpu_write_reg(gpu, REG_FB_NEXT_SIZE, (height << 16) | width);
+		gray_gpu_write_reg(gpu, REG_FB_NEXT_PITCH, pitch);
+	}
+	mutex_unlock(&gpu->mode_lock);
 }
 
-static void gray_gpu_set_cursor_position(struct gray_gpu_device *gpu, uint32_t x, uint32_t y)
+
+void gray_gpu_enable_display(struct gray_gpu_device *gpu, unsigned int head, bool enable)
 {
-	gpu->cursor_x = x;
-	gpu->cursor_y = y;
-	gray_gpu_write_reg(gpu, REG_CURSOR_X, x);
-	gray_gpu_write_reg(gpu, REG_CURSOR_Y, y);
+	mutex_lock(&gpu->mode_lock);
+	gray_gpu_write_reg(gpu, REG_HEAD(head, REG_FB_ENABLE), enable? 1:0);
+	mutex_unlock(&gpu->mode_lock);
+	dev_info(&gpu->pdev->dev, "Display %u %s\n", head, enable? "enabled" : "disabled");
 }
 
-static void gray_gpu_enable_cursor(struct gray_gpu_device *gpu, bool enable)
+/* The cursor helpers keep a copy for head 0 only, that is what the character device reports */
+void gray_gpu_set_cursor_position(struct gray_gpu_device *gpu, unsigned int head, uint32_t x,
+				  uint32_t y)
 {
-	gpu->cursor_enabled = enable ? 1 : 0;
-	gray_gpu_write_reg(gpu, REG_CURSOR_ENABLE, gpu->cursor_enabled);
-	dev_info(&gpu->pdev->dev, "Cursor %s\n", enable ? "enabled" : "disabled");
+	mutex_lock(&gpu->mode_lock);
+	if (!head) {
+		gpu->cursor_x = x;
+		gpu->cursor_y = y;
+	}
+	gray_gpu_write_reg(gpu, REG_HEAD(head, REG_CURSOR_X), x);
+	gray_gpu_write_reg(gpu, REG_HEAD(head, REG_CURSOR_Y), y);
+	mutex_unlock(&gpu->mode_lock);
 }
 
-static void gray_gpu_set_cursor_hotspot(struct gray_gpu_device *gpu, uint32_t x, uint32_t y)
+void gray_gpu_enable_cursor(struct gray_gpu_device *gpu, unsigned int head, bool enable)
 {
-	gpu->cursor_hotspot_x = x;
-	gpu->cursor_hotspot_y = y;
-	gray_gpu_write_reg(gpu, REG_CURSOR_HOTSPOT_X, x);
-	gray_gpu_write_reg(gpu, REG_CURSOR_HOTSPOT_Y, y);
+	mutex_lock(&gpu->mode_lock);
+	if (!head)
+		gpu->cursor_enabled = enable ? 1 : 0;
+	gray_gpu_write_reg(gpu, REG_HEAD(head, REG_CURSOR_ENABLE), enable ? 1 : 0);
+	mutex_unlock(&gpu->mode_lock);
+	dev_info(&gpu->pdev->dev, "Cursor %u %s\n", head, enable ? "enabled" : "disabled");
 }
 
-static int gray_gpu_upload_cursor(struct gray_gpu_device *gpu, const uint32_t *cursor_data, size_t size)
+void gray_gpu_set_cursor_hotspot(struct gray_gpu_device *gpu, unsigned int head, uint32_t x,
+				 uint32_t y)
 {
-	size_t i;
+	mutex_lock(&gpu->mode_lock);
+	if (!head) {
+		gpu->cursor_hotspot_x = x;
+		gpu->cursor_hotspot_y = y;
+	}
+	gray_gpu_write_reg(gpu, REG_HEAD(head, REG_CURSOR_HOTSPOT_X), x);
+	gray_gpu_write_reg(gpu, REG_HEAD(head, REG_CURSOR_HOTSPOT_Y), y);
+	mutex_unlock(&gpu->mode_lock);
+}
 
-	if(size > 64 * 64){
+/* Stage a packed width x height image in VRAM and latch it with one write */
+static int gray_gpu_upload_cursor(struct gray_gpu_device *gpu, const uint32_t *cursor_data,
+				  uint32_t width, uint32_t height)
+{
+	if(!width || !height || width > GRAY_GPU_CURSOR_SIZE || height > GRAY_GPU_CURSOR_SIZE){
 		dev_err(&gpu->pdev->dev, "Cursor data too large (max 64x64 pixels)\n");
 		return -EINVAL;
 	}
 
-	/* Upload cursor data pixel by pixel */
-	for (i = 0; i < size; i++) {
-		gray_gpu_write_reg(gpu, REG_CURSOR_UPLOAD, cursor_data[i]);
+	mutex_lock(&gpu->cursor_lock);
+	memcpy_toio(gpu->vram + gpu->cursor_offset, cursor_data, width * height * 4);
+	gray_gpu_write_reg(gpu, REG_CURSOR_BASE, gpu->cursor_offset);
+	gray_gpu_write_reg(gpu, REG_CURSOR_COMMIT, (height << 16) | width);
+	gpu->cursor_width = width;
+	gpu->cursor_height = height;
+	mutex_unlock(&gpu->cursor_lock);
+
+	return 0;
+}
+
+/* Latch a packed image that already sits in VRAM, e.g. a cursor plane buffer */
+void gray_gpu_commit_cursor(struct gray_gpu_device *gpu, unsigned int head, uint32_t offset,
+			    uint32_t width, uint32_t height)
+{
+	mutex_lock(&gpu->cursor_lock);
+	gray_gpu_write_reg(gpu, REG_HEAD(head, REG_CURSOR_BASE), offset);
+	gray_gpu_write_reg(gpu, REG_HEAD(head, REG_CURSOR_COMMIT), (height << 16) | width);
+	if (!head) {
+		gpu->cursor_width = width;
+		gpu->cursor_height = height;
+	}
+	mutex_unlock(&gpu->cursor_lock);
+}
+
+/*
+ * Point an overlay of head 0 at a buffer object and latch it, or hide it.
+ * The overlay holds a reference on its source until it is replaced.
+ */
+static int gray_gpu_set_overlay(struct gray_gpu_file *gfile, void __user *uarg)
+{
+	struct gray_gpu_device *gpu = gfile->gpu;
+	struct {
+		uint32_t index;
+		uint32_t flags;		/* GRAY_GPU_OVERLAY_* */
+		uint32_t handle;	/* buffer object holding the source */
+		uint32_t offset;	/* of the first source pixel in the object */
+		uint32_t pitch;		/* bytes */
+		uint32_t format;	/* OVERLAY_FORMAT_* */
+		uint32_t src_width;
+		uint32_t src_height;
+		int32_t dst_x;		/* may be partly off screen */
+		int32_t dst_y;
+		uint32_t dst_width;	/* the source is scaled to this size */
+		uint32_t dst_height;
+		uint32_t zpos;		/* higher on top, the cursor stays above all */
+		uint32_t pad;
+	} req;
+	struct gray_gpu_bo *bo = NULL, *old;
+
+	if (copy_from_user(&req, uarg, sizeof(req)))
+		return -EFAULT;
+	if (req.index >= gpu->num_overlays || req.flags & ~GRAY_GPU_OVERLAY_FLAGS)
+		return -EINVAL;
+
+	if (req.flags & GRAY_GPU_OVERLAY_ENABLE) {
+		if (req.format != OVERLAY_FORMAT_XRGB8888 && req.format != OVERLAY_FORMAT_ARGB8888)
+			return -EINVAL;
+		if (!req.src_width || !req.src_height || !req.dst_width || !req.dst_height ||
+		    req.src_width > U16_MAX || req.src_height > U16_MAX ||
+		    req.dst_width > U16_MAX || req.dst_height > U16_MAX ||
+		    req.dst_x < S16_MIN || req.dst_x > S16_MAX ||
+		    req.dst_y < S16_MIN || req.dst_y > S16_MAX)
+			return -EINVAL;
+		if ((req.offset | req.pitch) & 3 || req.pitch < req.src_width * 4)
+			return -EINVAL;
+
+		bo = gray_gpu_bo_get(gfile, req.handle);
+		if (!bo)
+			return -ENOENT;
+		if ((u64)req.offset + (u64)(req.src_height - 1) * req.pitch +
+		    req.src_width * 4 > bo->size) {
+			gray_gpu_bo_put(bo);
+			return -EINVAL;
+		}
+	}
+
+	mutex_lock(&gpu->mode_lock);
+	if (bo) {
+		gray_gpu_write_reg(gpu, REG_OVERLAY(req.index, OVL_ADDR), bo->offset + req.offset);
+		gray_gpu_write_reg(gpu, REG_OVERLAY(req.index, OVL_PITCH), req.pitch);
+		gray_gpu_write_reg(gpu, REG_OVERLAY(req.index, OVL_FORMAT), req.format);
+		gray_gpu_write_reg(gpu, REG_OVERLAY(req.index, OVL_SRC_SIZE),
+				   (req.src_height << 16) | req.src_width);
+		gray_gpu_write_reg(gpu, REG_OVERLAY(req.index, OVL_DST_POS),
+				   ((u32)(u16)req.dst_y << 16) | (u16)req.dst_x);
+		gray_gpu_write_reg(gpu, REG_OVERLAY(req.index, OVL_DST_SIZE),
+				   (req.dst_height << 16) | req.dst_width);
+		gray_gpu_write_reg(gpu, REG_OVERLAY(req.index, OVL_ZPOS), req.zpos);
 	}
+	gray_gpu_write_reg(gpu, REG_OVERLAY(req.index, OVL_ENABLE), bo ? 1 : 0);
+	gray_gpu_write_reg(gpu, REG_OVERLAY_COMMIT, BIT(req.index));
+
+	/* The device latched the new source at once, nothing reads the old one */
+	old = gpu->overlay_bo[req.index];
+	gpu->overlay_bo[req.index] = bo;
+	mutex_unlock(&gpu->mode_lock);
+
+	gray_gpu_bo_put(old);
 	return 0;
 }
 
 static int gray_gpu_setup_multi_framebuffer(struct gray_gpu_device *gpu, uint32_t fb_count, uint32_t width, uint32_t height, uint32_t bpp)
 {
-	uint32_t fb_size;
+	struct gray_gpu_bo *stale = NULL;
+	uint32_t pitch, fb_size;
+	unsigned long flags;
+	int ret;
+
 	if(fb_count > 4){
 		dev_err(&gpu->pdev->dev, "Maximum 4 framebuffer supported\n");
 		return -EINVAL;
 	}
 
-	fb_size = width * height * (bpp / 8);
+	if(check_mul_overflow(width, bpp / 8, &pitch) || check_mul_overflow(pitch, height, &fb_size)){
+		return -EINVAL;
+	}
 
-	if(fb_size * fb_count > gpu->vram_size){
+	if((u64)fb_size * fb_count > gpu->vram_usable){
 		dev_err(&gpu->pdev->dev, "Not enough VRAM for %d framebuffer\n", fb_count);
 		return -EINVAL;
 	}
 
-	gpu->fb_width = width;
-	gpu->fb_height = height;
-	gpu->fb_bpp = bpp;
-	gpu->fb_size = fb_size;
+	mutex_lock(&gpu->mode_lock);
+	mutex_lock(&gpu->vram_lock);
+	ret = gray_gpu_reserve_legacy(gpu, fb_size * fb_count);
+	mutex_unlock(&gpu->vram_lock);
+	if(ret){
+		mutex_unlock(&gpu->mode_lock);
+		dev_err(&gpu->pdev->dev, "Framebuffers overlap buffer objects\n");
+		return ret;
+	}
+
+	gray_gpu_store_mode(gpu, width, height, bpp, pitch);
+
+	/*
+	 * Queued indices refer to the old layout, and the armed flip is
+	 * forgotten. The device may still latch its buffer until the layout
+	 * below is programmed, so that reference is dropped only afterwards.
+	 */
+	spin_lock_irqsave(&gpu->lock, flags);
 	gpu->fb_count = fb_count;
 	gpu->fb_current = 0;
 	gpu->fb_next = 0;
+	if(gpu->flip_pending){
+		stale = gpu->armed_bo;
+		gpu->armed_bo = NULL;
+		gray_gpu_fence_signal(&gpu->armed_done, -ECANCELED);
+	}
 	gpu->flip_pending = 0;
+	while(gpu->flip_q_head != gpu->flip_q_tail){
+		gray_gpu_flip_cancel(&gpu->flip_queue[gpu->flip_q_head % GRAY_GPU_FLIP_QUEUE_LEN],
+				     -ECANCELED);
+		gpu->flip_q_head++;
+	}
+	gray_gpu_kick_ready_flips(gpu);
+	spin_unlock_irqrestore(&gpu->lock, flags);
+	wake_up_all(&gpu->flip_wq);
 
 	{
 		int i;
@@ -208,6 +790,8 @@ static int gray_gpu_setup_multi_framebuffer(struct gray_gpu_device *gpu, uint32_
 	gray_gpu_write_reg(gpu, REG_FB_PITCH, gpu->fb_pitch);
 	gray_gpu_write_reg(gpu, REG_FB_COUNT, fb_count);
 	gray_gpu_write_reg(gpu, REG_FB_ADDR, gpu->fb_addresses[0]); /* Start with first buffer */
+	mutex_unlock(&gpu->mode_lock);
+	gray_gpu_bo_put(stale);
     
 	 dev_info(&gpu->pdev->dev, "Setup %d framebuffers: %dx%d@%dbpp, each %d bytes\n",
 		fb_count, width, height, bpp, fb_size);
@@ -215,120 +799,1765 @@ static int gray_gpu_setup_multi_framebuffer(struct gray_gpu_device *gpu, uint32_
 	return 0;
 }
 
-static int gray_gpu_page_flip(struct gray_gpu_device *gpu, uint32_t fb_index, uint32_t wait_vblank)
+/* No flip armed in the device and none waiting in the queue */
+static bool gray_gpu_flips_idle(struct gray_gpu_device *gpu)
 {
-	if (fb_index >= gpu->fb_count) {
-		dev_err(&gpu->pdev->dev, "Invalid framebuffer index: %d\n", fb_index);
-		return -EINVAL;
-	}
-    
-	 if (gpu->flip_pending) {
-		dev_warn(&gpu->pdev->dev, "Page flip already pending\n");
-		return -EBUSY;
-	}
-    
-	/* Set next framebuffer */
-	gpu->fb_next = fb_index;
-	gray_gpu_write_reg(gpu, REG_FB_NEXT, fb_index);
-    
-	/* Trigger page flip */
-	 gray_gpu_write_reg(gpu, REG_PAGE_FLIP, 1);
-    
-	/* Check if flip completed immediately */
-	gpu->flip_pending = gray_gpu_read_reg(gpu, REG_FLIP_PENDING);
-	 if (!gpu->flip_pending) {
-		gpu->fb_current = fb_index;
-		gpu->vblank_count = gray_gpu_read_reg(gpu, REG_VBLANK_COUNT);
-	}
-    
-	dev_dbg(&gpu->pdev->dev, "Page flip to framebuffer %d %s\n", 
-		fb_index, gpu->flip_pending ? "pending" : "completed");
-            
-	return 0;
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	idle = !gpu->flip_pending && !gpu->ring_flip_seq && gpu->flip_q_head == gpu->flip_q_tail;
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	return idle;
 }
 
 static int gray_gpu_wait_flip(struct gray_gpu_device *gpu)
 {
-	int timeout = 100; /* 100ms timeout */
-    
-	while (gpu->flip_pending && timeout > 0) {
-		gpu->flip_pending = gray_gpu_read_reg(gpu, REG_FLIP_PENDING);
-		if (!gpu->flip_pending) {
-			gpu->fb_current = gray_gpu_read_reg(gpu, REG_FB_CURRENT);
-			gpu->vblank_count = gray_gpu_read_reg(gpu, REG_VBLANK_COUNT);
-			break;
-		}
-		msleep(1);
-		timeout--;
-	}
-    
-	if (gpu->flip_pending) {
+	long ret;
+
+	/* Woken by the flip-done interrupt, every queued flip takes one vblank */
+	ret = wait_event_interruptible_timeout(gpu->flip_wq, gray_gpu_flips_idle(gpu),
+					       msecs_to_jiffies(GRAY_GPU_FLIP_TIMEOUT_MS *
+								(GRAY_GPU_FLIP_QUEUE_LEN + 1)));
+	if (ret < 0)
+		return ret;
+
+	if (ret == 0) {
 		dev_err(&gpu->pdev->dev, "Page flip timeout\n");
 		return -ETIMEDOUT;
 	}
-    
+
 	return 0;
 }
 
-static void gray_gpu_get_fb_info(struct gray_gpu_device *gpu, void *info_struct)
+/* The device scans out the target of flip; gpu->lock held */
+static bool gray_gpu_on_screen(struct gray_gpu_device *gpu, const struct gray_gpu_flip *flip)
 {
-	struct {
-		uint32_t fb_count;
-		uint32_t current_fb;
-		uint32_t fb_size;
-		uint32_t fb_offsets[4];
-	} *fb_info = info_struct;
-	    
-	fb_info->fb_count = gpu->fb_count;
-	fb_info->current_fb = gpu->fb_current;
-	fb_info->fb_size = gpu->fb_size;
-	    
-	for (int i = 0; i < 4; i++) {
-		fb_info->fb_offsets[i] = (i < gpu->fb_count) ? gpu->fb_addresses[i] : 0;
+	if (gray_gpu_read_reg(gpu, REG_FB_CURRENT) != flip->fb_index)
+		return false;
+
+	return !flip->bo || gray_gpu_read_reg(gpu, REG_FB_ADDR) == flip->addr;
+}
+
+/*
+ * Arm a flip in the device, latched at its next vblank; gpu->lock held.
+ * Writing REG_FB_NEXT while a flip is still armed retargets that flip.
+ * Takes over the flip's buffer object and fence references.
+ *
+ * Not while a ring batch flips (ring_flip_seq): the flip state already
+ * describes that batch, but the device may not have armed it yet, so a
+ * retarget here would be overwritten. Such flips wait in the queue.
+ */
+static void gray_gpu_arm_flip(struct gray_gpu_device *gpu, const struct gray_gpu_flip *flip)
+{
+	bool same, new_latched = false;
+
+	if (flip->bo)
+		gray_gpu_write_reg(gpu, REG_FB_NEXT_ADDR, flip->addr);
+	else
+		gray_gpu_write_reg(gpu, REG_FB_NEXT, flip->fb_index);
+
+	if (gpu->flip_pending) {
+		/*
+		 * Still pending after the retarget: the old target never reached
+		 * the screen. Otherwise a vblank latched either the old target,
+		 * before the retarget, or already the new one after it; what is
+		 * scanned out now tells which. Its flip-done irq finds the flip
+		 * state updated.
+		 */
+		same = gpu->fb_next == flip->fb_index &&
+		       (!flip->bo || gpu->armed_addr == flip->addr);
+		if (gray_gpu_read_reg(gpu, REG_FLIP_PENDING)) {
+			gray_gpu_bo_put(gpu->armed_bo);
+			gray_gpu_fence_signal(&gpu->armed_done, -ECANCELED);
+		} else if (!same && gray_gpu_on_screen(gpu, flip)) {
+			gray_gpu_bo_put(gpu->armed_bo);
+			gray_gpu_fence_signal(&gpu->armed_done, -ECANCELED);
+			new_latched = true;
+		} else {
+			gray_gpu_flip_latched(gpu);
+		}
+	}
+
+	gpu->armed_bo = flip->bo;
+	gpu->armed_done = flip->done;
+	gpu->armed_addr = flip->addr;
+	gpu->fb_next = flip->fb_index;
+	if (new_latched) {
+		gray_gpu_flip_latched(gpu);
+		gpu->flip_pending = 0;
+		return;
 	}
+	gpu->flip_pending = 1;
+	gray_gpu_write_reg(gpu, REG_PAGE_FLIP, 1);
 }
 
-static int gray_gpu_open(struct inode *inode, struct file *file)
+static bool gray_gpu_flip_queue_full(struct gray_gpu_device *gpu)
 {
-	file->private_data = gray_gpu_dev;
-	return 0;
+	unsigned long flags;
+	bool full;
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	full = gpu->flip_q_tail - gpu->flip_q_head >= GRAY_GPU_FLIP_QUEUE_LEN;
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	return full;
 }
 
-static int gray_gpu_release(struct inode *inode, struct file *file)
+/* The target exists and covers the current mode; gpu->lock held */
+static bool gray_gpu_flip_valid(struct gray_gpu_device *gpu, const struct gray_gpu_flip *flip)
 {
-	return 0;
+	if (flip->bo)
+		return flip->bo->size >= (u64)gpu->fb_pitch * gpu->fb_height;
+
+	if (flip->fb_index >= gpu->fb_count) {
+		dev_err(&gpu->pdev->dev, "Invalid framebuffer index: %d\n", flip->fb_index);
+		return false;
+	}
+	return true;
 }
 
-static long gray_gpu_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+/*
+ * Queue a flip behind the armed one; gpu->lock held. With replace, the
+ * newest queued flip gives way to it instead, so it never fails.
+ */
+static int gray_gpu_queue_flip(struct gray_gpu_device *gpu, const struct gray_gpu_flip *flip,
+			       bool replace)
 {
-    struct gray_gpu_device *gpu = file->private_data;
-    
-    switch (cmd) {
-    case 0x1000: /* Setup framebuffer */
-        {
-            uint32_t params[3];
-            if (copy_from_user(params, (void __user *)arg, sizeof(params))) {
-                return -EFAULT;
-            }
+	struct gray_gpu_flip *last;
 
-            return gray_gpu_setup_framebuffer(gpu, params[0], params[1], params[2]);
-        }
-    case 0x1001: /* Enable display */
-        gray_gpu_enable_display(gpu, arg != 0);
-        return 0;
-    case 0x1002: /* Get VRAM size */
-        return put_user(gpu->vram_size, (uint32_t __user *)arg);
-    case 0x1003: //Set cursor position
-	{
-		uint32_t params[2];
-		if(copy_from_user(params, (void __user *)arg, sizeof(params))){
-			return -EFAULT;
-		}
-		gray_gpu_set_cursor_position(gpu, params[0], params[1]);
+	if (replace && gpu->flip_q_head != gpu->flip_q_tail) {
+		last = &gpu->flip_queue[(gpu->flip_q_tail - 1) % GRAY_GPU_FLIP_QUEUE_LEN];
+		gray_gpu_flip_cancel(last, -ECANCELED);
+		*last = *flip;
+		return 0;
+	}
+	if (gpu->flip_q_tail - gpu->flip_q_head >= GRAY_GPU_FLIP_QUEUE_LEN)
+		return -EAGAIN;
+
+	gpu->flip_queue[gpu->flip_q_tail % GRAY_GPU_FLIP_QUEUE_LEN] = *flip;
+	gpu->flip_q_tail++;
+	return 0;
+}
+
+/*
+ * Arm or queue a flip; gpu->lock held. Takes over the flip's references
+ * on success, -EAGAIN (queue full) and -EINVAL leave them with the caller.
+ * Behind a ring flip, a mailbox flip takes the single queue slot.
+ */
+static int gray_gpu_page_flip_locked(struct gray_gpu_device *gpu, struct gray_gpu_flip *flip)
+{
+	bool mailbox = gpu->present_mode == GRAY_GPU_PRESENT_MAILBOX;
+
+	if (!gray_gpu_flip_valid(gpu, flip))
+		return -EINVAL;
+
+	if (!gpu->ring_flip_seq && (!gpu->flip_pending || mailbox)) {
+		gray_gpu_arm_flip(gpu, flip);
+		return 0;
+	}
+	return gray_gpu_queue_flip(gpu, flip, mailbox);
+}
+
+/*
+ * FIFO: flips are shown in order, one per vblank; a full queue blocks
+ * (or returns -EAGAIN for O_NONBLOCK).
+ * MAILBOX: the newest flip replaces the one not yet latched, never blocks.
+ * Consumes the flip's references, also on error.
+ */
+static int gray_gpu_page_flip(struct gray_gpu_device *gpu, struct gray_gpu_flip *flip,
+			      uint32_t wait_vblank, bool nonblock)
+{
+	unsigned long flags;
+	int ret;
+
+	for (;;) {
+		spin_lock_irqsave(&gpu->lock, flags);
+		/* Checked each time round, the geometry may change while we sleep */
+		ret = gray_gpu_page_flip_locked(gpu, flip);
+		if (ret != -EAGAIN)
+			break;
+		spin_unlock_irqrestore(&gpu->lock, flags);
+
+		if (nonblock)
+			goto err_cancel;
+
+		ret = wait_event_interruptible(gpu->flip_wq, !gray_gpu_flip_queue_full(gpu));
+		if (ret)
+			goto err_cancel;
+	}
+	spin_unlock_irqrestore(&gpu->lock, flags);
+	if (ret)
+		goto err_cancel;
+
+	dev_dbg(&gpu->pdev->dev, "Page flip to framebuffer %d queued\n", flip->fb_index);
+
+	if (wait_vblank)
+		return gray_gpu_wait_flip(gpu);
+
+	return 0;
+
+err_cancel:
+	gray_gpu_flip_cancel(flip, ret);
+	return ret;
+}
+
+/*
+ * Submit fenced flips whose in-fence is done, in the order they got ready.
+ * This runs on a shared workqueue and must not sleep on the device: with
+ * the FIFO full the rest stays on ready_flips, and whoever frees a slot
+ * kicks ready_work to continue. Each flip is armed or queued under
+ * gpu->lock, so concurrent runs keep the order too.
+ */
+static void gray_gpu_run_ready_flips(struct gray_gpu_device *gpu)
+{
+	struct gray_gpu_fenced_flip *ff;
+	unsigned long flags;
+	int ret;
+
+	for (;;) {
+		spin_lock_irqsave(&gpu->lock, flags);
+		ff = list_first_entry_or_null(&gpu->ready_flips, struct gray_gpu_fenced_flip, link);
+		if (!ff) {
+			spin_unlock_irqrestore(&gpu->lock, flags);
+			return;
+		}
+
+		/* A failed producer fails the flip, rather than showing its garbage */
+		ret = ff->in->error;
+		if (!ret) {
+			ret = gray_gpu_page_flip_locked(gpu, &ff->flip);
+			if (ret == -EAGAIN) {
+				spin_unlock_irqrestore(&gpu->lock, flags);
+				return;
+			}
+		}
+		list_del(&ff->link);
+		if (ret)
+			gray_gpu_flip_cancel(&ff->flip, ret);
+		spin_unlock_irqrestore(&gpu->lock, flags);
+
+		dma_fence_put(ff->in);
+		kfree(ff);
+
+		if (atomic_dec_and_test(&gpu->fenced_flip_count))
+			wake_up_all(&gpu->flip_wq);
+	}
+}
+
+static void gray_gpu_ready_flips_work(struct work_struct *work)
+{
+	gray_gpu_run_ready_flips(container_of(work, struct gray_gpu_device, ready_work));
+}
+
+static void gray_gpu_fenced_flip_work(struct work_struct *work)
+{
+	struct gray_gpu_fenced_flip *ff = container_of(work, struct gray_gpu_fenced_flip, work);
+	struct gray_gpu_device *gpu = ff->gpu;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	list_move_tail(&ff->link, &gpu->ready_flips);
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	gray_gpu_run_ready_flips(gpu);
+}
+
+/* Runs under the in-fence's lock, possibly in irq context */
+static void gray_gpu_fenced_flip_cb(struct dma_fence *fence, struct dma_fence_cb *cb)
+{
+	struct gray_gpu_fenced_flip *ff = container_of(cb, struct gray_gpu_fenced_flip, cb);
+
+	schedule_work(&ff->work);
+}
+
+/*
+ * Flip once an in-fence signals, without blocking the caller. Consumes
+ * the flip's references and the in-fence reference.
+ */
+static int gray_gpu_page_flip_fenced(struct gray_gpu_device *gpu, struct gray_gpu_flip *flip,
+				     struct dma_fence *in, bool nonblock)
+{
+	struct gray_gpu_fenced_flip *ff;
+	unsigned long flags;
+	int ret;
+
+	if (dma_fence_is_signaled(in)) {
+		ret = in->error;
+		dma_fence_put(in);
+		if (ret) {
+			gray_gpu_flip_cancel(flip, ret);
+			return ret;
+		}
+		return gray_gpu_page_flip(gpu, flip, 0, nonblock);
+	}
+
+	ff = kzalloc(sizeof(*ff), GFP_KERNEL);
+	if (!ff) {
+		dma_fence_put(in);
+		gray_gpu_flip_cancel(flip, -ENOMEM);
+		return -ENOMEM;
+	}
+
+	ff->gpu = gpu;
+	ff->flip = *flip;
+	ff->in = in;
+	INIT_WORK(&ff->work, gray_gpu_fenced_flip_work);
+
+	atomic_inc(&gpu->fenced_flip_count);
+	spin_lock_irqsave(&gpu->lock, flags);
+	list_add_tail(&ff->link, &gpu->fenced_flips);
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	/* Already signalled in between: run the work directly */
+	if (dma_fence_add_callback(in, &ff->cb, gray_gpu_fenced_flip_cb))
+		schedule_work(&ff->work);
+
+	return 0;
+}
+
+/*
+ * Fail everything userspace may still be waiting on. Runs with interrupts
+ * still enabled, so fenced flips already scheduled can drain the queue.
+ */
+static void gray_gpu_fini_fences(struct gray_gpu_device *gpu)
+{
+	struct gray_gpu_fenced_flip *ff, *ff_tmp;
+	struct gray_gpu_fence *fence, *tmp;
+	unsigned long flags;
+	LIST_HEAD(parked);
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	list_for_each_entry_safe(ff, ff_tmp, &gpu->fenced_flips, link) {
+		/* Callbacks that already fired have their work queued */
+		if (dma_fence_remove_callback(ff->in, &ff->cb))
+			list_move_tail(&ff->link, &parked);
+	}
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	list_for_each_entry_safe(ff, ff_tmp, &parked, link) {
+		gray_gpu_flip_cancel(&ff->flip, -ENODEV);
+		dma_fence_put(ff->in);
+		kfree(ff);
+		atomic_dec(&gpu->fenced_flip_count);
+	}
+	wait_event(gpu->flip_wq, !atomic_read(&gpu->fenced_flip_count));
+	/* Nothing is ready any more, so nothing can kick it again */
+	cancel_work_sync(&gpu->ready_work);
+
+	spin_lock_irqsave(&gpu->fence_lock, flags);
+	list_for_each_entry_safe(fence, tmp, &gpu->fence_pending, link) {
+		list_del(&fence->link);
+		dma_fence_set_error(&fence->base, -ENODEV);
+		dma_fence_signal_locked(&fence->base);
+		dma_fence_put(&fence->base);
+	}
+	spin_unlock_irqrestore(&gpu->fence_lock, flags);
+}
+
+/* gray_gpu_arm_flip() for heads past 0, which only ever get buffer object flips */
+static void gray_gpu_head_arm_flip(struct gray_gpu_head *h, struct gray_gpu_bo *bo, uint32_t addr)
+{
+	struct gray_gpu_device *gpu = h->gpu;
+
+	gray_gpu_write_reg(gpu, REG_HEAD(h->index, REG_FB_NEXT_ADDR), addr);
+
+	if (h->flip_pending) {
+		if (gray_gpu_read_reg(gpu, REG_HEAD(h->index, REG_FLIP_PENDING))) {
+			gray_gpu_bo_put(h->armed_bo);
+		} else {
+			gray_gpu_bo_put(h->scanout_bo);
+			h->scanout_bo = h->armed_bo;
+		}
+	}
+
+	h->armed_bo = bo;
+	h->flip_pending = 1;
+	gray_gpu_write_reg(gpu, REG_HEAD(h->index, REG_PAGE_FLIP), 1);
+}
+
+/* Mailbox flip for the KMS front end: retarget anything armed, never queue */
+void gray_gpu_flip_now(struct gray_gpu_device *gpu, unsigned int head, struct gray_gpu_bo *bo,
+		       uint32_t addr)
+{
+	struct gray_gpu_flip flip = { .fb_index = GRAY_GPU_FB_INDEX_BO, .bo = bo, .addr = addr };
+	unsigned long flags;
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	if (head)
+		gray_gpu_head_arm_flip(&gpu->heads[head], bo, addr);
+	else if (gpu->ring_flip_seq)
+		gray_gpu_queue_flip(gpu, &flip, true);
+	else
+		gray_gpu_arm_flip(gpu, &flip);
+	spin_unlock_irqrestore(&gpu->lock, flags);
+}
+
+static int gray_gpu_set_present_mode(struct gray_gpu_device *gpu, uint32_t mode)
+{
+	unsigned long flags;
+
+	if (mode != GRAY_GPU_PRESENT_FIFO && mode != GRAY_GPU_PRESENT_MAILBOX)
+		return -EINVAL;
+
+	/*
+	 * A mailbox flip retargets the armed flip and would jump ahead of
+	 * anything still queued, so switching to mailbox cancels the queue.
+	 */
+	spin_lock_irqsave(&gpu->lock, flags);
+	gpu->present_mode = mode;
+	if (mode == GRAY_GPU_PRESENT_MAILBOX) {
+		while (gpu->flip_q_head != gpu->flip_q_tail) {
+			gray_gpu_flip_cancel(&gpu->flip_queue[gpu->flip_q_head % GRAY_GPU_FLIP_QUEUE_LEN],
+					     -ECANCELED);
+			gpu->flip_q_head++;
+		}
+		gray_gpu_kick_ready_flips(gpu);
+	}
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	/* Blocked FIFO submitters see the room and go the mailbox way */
+	wake_up_all(&gpu->flip_wq);
+
+	return 0;
+}
+
+/* Queue an event for every client that asked for it; gpu->lock held */
+static void gray_gpu_send_event(struct gray_gpu_device *gpu, uint32_t type, uint32_t fb_index)
+{
+	struct gray_gpu_file *gfile;
+	struct gray_gpu_event ev = {
+		.type = type,
+		.fb_index = fb_index,
+		.sequence = gpu->vblank_count,
+		.timestamp_ns = ktime_get_ns(),
+	};
+
+	list_for_each_entry(gfile, &gpu->clients, link) {
+		if (!(gfile->event_mask & type))
+			continue;
+
+		/* A client that stopped reading loses new events, not old ones */
+		if (gfile->ev_tail - gfile->ev_head >= GRAY_GPU_EVENT_QUEUE_LEN) {
+			gfile->ev_dropped++;
+			continue;
+		}
+
+		gfile->events[gfile->ev_tail % GRAY_GPU_EVENT_QUEUE_LEN] = ev;
+		gfile->ev_tail++;
+		wake_up_interruptible(&gfile->event_wq);
+		if (gfile->eventfd)
+			eventfd_signal(gfile->eventfd);
+	}
+}
+
+/*
+ * gray_kms_fini() clears gpu->kms and then waits for the handlers, so
+ * each one reads it once and uses that copy throughout.
+ */
+static void gray_gpu_handle_vblank(struct gray_gpu_device *gpu)
+{
+	struct gray_kms *kms = READ_ONCE(gpu->kms);
+
+	spin_lock(&gpu->lock);
+	gpu->vblank_count = gray_gpu_read_reg(gpu, REG_VBLANK_COUNT);
+	gray_gpu_send_event(gpu, GRAY_GPU_EVENT_VBLANK, gpu->fb_current);
+	spin_unlock(&gpu->lock);
+
+	if (kms)
+		gray_kms_vblank(kms, 0);
+}
+
+/* Catch up with the device's flip state; gpu->lock held, returns true if idle */
+static bool gray_gpu_update_flips(struct gray_gpu_device *gpu)
+{
+	u32 hw_pending;
+
+	gpu->fb_current = gray_gpu_read_reg(gpu, REG_FB_CURRENT);
+	gpu->vblank_count = gray_gpu_read_reg(gpu, REG_VBLANK_COUNT);
+	/* A mailbox flip may have re-armed the device right after the latch */
+	hw_pending = gray_gpu_read_reg(gpu, REG_FLIP_PENDING);
+	if (gpu->flip_pending && !hw_pending)
+		gray_gpu_flip_latched(gpu);
+	gpu->flip_pending = hw_pending;
+	gray_gpu_send_event(gpu, GRAY_GPU_EVENT_FLIP_COMPLETE, gpu->fb_current);
+
+	/* Feed the next queued flip, it will latch on the following vblank */
+	if (!gpu->flip_pending && gpu->flip_q_head != gpu->flip_q_tail) {
+		gray_gpu_arm_flip(gpu, &gpu->flip_queue[gpu->flip_q_head % GRAY_GPU_FLIP_QUEUE_LEN]);
+		gpu->flip_q_head++;
+		gray_gpu_kick_ready_flips(gpu);
+	}
+	return !gpu->flip_pending;
+}
+
+static void gray_gpu_handle_flip_done(struct gray_gpu_device *gpu)
+{
+	struct gray_kms *kms = READ_ONCE(gpu->kms);
+	bool idle;
+
+	spin_lock(&gpu->lock);
+	/* A ring flip may not be armed yet, its fence irq catches up instead */
+	if (gpu->ring_flip_seq) {
+		spin_unlock(&gpu->lock);
+		return;
+	}
+	idle = gray_gpu_update_flips(gpu);
+	spin_unlock(&gpu->lock);
+
+	wake_up_all(&gpu->flip_wq);
+
+	/* Only once nothing newer is armed, or the event would come a frame early */
+	if (kms && idle)
+		gray_kms_flip_done(kms, 0);
+}
+
+/* Heads past 0 only report to the KMS front end */
+static void gray_gpu_handle_head_vblank(struct gray_gpu_head *h)
+{
+	struct gray_kms *kms = READ_ONCE(h->gpu->kms);
+
+	if (kms)
+		gray_kms_vblank(kms, h->index);
+}
+
+static void gray_gpu_handle_head_flip_done(struct gray_gpu_head *h)
+{
+	struct gray_gpu_device *gpu = h->gpu;
+	struct gray_kms *kms = READ_ONCE(gpu->kms);
+	u32 hw_pending;
+
+	spin_lock(&gpu->lock);
+	hw_pending = gray_gpu_read_reg(gpu, REG_HEAD(h->index, REG_FLIP_PENDING));
+	if (h->flip_pending && !hw_pending) {
+		gray_gpu_bo_put(h->scanout_bo);
+		h->scanout_bo = h->armed_bo;
+		h->armed_bo = NULL;
+	}
+	h->flip_pending = hw_pending;
+	spin_unlock(&gpu->lock);
+
+	if (kms && !hw_pending)
+		gray_kms_flip_done(kms, h->index);
+}
+
+static void gray_gpu_handle_cmd_done(struct gray_gpu_device *gpu)
+{
+	u32 seq = gray_gpu_read_reg(gpu, REG_FENCE_COMPLETED);
+	struct gray_kms *kms = READ_ONCE(gpu->kms);
+	struct gray_gpu_fence *fence, *tmp;
+	bool ring_flip = false, idle = false;
+	u64 completed;
+
+	/* The device only has 32 bits of seqno, extend it */
+	spin_lock(&gpu->lock);
+	gpu->fence_completed += (u32)(seq - lower_32_bits(gpu->fence_completed));
+	completed = gpu->fence_completed;
+
+	/* The batch waited for the vblank that latched its flip */
+	if (gpu->ring_flip_seq && completed >= gpu->ring_flip_seq) {
+		gpu->ring_flip_seq = 0;
+		idle = gray_gpu_update_flips(gpu);
+		ring_flip = true;
+	}
+	spin_unlock(&gpu->lock);
+
+	wake_up_all(&gpu->fence_wq);
+	if (ring_flip) {
+		wake_up_all(&gpu->flip_wq);
+		if (kms && idle)
+			gray_kms_flip_done(kms, 0);
+	}
+
+	spin_lock(&gpu->fence_lock);
+	list_for_each_entry_safe(fence, tmp, &gpu->fence_pending, link) {
+		if (fence->base.seqno > completed)
+			break;
+		list_del(&fence->link);
+		dma_fence_signal_locked(&fence->base);
+		dma_fence_put(&fence->base);
+	}
+	spin_unlock(&gpu->fence_lock);
+}
+
+static void gray_gpu_handle_dma_done(struct gray_gpu_device *gpu)
+{
+	spin_lock(&gpu->lock);
+	gpu->dma_status = gray_gpu_read_reg(gpu, REG_DMA_STATUS);
+	gpu->dma_completed = gray_gpu_read_reg(gpu, REG_DMA_COMPLETED);
+	spin_unlock(&gpu->lock);
+
+	wake_up_all(&gpu->dma_wq);
+}
+
+/* MSI-X: one vector per source, no status register to read or ack */
+static irqreturn_t gray_gpu_vblank_irq(int irq, void *data)
+{
+	gray_gpu_handle_vblank(data);
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t gray_gpu_flip_irq(int irq, void *data)
+{
+	gray_gpu_handle_flip_done(data);
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t gray_gpu_cmd_irq(int irq, void *data)
+{
+	gray_gpu_handle_cmd_done(data);
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t gray_gpu_dma_irq(int irq, void *data)
+{
+	gray_gpu_handle_dma_done(data);
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t gray_gpu_head_vblank_irq(int irq, void *data)
+{
+	gray_gpu_handle_head_vblank(data);
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t gray_gpu_head_flip_irq(int irq, void *data)
+{
+	gray_gpu_handle_head_flip_done(data);
+	return IRQ_HANDLED;
+}
+
+/* INTx fallback: shared line, demultiplex through REG_IRQ_STATUS */
+static irqreturn_t gray_gpu_irq_handler(int irq, void *data)
+{
+	struct gray_gpu_device *gpu = data;
+	unsigned int i;
+	u32 status;
+
+	status = gray_gpu_read_reg(gpu, REG_IRQ_STATUS) & gpu->irq_enable;
+	if (!status)
+		return IRQ_NONE;
+
+	/* Acknowledge before handling so a new event is not lost */
+	gray_gpu_write_reg(gpu, REG_IRQ_STATUS, status);
+
+	if (status & IRQ_VBLANK)
+		gray_gpu_handle_vblank(gpu);
+
+	if (status & IRQ_FLIP_DONE)
+		gray_gpu_handle_flip_done(gpu);
+
+	if (status & IRQ_CMD_DONE)
+		gray_gpu_handle_cmd_done(gpu);
+
+	if (status & IRQ_DMA_DONE)
+		gray_gpu_handle_dma_done(gpu);
+
+	for (i = 1; i < gpu->num_heads; i++) {
+		if (status & IRQ_HEAD_VBLANK(i))
+			gray_gpu_handle_head_vblank(&gpu->heads[i]);
+		if (status & IRQ_HEAD_FLIP_DONE(i))
+			gray_gpu_handle_head_flip_done(&gpu->heads[i]);
+	}
+
+	return IRQ_HANDLED;
+}
+
+static void gray_gpu_set_irq_enable(struct gray_gpu_device *gpu, u32 mask)
+{
+	gpu->irq_enable = mask;
+	gray_gpu_write_reg(gpu, REG_IRQ_ENABLE, mask);
+}
+
+/* Wait for running handlers, e.g. after taking away something they look at */
+void gray_gpu_sync_irqs(struct gray_gpu_device *gpu)
+{
+	unsigned int i;
+
+	for (i = 0; i < gpu->num_vectors; i++)
+		synchronize_irq(pci_irq_vector(gpu->pdev, i));
+}
+
+static int gray_gpu_init_irq(struct gray_gpu_device *gpu)
+{
+	struct pci_dev *pdev = gpu->pdev;
+	int want = GRAY_GPU_NUM_VECTORS(gpu->num_heads);
+	u32 mask = IRQ_FLIP_DONE | IRQ_CMD_DONE | IRQ_DMA_DONE;
+	unsigned int i;
+	int nvec, ret;
+
+	/* MSI-X writes are bus master DMA */
+	pci_set_master(pdev);
+
+	nvec = pci_alloc_irq_vectors(pdev, want, want, PCI_IRQ_MSIX);
+	if (nvec == want) {
+		ret = devm_request_irq(&pdev->dev, pci_irq_vector(pdev, GRAY_GPU_VECTOR_VBLANK),
+				       gray_gpu_vblank_irq, 0, "gray-gpu-vblank", gpu);
+		if (!ret)
+			ret = devm_request_irq(&pdev->dev, pci_irq_vector(pdev, GRAY_GPU_VECTOR_FLIP),
+					       gray_gpu_flip_irq, 0, "gray-gpu-flip", gpu);
+		if (!ret)
+			ret = devm_request_irq(&pdev->dev, pci_irq_vector(pdev, GRAY_GPU_VECTOR_CMD),
+					       gray_gpu_cmd_irq, 0, "gray-gpu-cmd", gpu);
+		if (!ret)
+			ret = devm_request_irq(&pdev->dev, pci_irq_vector(pdev, GRAY_GPU_VECTOR_DMA),
+					       gray_gpu_dma_irq, 0, "gray-gpu-dma", gpu);
+		for (i = 1; !ret && i < gpu->num_heads; i++) {
+			ret = devm_request_irq(&pdev->dev,
+					       pci_irq_vector(pdev, GRAY_GPU_VECTOR_HEAD_VBLANK(i)),
+					       gray_gpu_head_vblank_irq, 0, "gray-gpu-vblank",
+					       &gpu->heads[i]);
+			if (!ret)
+				ret = devm_request_irq(&pdev->dev,
+						       pci_irq_vector(pdev, GRAY_GPU_VECTOR_HEAD_FLIP(i)),
+						       gray_gpu_head_flip_irq, 0, "gray-gpu-flip",
+						       &gpu->heads[i]);
+		}
+		if (ret) {
+			dev_err(&pdev->dev, "Failed to request MSI-X vectors\n");
+			return ret;
+		}
+		dev_info(&pdev->dev, "Using %d MSI-X vectors\n", nvec);
+	} else {
+		nvec = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_INTX);
+		if (nvec < 0) {
+			dev_err(&pdev->dev, "No usable interrupt\n");
+			return nvec;
+		}
+
+		ret = devm_request_irq(&pdev->dev, pci_irq_vector(pdev, 0), gray_gpu_irq_handler,
+				       IRQF_SHARED, DRIVER_NAME, gpu);
+		if (ret) {
+			dev_err(&pdev->dev, "Failed to request irq %d\n", pci_irq_vector(pdev, 0));
+			return ret;
+		}
+		dev_info(&pdev->dev, "MSI-X unavailable, using legacy INTx\n");
+	}
+	gpu->num_vectors = nvec;
+
+	/* Vblank interrupts stay off until someone needs them */
+	for (i = 1; i < gpu->num_heads; i++)
+		mask |= IRQ_HEAD_FLIP_DONE(i);
+	gray_gpu_set_irq_enable(gpu, mask);
+
+	return 0;
+}
+
+static void gray_gpu_init_ring(struct gray_gpu_device *gpu)
+{
+	gpu->ring_context = dma_fence_context_alloc(1);
+
+	gpu->ring_offset = gpu->vram_size - GRAY_GPU_RING_SIZE;
+	gpu->ring = gpu->vram + gpu->ring_offset;
+	gpu->vram_usable = gpu->ring_offset;
+	gpu->ring_head = 0;
+	gpu->ring_tail = 0;
+	gpu->fence_seqno = 0;
+	gpu->fence_completed = 0;
+
+	gray_gpu_write_reg(gpu, REG_RING_BASE, gpu->ring_offset);
+	gray_gpu_write_reg(gpu, REG_RING_SIZE, GRAY_GPU_RING_SIZE);
+
+	/* The cursor staging slot sits right below the ring */
+	gpu->cursor_offset = gpu->ring_offset - GRAY_GPU_CURSOR_SLOT;
+	gpu->vram_usable = gpu->cursor_offset;
+	gray_gpu_write_reg(gpu, REG_CURSOR_BASE, gpu->cursor_offset);
+}
+
+static int gray_gpu_init_dma(struct gray_gpu_device *gpu)
+{
+	struct device *dev = &gpu->pdev->dev;
+	int ret;
+
+	ret = dma_set_mask_and_coherent(dev, DMA_BIT_MASK(64));
+	if (ret) {
+		dev_err(dev, "No usable DMA configuration\n");
+		return ret;
+	}
+
+	gpu->dma_desc = dmam_alloc_coherent(dev, GRAY_GPU_DMA_MAX_DESC * sizeof(*gpu->dma_desc),
+					    &gpu->dma_desc_addr, GFP_KERNEL);
+	if (!gpu->dma_desc)
+		return -ENOMEM;
+
+	gpu->dma_cookie = 0;
+	gpu->dma_completed = 0;
+	gpu->dma_status = 0;
+
+	gray_gpu_write_reg(gpu, REG_DMA_DESC_LO, lower_32_bits(gpu->dma_desc_addr));
+	gray_gpu_write_reg(gpu, REG_DMA_DESC_HI, upper_32_bits(gpu->dma_desc_addr));
+
+	return 0;
+}
+
+static bool gray_gpu_dma_done(struct gray_gpu_device *gpu, u32 cookie)
+{
+	unsigned long flags;
+	bool done;
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	done = gpu->dma_completed == cookie;
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	return done;
+}
+
+/*
+ * Run the first count descriptors and wait for them. The wait cannot be
+ * interrupted: the device may still be writing into the caller's pages.
+ */
+static int gray_gpu_dma_kick(struct gray_gpu_device *gpu, unsigned int count)
+{
+	u32 cookie = ++gpu->dma_cookie;
+
+	gray_gpu_write_reg(gpu, REG_DMA_DESC_COUNT, count);
+	gray_gpu_write_reg(gpu, REG_DMA_START, cookie);
+
+	if (!wait_event_timeout(gpu->dma_wq, gray_gpu_dma_done(gpu, cookie),
+				msecs_to_jiffies(GRAY_GPU_DMA_TIMEOUT_MS))) {
+		/* Abort it so the engine takes the next transfer and leaves our pages alone */
+		dev_err(&gpu->pdev->dev, "DMA transfer %u timed out, resetting the engine\n", cookie);
+		gray_gpu_write_reg(gpu, REG_CONTROL, CTRL_DMA_RESET);
+		return -ETIMEDOUT;
+	}
+
+	return (gpu->dma_status & DMA_STATUS_ERROR) ? -EIO : 0;
+}
+
+/*
+ * Copy a rows x row_bytes rectangle between a user buffer and VRAM. The
+ * user pages are pinned and mapped one by one, and every row is split at
+ * page boundaries; pieces that happen to be contiguous on both sides are
+ * merged, so a packed buffer in contiguous pages is a single descriptor.
+ */
+static int gray_gpu_dma_transfer(struct gray_gpu_device *gpu, unsigned long uaddr,
+				 u32 vram_offset, u32 row_bytes, u32 rows,
+				 u32 user_pitch, u32 vram_pitch, bool to_user)
+{
+	struct device *dev = &gpu->pdev->dev;
+	enum dma_data_direction dir = to_user ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+	u32 desc_flags = to_user ? DMA_DESC_TO_SYSTEM : 0;
+	struct gray_gpu_dma_desc *d = NULL;
+	unsigned long first = uaddr & PAGE_MASK;
+	u64 span, extent;
+	unsigned int npages, mapped = 0, count = 0, i;
+	struct page **pages;
+	dma_addr_t *addrs;
+	int pinned, ret = 0;
+	u32 y;
+
+	if (!row_bytes || !rows)
+		return -EINVAL;
+	if (rows > 1 && (user_pitch < row_bytes || vram_pitch < row_bytes))
+		return -EINVAL;
+
+	extent = (u64)(rows - 1) * vram_pitch + row_bytes;
+	span = (u64)(rows - 1) * user_pitch + row_bytes;
+	if ((u64)vram_offset + extent > gpu->vram_usable || span > gpu->vram_size)
+		return -EINVAL;
+
+	npages = DIV_ROUND_UP((uaddr & ~PAGE_MASK) + span, PAGE_SIZE);
+	pages = kvmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
+	addrs = kvmalloc_array(npages, sizeof(*addrs), GFP_KERNEL);
+	if (!pages || !addrs) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	pinned = pin_user_pages_fast(first, npages, to_user ? FOLL_WRITE : 0, pages);
+	if (pinned != npages) {
+		if (pinned > 0)
+			unpin_user_pages(pages, pinned);
+		ret = pinned < 0 ? pinned : -EFAULT;
+		goto out_free;
+	}
+
+	for (mapped = 0; mapped < npages; mapped++) {
+		addrs[mapped] = dma_map_page(dev, pages[mapped], 0, PAGE_SIZE, dir);
+		if (dma_mapping_error(dev, addrs[mapped])) {
+			ret = -ENOMEM;
+			goto out_unmap;
+		}
+	}
+
+	mutex_lock(&gpu->dma_lock);
+	for (y = 0; y < rows && !ret; y++) {
+		u64 uoff = (uaddr & ~PAGE_MASK) + (u64)y * user_pitch;
+		u32 voff = vram_offset + y * vram_pitch;
+		u32 left = row_bytes;
+
+		while (left && !ret) {
+			u32 in_page = uoff & ~PAGE_MASK;
+			u32 chunk = min_t(u32, left, PAGE_SIZE - in_page);
+			dma_addr_t sys = addrs[uoff >> PAGE_SHIFT] + in_page;
+
+			if (d && le64_to_cpu(d->sys_addr) + le32_to_cpu(d->row_bytes) == sys &&
+			    le32_to_cpu(d->vram_offset) + le32_to_cpu(d->row_bytes) == voff) {
+				le32_add_cpu(&d->row_bytes, chunk);
+			} else {
+				if (count == GRAY_GPU_DMA_MAX_DESC) {
+					ret = gray_gpu_dma_kick(gpu, count);
+					count = 0;
+					if (ret)
+						break;
+				}
+				d = &gpu->dma_desc[count++];
+				d->sys_addr = cpu_to_le64(sys);
+				d->vram_offset = cpu_to_le32(voff);
+				d->row_bytes = cpu_to_le32(chunk);
+				d->rows = cpu_to_le32(1);
+				d->sys_pitch = 0;
+				d->vram_pitch = 0;
+				d->flags = cpu_to_le32(desc_flags);
+			}
+
+			uoff += chunk;
+			voff += chunk;
+			left -= chunk;
+		}
+	}
+	if (!ret && count)
+		ret = gray_gpu_dma_kick(gpu, count);
+	mutex_unlock(&gpu->dma_lock);
+
+out_unmap:
+	for (i = 0; i < mapped; i++)
+		dma_unmap_page(dev, addrs[i], PAGE_SIZE, dir);
+	unpin_user_pages_dirty_lock(pages, npages, to_user);
+out_free:
+	kvfree(addrs);
+	kvfree(pages);
+	return ret;
+}
+
+/*
+ * Registers userspace may program through the ring. Flips only go through
+ * the flip ioctls, which track the flip state and buffer references.
+ */
+static bool gray_gpu_ring_reg_allowed(u32 reg)
+{
+	switch (reg) {
+	case REG_FB_ADDR:
+	case REG_FB_WIDTH:
+	case REG_FB_HEIGHT:
+	case REG_FB_BPP:
+	case REG_FB_ENABLE:
+	case REG_FB_PITCH:
+	case REG_CURSOR_X:
+	case REG_CURSOR_Y:
+	case REG_CURSOR_ENABLE:
+	case REG_CURSOR_HOTSPOT_X:
+	case REG_CURSOR_HOTSPOT_Y:
+	case REG_CURSOR_UPLOAD:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Keep 2D engine rectangles inside framebuffer VRAM, away from the ring */
+static bool gray_gpu_blit_rect_ok(struct gray_gpu_device *gpu, u32 offset, u32 pitch,
+				  u32 width, u32 height)
+{
+	u64 end;
+
+	if (!width || !height || (offset | pitch) & 3 || (u64)width * 4 > pitch)
+		return false;
+
+	end = offset + (u64)(height - 1) * pitch + (u64)width * 4;
+	return end <= gpu->vram_usable;
+}
+
+static int gray_gpu_validate_blit(struct gray_gpu_device *gpu, u32 op, const __le32 *p, u32 len)
+{
+	if (op == CMD_FILL) {
+		if (len != 5)
+			return -EINVAL;
+		return gray_gpu_blit_rect_ok(gpu, le32_to_cpu(p[0]), le32_to_cpu(p[1]),
+					     le32_to_cpu(p[2]), le32_to_cpu(p[3])) ? 0 : -EINVAL;
+	}
+
+	if (len != (op == CMD_COPY_KEY ? 7 : 6))
+		return -EINVAL;
+	if (!gray_gpu_blit_rect_ok(gpu, le32_to_cpu(p[0]), le32_to_cpu(p[1]),
+				   le32_to_cpu(p[4]), le32_to_cpu(p[5])) ||
+	    !gray_gpu_blit_rect_ok(gpu, le32_to_cpu(p[2]), le32_to_cpu(p[3]),
+				   le32_to_cpu(p[4]), le32_to_cpu(p[5])))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int gray_gpu_validate_batch(struct gray_gpu_device *gpu, const __le32 *cmds, u32 ndw)
+{
+	u32 i = 0, j;
+
+	while (i < ndw) {
+		u32 hdr = le32_to_cpu(cmds[i]);
+		u32 len = CMD_LENGTH(hdr);
+
+		if (len > ndw - i - 1)
+			return -EINVAL;
+
+		switch (CMD_OPCODE(hdr)) {
+		case CMD_NOP:
+			break;
+		case CMD_SET_REG:
+			if (len % 2)
+				return -EINVAL;
+			for (j = 0; j < len; j += 2) {
+				u32 reg = le32_to_cpu(cmds[i + 1 + j]);
+
+				if (!gray_gpu_ring_reg_allowed(reg)) {
+					dev_dbg(&gpu->pdev->dev, "Ring write to 0x%x rejected\n", reg);
+					return -EPERM;
+				}
+			}
+			break;
+		case CMD_WAIT_VBLANK:
+			break;
+		case CMD_FILL:
+		case CMD_COPY:
+		case CMD_BLEND:
+		case CMD_COPY_KEY:
+		{
+			int ret = gray_gpu_validate_blit(gpu, CMD_OPCODE(hdr), &cmds[i + 1], len);
+
+			if (ret)
+				return ret;
+			break;
+		}
+		default:
+			/* Fences are emitted by the kernel only */
+			return -EINVAL;
+		}
+		i += 1 + len;
+	}
+
+	return 0;
+}
+
+static u32 gray_gpu_ring_space(struct gray_gpu_device *gpu)
+{
+	/* One dword stays unused so head == tail always means empty */
+	return GRAY_GPU_RING_SIZE - 4 -
+		((gpu->ring_tail - gpu->ring_head) & (GRAY_GPU_RING_SIZE - 1));
+}
+
+static bool gray_gpu_ring_has_space(struct gray_gpu_device *gpu, u32 bytes)
+{
+	if (gray_gpu_ring_space(gpu) >= bytes)
+		return true;
+
+	gpu->ring_head = gray_gpu_read_reg(gpu, REG_RING_HEAD);
+	return gray_gpu_ring_space(gpu) >= bytes;
+}
+
+/* Copy dwords to the ring at tail, wrapping at the end; ring_lock held */
+static void gray_gpu_ring_write(struct gray_gpu_device *gpu, const __le32 *dw, u32 count)
+{
+	u32 bytes = count * 4;
+	u32 first = min_t(u32, bytes, GRAY_GPU_RING_SIZE - gpu->ring_tail);
+
+	memcpy_toio(gpu->ring + gpu->ring_tail, dw, first);
+	if (first < bytes)
+		memcpy_toio(gpu->ring, (const u8 *)dw + first, bytes - first);
+
+	gpu->ring_tail = (gpu->ring_tail + bytes) & (GRAY_GPU_RING_SIZE - 1);
+}
+
+/*
+ * Write a validated batch to the ring followed by a fence, with one
+ * doorbell write. Returns the fence seqno that completes with the batch;
+ * if rf is given it is initialised with that seqno and signalled along
+ * with it.
+ *
+ * flip: the batch arms this flip. Needs the flip state idle, -EBUSY
+ * otherwise, and takes over its references on success.
+ */
+static int gray_gpu_ring_submit(struct gray_gpu_device *gpu, const __le32 *cmds, u32 size,
+				const struct gray_gpu_flip *flip, u64 *fence_out,
+				struct gray_gpu_fence *rf)
+{
+	__le32 fence[2];
+	unsigned long flags;
+	long wait;
+	u64 seq;
+	int ret;
+
+	ret = mutex_lock_interruptible(&gpu->ring_lock);
+	if (ret)
+		return ret;
+
+	/* Every batch ends in a fence irq, so waiting on fence_wq makes progress */
+	wait = wait_event_interruptible_timeout(gpu->fence_wq,
+						gray_gpu_ring_has_space(gpu, size + sizeof(fence)),
+						msecs_to_jiffies(GRAY_GPU_FENCE_TIMEOUT_MS));
+	if (wait <= 0) {
+		ret = wait ? wait : -ETIMEDOUT;
+		goto out_unlock;
+	}
+
+	/* Last step that can fail, the ring is untouched until here */
+	if (flip) {
+		spin_lock_irqsave(&gpu->lock, flags);
+		if (gpu->flip_pending || gpu->ring_flip_seq || gpu->flip_q_head != gpu->flip_q_tail) {
+			spin_unlock_irqrestore(&gpu->lock, flags);
+			ret = -EBUSY;
+			goto out_unlock;
+		}
+		gpu->armed_bo = flip->bo;
+		gpu->armed_done = flip->done;
+		gpu->armed_addr = flip->addr;
+		gpu->fb_next = flip->fb_index;
+		gpu->flip_pending = 1;
+		gpu->ring_flip_seq = gpu->fence_seqno + 1;
+		spin_unlock_irqrestore(&gpu->lock, flags);
+	}
+
+	seq = ++gpu->fence_seqno;
+	fence[0] = cpu_to_le32(CMD_HEADER(CMD_FENCE, 1));
+	fence[1] = cpu_to_le32(lower_32_bits(seq));
+
+	gray_gpu_ring_write(gpu, cmds, size / 4);
+	gray_gpu_ring_write(gpu, fence, ARRAY_SIZE(fence));
+
+	/* Queued before the doorbell, so the cmd-done irq cannot miss it */
+	if (rf) {
+		dma_fence_init(&rf->base, &gray_gpu_ring_fence_ops, &gpu->fence_lock,
+			       gpu->ring_context, seq);
+		dma_fence_get(&rf->base);
+		spin_lock_irqsave(&gpu->fence_lock, flags);
+		list_add_tail(&rf->link, &gpu->fence_pending);
+		spin_unlock_irqrestore(&gpu->fence_lock, flags);
+	}
+
+	gray_gpu_write_reg(gpu, REG_RING_DOORBELL, gpu->ring_tail);
+	*fence_out = seq;
+
+out_unlock:
+	mutex_unlock(&gpu->ring_lock);
+	return ret;
+}
+
+/* Submit a batch of ring commands from userspace, see gray_gpu_ring_submit() */
+static int gray_gpu_submit(struct gray_gpu_device *gpu, const void __user *ucmds, u32 size,
+			   u64 *fence_out, struct gray_gpu_fence *rf)
+{
+	__le32 *cmds;
+	int ret;
+
+	if (!size || size % 4 || size > GRAY_GPU_MAX_BATCH)
+		return -EINVAL;
+
+	cmds = memdup_user(ucmds, size);
+	if (IS_ERR(cmds))
+		return PTR_ERR(cmds);
+
+	ret = gray_gpu_validate_batch(gpu, cmds, size / 4);
+	if (!ret)
+		ret = gray_gpu_ring_submit(gpu, cmds, size, NULL, fence_out, rf);
+
+	kfree(cmds);
+	return ret;
+}
+
+static bool gray_gpu_fence_signaled(struct gray_gpu_device *gpu, u64 seq)
+{
+	unsigned long flags;
+	bool done;
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	done = gpu->fence_completed >= seq;
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	return done;
+}
+
+static int gray_gpu_wait_fence(struct gray_gpu_device *gpu, u64 seq, u32 timeout_ms)
+{
+	long ret;
+
+	ret = wait_event_interruptible_timeout(gpu->fence_wq, gray_gpu_fence_signaled(gpu, seq),
+					       msecs_to_jiffies(timeout_ms));
+	if (ret < 0)
+		return ret;
+
+	return ret ? 0 : -ETIMEDOUT;
+}
+
+/*
+ * Wrap a fence in a sync_file behind a reserved fd. Nothing is visible to
+ * userspace before fd_install(), so the caller can still back out.
+ */
+static int gray_gpu_sync_file_reserve(struct dma_fence *fence, struct sync_file **sync)
+{
+	int fd;
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0)
+		return fd;
+
+	*sync = sync_file_create(fence);
+	if (!*sync) {
+		put_unused_fd(fd);
+		return -ENOMEM;
+	}
+
+	return fd;
+}
+
+static void gray_gpu_sync_file_unreserve(int fd, struct sync_file *sync)
+{
+	fput(sync->file);
+	put_unused_fd(fd);
+}
+
+/* Bytes a legacy framebuffer slot can scan out, the last one runs to the reservation end */
+static uint32_t gray_gpu_legacy_slot_size(struct gray_gpu_device *gpu, uint32_t index)
+{
+	uint32_t end = index + 1 < gpu->fb_count ? gpu->fb_addresses[index + 1] : gpu->legacy_size;
+
+	return end - gpu->fb_addresses[index];
+}
+
+/* Properties that map straight onto one register, applied in this order */
+static const struct {
+	uint32_t prop;
+	uint32_t reg;
+} gray_gpu_atomic_regs[] = {
+	{ GRAY_GPU_PROP_CURSOR_X, REG_CURSOR_X },
+	{ GRAY_GPU_PROP_CURSOR_Y, REG_CURSOR_Y },
+	{ GRAY_GPU_PROP_CURSOR_HOTSPOT_X, REG_CURSOR_HOTSPOT_X },
+	{ GRAY_GPU_PROP_CURSOR_HOTSPOT_Y, REG_CURSOR_HOTSPOT_Y },
+	{ GRAY_GPU_PROP_CURSOR_ENABLE, REG_CURSOR_ENABLE },
+	{ GRAY_GPU_PROP_DISPLAY_ENABLE, REG_FB_ENABLE },
+};
+
+/* A parsed atomic commit, see gray_gpu_atomic_commit() */
+struct gray_gpu_atomic {
+	unsigned long set;		/* BIT(GRAY_GPU_PROP_*) given */
+	uint32_t val[GRAY_GPU_PROP_COUNT];
+	struct gray_gpu_flip flip;	/* new scanout, if FB_INDEX or FB_BO is set */
+	bool test_only;
+};
+
+/*
+ * Check a commit against the current state and queue it as one ring batch;
+ * mode_lock held, so nothing it checked can change before it is applied.
+ * Takes over the flip's references unless it fails or only tests.
+ */
+static int gray_gpu_atomic_apply(struct gray_gpu_device *gpu, struct gray_gpu_atomic *st,
+				 u64 *fence_out)
+{
+	const uint32_t *val = st->val;
+	struct gray_gpu_flip *flip = &st->flip;
+	__le32 cmds[GRAY_GPU_ATOMIC_MAX_DW];
+	uint32_t width, height, pitch, size = 0;
+	bool mode, scanout;
+	u32 n = 0, hdr, i;
+	int ret;
+
+	mode = st->set & (BIT(GRAY_GPU_PROP_MODE_WIDTH) | BIT(GRAY_GPU_PROP_MODE_HEIGHT) |
+			  BIT(GRAY_GPU_PROP_MODE_PITCH));
+	scanout = st->set & (BIT(GRAY_GPU_PROP_FB_INDEX) | BIT(GRAY_GPU_PROP_FB_BO));
+
+	/* Unset properties keep their current value */
+	width = test_bit(GRAY_GPU_PROP_MODE_WIDTH, &st->set) ? val[GRAY_GPU_PROP_MODE_WIDTH] : gpu->fb_width;
+	height = test_bit(GRAY_GPU_PROP_MODE_HEIGHT, &st->set) ? val[GRAY_GPU_PROP_MODE_HEIGHT] : gpu->fb_height;
+	if (test_bit(GRAY_GPU_PROP_MODE_PITCH, &st->set))
+		pitch = val[GRAY_GPU_PROP_MODE_PITCH];
+	else if (test_bit(GRAY_GPU_PROP_MODE_WIDTH, &st->set))
+		pitch = width * 4;
+	else
+		pitch = gpu->fb_pitch;
+
+	/* The buffer on screen was only checked against the old mode */
+	if (mode && !scanout)
+		return -EINVAL;
+	if (mode && (!width || !height || pitch % 4 || pitch / 4 < width ||
+		     (u64)pitch * height > gpu->vram_usable))
+		return -EINVAL;
+
+	if (flip->bo) {
+		size = flip->bo->size;
+	} else if (scanout) {
+		if (flip->fb_index >= gpu->fb_count)
+			return -EINVAL;
+		size = gray_gpu_legacy_slot_size(gpu, flip->fb_index);
+	}
+	if (scanout && (u64)pitch * height > size)
+		return -EINVAL;
+
+	/* The hotspot has to fall inside the cursor image loaded now */
+	ret = 0;
+	mutex_lock(&gpu->cursor_lock);
+	if (test_bit(GRAY_GPU_PROP_CURSOR_HOTSPOT_X, &st->set) &&
+	    val[GRAY_GPU_PROP_CURSOR_HOTSPOT_X] >= gpu->cursor_width)
+		ret = -EINVAL;
+	if (test_bit(GRAY_GPU_PROP_CURSOR_HOTSPOT_Y, &st->set) &&
+	    val[GRAY_GPU_PROP_CURSOR_HOTSPOT_Y] >= gpu->cursor_height)
+		ret = -EINVAL;
+	mutex_unlock(&gpu->cursor_lock);
+	if (ret)
+		return ret;
+
+	if (st->test_only)
+		return 0;
+
+	/* Armed right away, latched by the vblank the wait below returns on */
+	if (scanout) {
+		cmds[n++] = cpu_to_le32(CMD_HEADER(CMD_SET_REG, 4));
+		cmds[n++] = cpu_to_le32(flip->bo ? REG_FB_NEXT_ADDR : REG_FB_NEXT);
+		cmds[n++] = cpu_to_le32(flip->bo ? flip->addr : flip->fb_index);
+		cmds[n++] = cpu_to_le32(REG_PAGE_FLIP);
+		cmds[n++] = cpu_to_le32(1);
+	}
+	cmds[n++] = cpu_to_le32(CMD_HEADER(CMD_WAIT_VBLANK, 0));
+
+	hdr = n++;
+	if (mode) {
+		/* The device derives the pitch from width and bpp, so it goes last */
+		cmds[n++] = cpu_to_le32(REG_FB_WIDTH);
+		cmds[n++] = cpu_to_le32(width);
+		cmds[n++] = cpu_to_le32(REG_FB_HEIGHT);
+		cmds[n++] = cpu_to_le32(height);
+		cmds[n++] = cpu_to_le32(REG_FB_BPP);
+		cmds[n++] = cpu_to_le32(32);
+		cmds[n++] = cpu_to_le32(REG_FB_PITCH);
+		cmds[n++] = cpu_to_le32(pitch);
+	}
+	for (i = 0; i < ARRAY_SIZE(gray_gpu_atomic_regs); i++) {
+		if (!test_bit(gray_gpu_atomic_regs[i].prop, &st->set))
+			continue;
+		cmds[n++] = cpu_to_le32(gray_gpu_atomic_regs[i].reg);
+		cmds[n++] = cpu_to_le32(val[gray_gpu_atomic_regs[i].prop]);
+	}
+	if (n == hdr + 1)
+		n = hdr;
+	else
+		cmds[hdr] = cpu_to_le32(CMD_HEADER(CMD_SET_REG, n - hdr - 1));
+
+	ret = gray_gpu_ring_submit(gpu, cmds, n * 4, scanout ? flip : NULL, fence_out, NULL);
+	if (ret)
+		return ret;
+
+	if (mode)
+		gray_gpu_store_mode(gpu, width, height, 32, pitch);
+	if (test_bit(GRAY_GPU_PROP_CURSOR_X, &st->set))
+		gpu->cursor_x = val[GRAY_GPU_PROP_CURSOR_X];
+	if (test_bit(GRAY_GPU_PROP_CURSOR_Y, &st->set))
+		gpu->cursor_y = val[GRAY_GPU_PROP_CURSOR_Y];
+	if (test_bit(GRAY_GPU_PROP_CURSOR_HOTSPOT_X, &st->set))
+		gpu->cursor_hotspot_x = val[GRAY_GPU_PROP_CURSOR_HOTSPOT_X];
+	if (test_bit(GRAY_GPU_PROP_CURSOR_HOTSPOT_Y, &st->set))
+		gpu->cursor_hotspot_y = val[GRAY_GPU_PROP_CURSOR_HOTSPOT_Y];
+	if (test_bit(GRAY_GPU_PROP_CURSOR_ENABLE, &st->set))
+		gpu->cursor_enabled = val[GRAY_GPU_PROP_CURSOR_ENABLE];
+
+	return 0;
+}
+
+/*
+ * Validate a whole property list against the current state, then apply it
+ * as one ring batch. The scanout flip is armed first; the batch then waits
+ * for the vblank that latches it and writes every other register right
+ * after, so the device never scans out a mix of old and new state.
+ */
+static int gray_gpu_atomic_commit(struct gray_gpu_file *gfile, void __user *uarg, bool nonblock)
+{
+	struct gray_gpu_device *gpu = gfile->gpu;
+	struct {
+		uint64_t props;		/* user pointer to (property, value) uint32_t pairs */
+		uint32_t count;
+		uint32_t flags;		/* GRAY_GPU_ATOMIC_* */
+		uint64_t fence;		/* out: completes once applied, see 0x100F */
+	} req;
+	struct gray_gpu_atomic st = { 0 };
+	uint32_t (*props)[2];
+	uint32_t *val = st.val;
+	u32 i;
+	int ret;
+
+	if (copy_from_user(&req, uarg, sizeof(req)))
+		return -EFAULT;
+	if (req.flags & ~GRAY_GPU_ATOMIC_TEST_ONLY || !req.count || req.count > GRAY_GPU_PROP_COUNT)
+		return -EINVAL;
+	st.test_only = req.flags & GRAY_GPU_ATOMIC_TEST_ONLY;
+
+	props = memdup_array_user(u64_to_user_ptr(req.props), req.count, sizeof(*props));
+	if (IS_ERR(props))
+		return PTR_ERR(props);
+
+	for (i = 0; i < req.count; i++) {
+		uint32_t id = props[i][0];
+
+		if (id >= GRAY_GPU_PROP_COUNT || __test_and_set_bit(id, &st.set)) {
+			kfree(props);
+			return -EINVAL;
+		}
+		val[id] = props[i][1];
+	}
+	kfree(props);
+
+	/* Checks that do not depend on the device state */
+	if (test_bit(GRAY_GPU_PROP_CURSOR_ENABLE, &st.set))
+		val[GRAY_GPU_PROP_CURSOR_ENABLE] = !!val[GRAY_GPU_PROP_CURSOR_ENABLE];
+	if (test_bit(GRAY_GPU_PROP_DISPLAY_ENABLE, &st.set))
+		val[GRAY_GPU_PROP_DISPLAY_ENABLE] = !!val[GRAY_GPU_PROP_DISPLAY_ENABLE];
+
+	if (test_bit(GRAY_GPU_PROP_FB_INDEX, &st.set) && test_bit(GRAY_GPU_PROP_FB_BO, &st.set))
+		return -EINVAL;
+	if (test_bit(GRAY_GPU_PROP_FB_BO, &st.set)) {
+		st.flip.bo = gray_gpu_bo_get(gfile, val[GRAY_GPU_PROP_FB_BO]);
+		if (!st.flip.bo)
+			return -ENOENT;
+		st.flip.fb_index = GRAY_GPU_FB_INDEX_BO;
+		st.flip.addr = st.flip.bo->offset;
+	} else if (test_bit(GRAY_GPU_PROP_FB_INDEX, &st.set)) {
+		st.flip.fb_index = val[GRAY_GPU_PROP_FB_INDEX];
+	}
+
+	/* Queued FIFO flips go first, the commit needs the flip state to itself */
+	for (;;) {
+		mutex_lock(&gpu->mode_lock);
+		ret = gray_gpu_atomic_apply(gpu, &st, &req.fence);
+		mutex_unlock(&gpu->mode_lock);
+		if (ret != -EBUSY)
+			break;
+		if (nonblock) {
+			ret = -EAGAIN;
+			break;
+		}
+		ret = wait_event_interruptible(gpu->flip_wq, gray_gpu_flips_idle(gpu));
+		if (ret)
+			break;
+	}
+	if (ret || st.test_only) {
+		gray_gpu_flip_cancel(&st.flip, ret);
+		return ret;
+	}
+
+	/* The batch is queued either way, the fence is all the caller loses */
+	if (copy_to_user(uarg, &req, sizeof(req)))
+		return -EFAULT;
+	return 0;
+}
+
+/* Page flip taking a sync_file in-fence and/or returning an out-fence */
+static int gray_gpu_flip_fences(struct gray_gpu_file *gfile, void __user *uarg, bool nonblock)
+{
+	struct gray_gpu_device *gpu = gfile->gpu;
+	struct {
+		uint32_t target;	/* framebuffer index, or handle with GRAY_GPU_FLIP_BO */
+		uint32_t flags;		/* GRAY_GPU_FLIP_* */
+		int32_t in_fence;	/* sync_file to wait for */
+		int32_t out_fence;	/* out: sync_file signalled once on screen */
+	} req;
+	struct gray_gpu_flip flip = { 0 };
+	struct dma_fence *in = NULL;
+	struct sync_file *sync = NULL;
+	int fd = -1;
+	int ret;
+
+	if (copy_from_user(&req, uarg, sizeof(req)))
+		return -EFAULT;
+	if (req.flags & ~GRAY_GPU_FLIP_FLAGS)
+		return -EINVAL;
+
+	if (req.flags & GRAY_GPU_FLIP_BO) {
+		flip.bo = gray_gpu_bo_get(gfile, req.target);
+		if (!flip.bo)
+			return -ENOENT;
+		flip.fb_index = GRAY_GPU_FB_INDEX_BO;
+		flip.addr = flip.bo->offset;
+	} else {
+		flip.fb_index = req.target;
+	}
+
+	if (req.flags & GRAY_GPU_FLIP_IN_FENCE) {
+		in = sync_file_get_fence(req.in_fence);
+		if (!in) {
+			ret = -EINVAL;
+			goto err_cancel;
+		}
+	}
+
+	if (req.flags & GRAY_GPU_FLIP_OUT_FENCE) {
+		flip.done = gray_gpu_flip_fence_create(gpu);
+		if (!flip.done) {
+			ret = -ENOMEM;
+			goto err_cancel;
+		}
+
+		fd = gray_gpu_sync_file_reserve(flip.done, &sync);
+		if (fd < 0) {
+			ret = fd;
+			goto err_cancel;
+		}
+
+		req.out_fence = fd;
+		if (copy_to_user(uarg, &req, sizeof(req))) {
+			ret = -EFAULT;
+			goto err_unreserve;
+		}
+	}
+
+	/* Both consume the flip and the in-fence, also on error */
+	if (in)
+		ret = gray_gpu_page_flip_fenced(gpu, &flip, in, nonblock);
+	else
+		ret = gray_gpu_page_flip(gpu, &flip, 0, nonblock);
+	if (ret) {
+		if (sync)
+			gray_gpu_sync_file_unreserve(fd, sync);
+		return ret;
+	}
+
+	if (sync)
+		fd_install(fd, sync->file);
+	return 0;
+
+err_unreserve:
+	gray_gpu_sync_file_unreserve(fd, sync);
+err_cancel:
+	dma_fence_put(in);
+	gray_gpu_flip_cancel(&flip, ret);
+	return ret;
+}
+
+static void gray_gpu_get_fb_info(struct gray_gpu_device *gpu, void *info_struct)
+{
+	struct {
+		uint32_t fb_count;
+		uint32_t current_fb;
+		uint32_t fb_size;
+		uint32_t fb_offsets[4];
+	} *fb_info = info_struct;
+	    
+	mutex_lock(&gpu->mode_lock);
+	fb_info->fb_count = gpu->fb_count;
+	fb_info->current_fb = READ_ONCE(gpu->fb_current);
+	fb_info->fb_size = gpu->fb_size;
+	    
+	for (int i = 0; i < 4; i++) {
+		fb_info->fb_offsets[i] = (i < gpu->fb_count) ? gpu->fb_addresses[i] : 0;
+	}
+	mutex_unlock(&gpu->mode_lock);
+}
+
+/* Count a vblank user, the irq is on while there is any; gpu->lock held */
+static void gray_gpu_vblank_ref(struct gray_gpu_device *gpu, bool enable)
+{
+	if (enable && gpu->vblank_listeners++ == 0)
+		gray_gpu_set_irq_enable(gpu, gpu->irq_enable | IRQ_VBLANK);
+	else if (!enable && --gpu->vblank_listeners == 0)
+		gray_gpu_set_irq_enable(gpu, gpu->irq_enable & ~IRQ_VBLANK);
+}
+
+void gray_gpu_vblank_enable(struct gray_gpu_device *gpu, unsigned int head, bool enable)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	/* Only head 0 is shared with character device clients */
+	if (head)
+		gray_gpu_set_irq_enable(gpu, enable ? gpu->irq_enable | IRQ_HEAD_VBLANK(head) :
+					gpu->irq_enable & ~IRQ_HEAD_VBLANK(head));
+	else
+		gray_gpu_vblank_ref(gpu, enable);
+	spin_unlock_irqrestore(&gpu->lock, flags);
+}
+
+/* Change which events a client receives, switching the vblank irq on demand */
+static void gray_gpu_set_event_mask(struct gray_gpu_file *gfile, uint32_t mask)
+{
+	struct gray_gpu_device *gpu = gfile->gpu;
+	unsigned long flags;
+	bool had_vblank, want_vblank;
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	had_vblank = gfile->event_mask & GRAY_GPU_EVENT_VBLANK;
+	want_vblank = mask & GRAY_GPU_EVENT_VBLANK;
+	gfile->event_mask = mask;
+
+	if (want_vblank != had_vblank)
+		gray_gpu_vblank_ref(gpu, want_vblank);
+	spin_unlock_irqrestore(&gpu->lock, flags);
+}
+
+static int gray_gpu_set_eventfd(struct gray_gpu_file *gfile, int fd)
+{
+	struct gray_gpu_device *gpu = gfile->gpu;
+	struct eventfd_ctx *ctx = NULL, *old;
+	unsigned long flags;
+
+	/* fd < 0 detaches the current eventfd */
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	old = gfile->eventfd;
+	gfile->eventfd = ctx;
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+static bool gray_gpu_event_pending(struct gray_gpu_file *gfile)
+{
+	return READ_ONCE(gfile->ev_tail) != READ_ONCE(gfile->ev_head);
+}
+
+static int gray_gpu_open(struct inode *inode, struct file *file)
+{
+	struct gray_gpu_device *gpu;
+	struct gray_gpu_file *gfile;
+	unsigned long flags;
+
+	mutex_lock(&gray_gpu_idr_lock);
+	gpu = idr_find(&gray_gpu_idr, iminor(inode));
+	if (gpu) {
+		kref_get(&gpu->ref);
+		/* The first inode opened hosts the mappings of all files */
+		if (!gpu->mapping_inode) {
+			ihold(inode);
+			WRITE_ONCE(gpu->mapping_inode, inode);
+		}
+	}
+	mutex_unlock(&gray_gpu_idr_lock);
+	if (!gpu)
+		return -ENODEV;
+
+	gfile = kzalloc(sizeof(*gfile), GFP_KERNEL);
+	if (!gfile) {
+		gray_gpu_device_put(gpu);
+		return -ENOMEM;
+	}
+
+	gfile->gpu = gpu;
+	init_waitqueue_head(&gfile->event_wq);
+	idr_init(&gfile->bos);
+	mutex_init(&gfile->bo_lock);
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	list_add_tail(&gfile->link, &gpu->clients);
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	file->f_mapping = gpu->mapping_inode->i_mapping;
+	file->private_data = gfile;
+	return 0;
+}
+
+static int gray_gpu_release(struct inode *inode, struct file *file)
+{
+	struct gray_gpu_file *gfile = file->private_data;
+	struct gray_gpu_device *gpu = gfile->gpu;
+	unsigned long flags;
+	int idx;
+
+	/* Dropping the vblank listener writes the irq mask */
+	if (gray_gpu_enter(gpu, &idx)) {
+		gray_gpu_set_event_mask(gfile, 0);
+		gray_gpu_exit(idx);
+	}
+	gray_gpu_set_eventfd(gfile, -1);
+
+	spin_lock_irqsave(&gpu->lock, flags);
+	list_del(&gfile->link);
+	spin_unlock_irqrestore(&gpu->lock, flags);
+
+	idr_for_each(&gfile->bos, gray_gpu_bo_release_handle, NULL);
+	idr_destroy(&gfile->bos);
+
+	kfree(gfile);
+	gray_gpu_device_put(gpu);
+	return 0;
+}
+
+static ssize_t gray_gpu_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct gray_gpu_file *gfile = file->private_data;
+	struct gray_gpu_device *gpu = gfile->gpu;
+	struct gray_gpu_event ev;
+	unsigned long flags;
+	size_t done = 0;
+	int ret;
+
+	if (count < sizeof(ev))
+		return -EINVAL;
+
+	if (!(file->f_flags & O_NONBLOCK)) {
+		ret = wait_event_interruptible(gfile->event_wq, gray_gpu_event_pending(gfile));
+		if (ret)
+			return ret;
+	}
+
+	while (count - done >= sizeof(ev)) {
+		spin_lock_irqsave(&gpu->lock, flags);
+		if (gfile->ev_head == gfile->ev_tail) {
+			spin_unlock_irqrestore(&gpu->lock, flags);
+			break;
+		}
+		ev = gfile->events[gfile->ev_head % GRAY_GPU_EVENT_QUEUE_LEN];
+		gfile->ev_head++;
+		spin_unlock_irqrestore(&gpu->lock, flags);
+
+		if (copy_to_user(buf + done, &ev, sizeof(ev)))
+			return done ? done : -EFAULT;
+		done += sizeof(ev);
+	}
+
+	return done ? done : -EAGAIN;
+}
+
+static __poll_t gray_gpu_poll(struct file *file, poll_table *wait)
+{
+	struct gray_gpu_file *gfile = file->private_data;
+
+	poll_wait(file, &gfile->event_wq, wait);
+
+	return gray_gpu_event_pending(gfile) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static long gray_gpu_do_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct gray_gpu_file *gfile = file->private_data;
+    struct gray_gpu_device *gpu = gfile->gpu;
+    
+    switch (cmd) {
+    case 0x1000: /* Setup framebuffer */
+        {
+            uint32_t params[3];
+            if (copy_from_user(params, (void __user *)arg, sizeof(params))) {
+                return -EFAULT;
+            }
+
+            return gray_gpu_setup_framebuffer(gpu, params[0], params[1], params[2]);
+        }
+    case 0x1001: /* Enable display */
+        gray_gpu_enable_display(gpu, 0, arg != 0);
+        return 0;
+    case 0x1002: /* Get VRAM size */
+        return put_user(gpu->vram_size, (uint32_t __user *)arg);
+    case 0x1003: //Set cursor position
+	{
+		uint32_t params[2];
+		if(copy_from_user(params, (void __user *)arg, sizeof(params))){
+			return -EFAULT;
+		}
+		gray_gpu_set_cursor_position(gpu, 0, params[0], params[1]);
 		return 0;
 	}
     case 0x1004: //Enable/Disable cursor 
-	gray_gpu_enable_cursor(gpu, arg != 0);
+	gray_gpu_enable_cursor(gpu, 0, arg != 0);
 	return 0;
     case 0x1005: //Set cursor hotspot
 	{
@@ -336,107 +2565,692 @@ static long gray_gpu_ioctl(struct file *file, unsigned int cmd, unsigned long ar
 		if(copy_from_user(params, (void __user *)arg, sizeof(params))){
 			return -EFAULT;
 		}
-		gray_gpu_set_cursor_hotspot(gpu, params[0], params[1]);
-		return 0;
+		gray_gpu_set_cursor_hotspot(gpu, 0, params[0], params[1]);
+		return 0;
+	}
+    case 0x1006:
+	{
+		struct{
+			uint32_t *data;
+			size_t size;
+		} cursor_upload;
+		uint32_t *cursor_data;
+		int ret;
+
+		if(copy_from_user(&cursor_upload, (void __user *)arg, sizeof(cursor_upload))){
+			return -EFAULT;
+		}
+
+		if(cursor_upload.size > 64 * 64){
+			return -EINVAL;
+		}
+		if(!cursor_upload.size){
+			return 0;
+		}
+
+		/* Rows of 64 pixels, a short last row is padded transparent */
+		cursor_data = kzalloc(GRAY_GPU_CURSOR_SLOT, GFP_KERNEL);
+		if(!cursor_data){
+			return -ENOMEM;
+		}
+
+		if(copy_from_user(cursor_data, cursor_upload.data, cursor_upload.size * sizeof(uint32_t))){
+			kfree(cursor_data);
+			return -EFAULT;
+		}
+
+		ret = gray_gpu_upload_cursor(gpu, cursor_data, GRAY_GPU_CURSOR_SIZE,
+					     DIV_ROUND_UP(cursor_upload.size, GRAY_GPU_CURSOR_SIZE));
+		kfree(cursor_data);
+		return ret;
+	}
+    case 0x1007: //Setup Multiple framebuffer
+	{
+		struct {
+			uint32_t fb_count;
+			uint32_t width;
+			uint32_t height;
+			uint32_t bpp;
+		} multi_setup;
+		if(copy_from_user(&multi_setup, (void __user *)arg, sizeof(multi_setup))){
+			return -EFAULT;
+		}
+		return gray_gpu_setup_multi_framebuffer(gpu, multi_setup.fb_count, multi_setup.width,multi_setup.height, multi_setup.bpp);
+	}
+    case 0x1008:
+	{
+		struct {
+			uint32_t fb_index;
+			uint32_t wait_vblank;
+		} flip_req;
+		struct gray_gpu_flip flip = { 0 };
+
+		if(copy_from_user(&flip_req, (void __user *)arg, sizeof(flip_req))){
+			return -EFAULT;
+		}
+		flip.fb_index = flip_req.fb_index;
+		return gray_gpu_page_flip(gpu, &flip, flip_req.wait_vblank,
+					  file->f_flags & O_NONBLOCK);
+	}
+    case 0x1009: //wait fror flip completion
+	return gray_gpu_wait_flip(gpu);
+    case 0x100A: //Get framebuffer into
+	{
+		struct {
+			uint32_t fb_count;
+			uint32_t current_fb;
+			uint32_t fb_size;
+			uint32_t fb_offset[4];
+		} fb_info;
+
+		gray_gpu_get_fb_info(gpu, &fb_info);
+
+		if(copy_to_user((void __user *)arg, &fb_info, sizeof(fb_info))){
+			return -EFAULT;
+		}
+		return 0;
+	}
+    case 0x100B: //Select events delivered through read()/poll()
+	if(arg & ~GRAY_GPU_EVENT_ALL){
+		return -EINVAL;
+	}
+	gray_gpu_set_event_mask(gfile, arg);
+	return 0;
+    case 0x100C: //Signal an eventfd on every queued event, -1 detaches
+	return gray_gpu_set_eventfd(gfile, (int)arg);
+    case 0x100D: //Select FIFO or mailbox present mode for page flips
+	return gray_gpu_set_present_mode(gpu, arg);
+    case 0x100E: //Submit a batch of ring commands
+	{
+		struct {
+			uint64_t cmds;		/* user pointer to little endian dwords */
+			uint32_t size;		/* bytes */
+			uint32_t flags;		/* must be 0 */
+			uint64_t fence;		/* out: completes with the batch */
+		} submit;
+		int ret;
+
+		if(copy_from_user(&submit, (void __user *)arg, sizeof(submit))){
+			return -EFAULT;
+		}
+		if(submit.flags){
+			return -EINVAL;
+		}
+
+		ret = gray_gpu_submit(gpu, u64_to_user_ptr(submit.cmds), submit.size, &submit.fence, NULL);
+		if(ret){
+			return ret;
+		}
+
+		if(copy_to_user((void __user *)arg, &submit, sizeof(submit))){
+			return -EFAULT;
+		}
+		return 0;
+	}
+    case 0x100F: //Wait for a fence returned by 0x100E
+	{
+		struct {
+			uint64_t fence;
+			uint32_t timeout_ms;
+			uint32_t pad;
+		} wait;
+
+		if(copy_from_user(&wait, (void __user *)arg, sizeof(wait))){
+			return -EFAULT;
+		}
+		return gray_gpu_wait_fence(gpu, wait.fence, wait.timeout_ms);
+	}
+    case 0x1010: //DMA a rectangle between a user buffer and VRAM
+	{
+		struct {
+			uint64_t user_ptr;
+			uint32_t vram_offset;
+			uint32_t row_bytes;
+			uint32_t rows;
+			uint32_t user_pitch;
+			uint32_t vram_pitch;
+			uint32_t flags;		/* GRAY_GPU_DMA_TO_USER to read back */
+		} dma;
+
+		if(copy_from_user(&dma, (void __user *)arg, sizeof(dma))){
+			return -EFAULT;
+		}
+		if(dma.flags & ~GRAY_GPU_DMA_TO_USER){
+			return -EINVAL;
+		}
+
+		return gray_gpu_dma_transfer(gpu, dma.user_ptr, dma.vram_offset, dma.row_bytes,
+					     dma.rows, dma.user_pitch, dma.vram_pitch,
+					     dma.flags & GRAY_GPU_DMA_TO_USER);
 	}
-    case 0x1006:
+    case 0x1011: //Upload a width x height cursor image, packed rows
 	{
-		struct{
-			uint32_t *data;
-			size_t size;
-		} cursor_upload;
+		struct {
+			uint64_t data;
+			uint32_t width;
+			uint32_t height;
+		} cursor;
 		uint32_t *cursor_data;
 		int ret;
 
-		if(copy_from_user(&cursor_upload, (void __user *)arg, sizeof(cursor_upload))){
+		if(copy_from_user(&cursor, (void __user *)arg, sizeof(cursor))){
 			return -EFAULT;
 		}
-
-		if(cursor_upload.size > 64 * 64){
+		if(!cursor.width || !cursor.height ||
+		   cursor.width > GRAY_GPU_CURSOR_SIZE || cursor.height > GRAY_GPU_CURSOR_SIZE){
 			return -EINVAL;
 		}
 
-		cursor_data = kmalloc(cursor_upload.size * sizeof(uint32_t), GFP_KERNEL);
-		if(!cursor_data){
-			return -ENOMEM;
-		}
-
-		if(copy_from_user(cursor_data, cursor_upload.data, cursor_upload.size * sizeof(uint32_t))){
-			kfree(cursor_data);
-			return -EFAULT;
+		cursor_data = memdup_user(u64_to_user_ptr(cursor.data), cursor.width * cursor.height * 4);
+		if(IS_ERR(cursor_data)){
+			return PTR_ERR(cursor_data);
 		}
 
-		ret = gray_gpu_upload_cursor(gpu, cursor_data, cursor_upload.size);
+		ret = gray_gpu_upload_cursor(gpu, cursor_data, cursor.width, cursor.height);
 		kfree(cursor_data);
 		return ret;
 	}
-    case 0x1007: //Setup Multiple framebuffer
+    case 0x1012: //Allocate a buffer object in VRAM
 	{
 		struct {
-			uint32_t fb_count;
-			uint32_t width;
-			uint32_t height;
-			uint32_t bpp;
-		} multi_setup;
-		if(copy_from_user(&multi_setup, (void __user *)arg, sizeof(multi_setup))){
+			uint32_t size;		/* bytes, rounded up to pages */
+			uint32_t handle;	/* out */
+			uint32_t offset;	/* out: VRAM and mmap offset */
+			uint32_t pad;
+		} create;
+		int ret;
+
+		if(copy_from_user(&create, (void __user *)arg, sizeof(create))){
 			return -EFAULT;
 		}
-		return gray_gpu_setup_multi_framebuffer(gpu, multi_setup.fb_count, multi_setup.width,multi_setup.height, multi_setup.bpp);
+
+		ret = gray_gpu_bo_create(gfile, create.size, &create.handle, &create.offset);
+		if(ret){
+			return ret;
+		}
+
+		if(copy_to_user((void __user *)arg, &create, sizeof(create))){
+			gray_gpu_bo_destroy(gfile, create.handle);
+			return -EFAULT;
+		}
+		return 0;
 	}
-    case 0x1008:
+    case 0x1013: //Free a buffer object handle
+	return gray_gpu_bo_destroy(gfile, arg);
+    case 0x1014: //Page flip to a buffer object
 	{
 		struct {
-			uint32_t fb_index;
+			uint32_t handle;
 			uint32_t wait_vblank;
 		} flip_req;
+		struct gray_gpu_flip flip = { 0 };
+		struct gray_gpu_bo *bo;
+
 		if(copy_from_user(&flip_req, (void __user *)arg, sizeof(flip_req))){
 			return -EFAULT;
 		}
-		return gray_gpu_page_flip(gpu, flip_req.fb_index, flip_req.wait_vblank);
+
+		bo = gray_gpu_bo_get(gfile, flip_req.handle);
+		if(!bo){
+			return -ENOENT;
+		}
+		flip.fb_index = GRAY_GPU_FB_INDEX_BO;
+		flip.bo = bo;
+		flip.addr = bo->offset;
+		return gray_gpu_page_flip(gpu, &flip, flip_req.wait_vblank,
+					  file->f_flags & O_NONBLOCK);
 	}
-    case 0x1009: //wait fror flip completion
-	return gray_gpu_wait_flip(gpu);
-    case 0x100A: //Get framebuffer into
+    case 0x1015: //Export a buffer object as a dma-buf fd
 	{
 		struct {
-			uint32_t fb_count;
-			uint32_t current_fb;
-			uint32_t fb_size;
-			uint32_t fb_offset[4];
-		} fb_info;
+			uint32_t handle;
+			uint32_t flags;		/* O_CLOEXEC, O_RDWR */
+			int32_t fd;		/* out */
+			uint32_t pad;
+		} export;
+		struct gray_gpu_bo *bo;
+		struct dma_buf *dmabuf;
+		int fd;
+
+		if(copy_from_user(&export, (void __user *)arg, sizeof(export))){
+			return -EFAULT;
+		}
+		if(export.flags & ~(O_CLOEXEC | O_ACCMODE)){
+			return -EINVAL;
+		}
 
-		gray_gpu_get_fb_info(gpu, &fb_info);
+		bo = gray_gpu_bo_get(gfile, export.handle);
+		if(!bo){
+			return -ENOENT;
+		}
+
+		dmabuf = gray_gpu_bo_export(bo, export.flags);
+		gray_gpu_bo_put(bo);
+		if(IS_ERR(dmabuf)){
+			return PTR_ERR(dmabuf);
+		}
+
+		/* Reserve the fd, it only goes live once the caller has its number */
+		fd = get_unused_fd_flags(export.flags & O_CLOEXEC);
+		if(fd < 0){
+			dma_buf_put(dmabuf);
+			return fd;
+		}
+
+		export.fd = fd;
+		if(copy_to_user((void __user *)arg, &export, sizeof(export))){
+			put_unused_fd(fd);
+			dma_buf_put(dmabuf);
+			return -EFAULT;
+		}
+		fd_install(fd, dmabuf->file);
+		return 0;
+	}
+    case 0x1016: //Import a dma-buf fd as a buffer object handle
+	{
+		struct {
+			int32_t fd;
+			uint32_t handle;	/* out */
+			uint32_t offset;	/* out: VRAM and mmap offset */
+			uint32_t size;		/* out */
+		} import;
+		struct gray_gpu_bo *bo;
+		struct dma_buf *dmabuf;
+		int id;
+
+		if(copy_from_user(&import, (void __user *)arg, sizeof(import))){
+			return -EFAULT;
+		}
+
+		dmabuf = dma_buf_get(import.fd);
+		if(IS_ERR(dmabuf)){
+			return PTR_ERR(dmabuf);
+		}
+		bo = gray_gpu_bo_import(gpu, dmabuf);
+		dma_buf_put(dmabuf);
+		if(IS_ERR(bo)){
+			return PTR_ERR(bo);
+		}
+
+		import.offset = bo->offset;
+		import.size = bo->size;
+		id = gray_gpu_bo_add_handle(gfile, bo);
+		if(id < 0){
+			return id;
+		}
+
+		import.handle = id;
+		if(copy_to_user((void __user *)arg, &import, sizeof(import))){
+			gray_gpu_bo_destroy(gfile, id);
+			return -EFAULT;
+		}
+		return 0;
+	}
+    case 0x1017: //Page flip with sync_file fences
+	return gray_gpu_flip_fences(gfile, (void __user *)arg, file->f_flags & O_NONBLOCK);
+    case 0x1018: //Submit a batch of ring commands, returning a sync_file
+	{
+		struct {
+			uint64_t cmds;		/* as 0x100E */
+			uint32_t size;
+			uint32_t flags;		/* must be 0 */
+			uint64_t fence;		/* out: seqno, as 0x100E */
+			int32_t fence_fd;	/* out: sync_file signalled with the batch */
+			uint32_t pad;
+		} submit;
+		struct gray_gpu_fence *rf;
+		struct sync_file *sync;
+		int fd, ret;
+
+		if(copy_from_user(&submit, (void __user *)arg, sizeof(submit))){
+			return -EFAULT;
+		}
+		if(submit.flags){
+			return -EINVAL;
+		}
+
+		rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+		if(!rf){
+			return -ENOMEM;
+		}
 
-		if(copy_from_user((void __user *)arg, &fb_info, sizeof(fb_info))){
+		ret = gray_gpu_submit(gpu, u64_to_user_ptr(submit.cmds), submit.size, &submit.fence, rf);
+		if(ret){
+			kfree(rf);
+			return ret;
+		}
+
+		/* The batch runs regardless, failing from here only loses the fd */
+		fd = gray_gpu_sync_file_reserve(&rf->base, &sync);
+		dma_fence_put(&rf->base);
+		if(fd < 0){
+			return fd;
+		}
+
+		submit.fence_fd = fd;
+		if(copy_to_user((void __user *)arg, &submit, sizeof(submit))){
+			gray_gpu_sync_file_unreserve(fd, sync);
 			return -EFAULT;
 		}
+		fd_install(fd, sync->file);
 		return 0;
 	}
+    case 0x1019: //Validate and apply mode, scanout and cursor state at one vblank
+	return gray_gpu_atomic_commit(gfile, (void __user *)arg, file->f_flags & O_NONBLOCK);
+    case 0x101A: //Show an overlay plane from a buffer object, or hide it
+	return gray_gpu_set_overlay(gfile, (void __user *)arg);
+    case 0x101B: //Get the number of overlay planes
+	return put_user(gpu->num_overlays, (uint32_t __user *)arg);
+    case 0x101C: //Get and reset the number of events dropped on a full queue
+	{
+		unsigned long flags;
+		uint32_t dropped;
+
+		spin_lock_irqsave(&gpu->lock, flags);
+		dropped = gfile->ev_dropped;
+		gfile->ev_dropped = 0;
+		spin_unlock_irqrestore(&gpu->lock, flags);
+
+		return put_user(dropped, (uint32_t __user *)arg);
+	}
     default:
         return -ENOTTY;
     }
 }
 
+/* Find the caller's buffer object covering [offset, offset + size) and take a reference */
+static struct gray_gpu_bo *gray_gpu_bo_get_range(struct gray_gpu_file *gfile, u64 offset, u64 size)
+{
+	struct gray_gpu_bo *bo, *found = NULL;
+	int id;
+
+	mutex_lock(&gfile->bo_lock);
+	idr_for_each_entry(&gfile->bos, bo, id) {
+		if (offset >= bo->offset && offset + size <= (u64)bo->offset + bo->size) {
+			kref_get(&bo->ref);
+			found = bo;
+			break;
+		}
+	}
+	mutex_unlock(&gfile->bo_lock);
+
+	return found;
+}
+
+/* Each mapping of a buffer object holds a reference, so freeing the handle keeps the pages */
+static void gray_gpu_vm_open(struct vm_area_struct *vma)
+{
+	struct gray_gpu_bo *bo = vma->vm_private_data;
+
+	if (bo)
+		kref_get(&bo->ref);
+}
+
+static void gray_gpu_vm_close(struct vm_area_struct *vma)
+{
+	gray_gpu_bo_put(vma->vm_private_data);
+}
+
+/*
+ * VRAM mappings are populated on first touch, so setup cost follows what
+ * is used rather than the mapping size. Map a few pages ahead of the
+ * fault, framebuffers are mostly written in order.
+ */
+vm_fault_t gray_gpu_insert_pfns(struct vm_area_struct *vma, unsigned long addr, unsigned long pfn)
+{
+	vm_fault_t ret;
+	int i;
+
+	addr &= PAGE_MASK;
+
+	ret = vmf_insert_pfn(vma, addr, pfn);
+	if (ret & VM_FAULT_ERROR)
+		return ret;
+
+	for (i = 1; i < GRAY_GPU_FAULT_AROUND; i++) {
+		addr += PAGE_SIZE;
+		if (addr >= vma->vm_end)
+			break;
+		if (vmf_insert_pfn(vma, addr, pfn + i) & VM_FAULT_ERROR)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * Legacy mappings have no buffer object and follow the reservation: the
+ * check runs under vram_lock, so a concurrent resize zaps what we insert.
+ */
+static vm_fault_t gray_gpu_vm_fault(struct vm_fault *vmf)
+{
+	struct gray_gpu_file *gfile = vmf->vma->vm_file->private_data;
+	struct gray_gpu_device *gpu = gfile->gpu;
+	/* Fault-around may fill up to the end of the mapping */
+	unsigned long end = vmf->pgoff + ((vmf->vma->vm_end - (vmf->address & PAGE_MASK)) >> PAGE_SHIFT);
+	vm_fault_t ret = VM_FAULT_SIGBUS;
+	int idx;
+
+	if (!gray_gpu_enter(gpu, &idx))
+		return VM_FAULT_SIGBUS;
+
+	mutex_lock(&gpu->vram_lock);
+	if (vmf->vma->vm_private_data || ((u64)end << PAGE_SHIFT) <= gpu->legacy_size)
+		ret = gray_gpu_insert_pfns(vmf->vma, vmf->address,
+					   (gpu->vram_base >> PAGE_SHIFT) + vmf->pgoff);
+	mutex_unlock(&gpu->vram_lock);
+	gray_gpu_exit(idx);
+
+	return ret;
+}
+
+static const struct vm_operations_struct gray_gpu_vm_ops = {
+	.open = gray_gpu_vm_open,
+	.close = gray_gpu_vm_close,
+	.fault = gray_gpu_vm_fault,
+};
+
+/*
+ * The mmap offset is a VRAM offset. It must fall inside one of the
+ * caller's buffer objects or the legacy framebuffers; the ring, cursor
+ * slot and other clients' buffers are not mappable.
+ */
 static int gray_gpu_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	struct gray_gpu_device *gpu = file->private_data;
-	unsigned long size = vma->vm_end - vma->vm_start;
-	unsigned long pfn;
+	struct gray_gpu_file *gfile = file->private_data;
+	struct gray_gpu_device *gpu = gfile->gpu;
+	u64 offset = (u64)vma->vm_pgoff << PAGE_SHIFT;
+	u64 size = vma->vm_end - vma->vm_start;
+	struct gray_gpu_bo *bo = NULL;
+	int idx;
+
+	if(!gray_gpu_enter(gpu, &idx)){
+		return -ENODEV;
+	}
 
-	if(size > gpu->vram_size){
-		return -EINVAL;
+	if(offset + size > gpu->legacy_size){
+		bo = gray_gpu_bo_get_range(gfile, offset, size);
+		if(!bo){
+			gray_gpu_exit(idx);
+			return -EINVAL;
+		}
 	}
-	
-	pfn = pci_resource_start(gpu->pdev, 1)>>PAGE_SHIFT;
+	gray_gpu_exit(idx);
+
+	vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
+	vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	vma->vm_private_data = bo;
+	vma->vm_ops = &gray_gpu_vm_ops;
+
+	return 0;
+}
+
+/*
+ * dma-buf export. Buffers stay in VRAM: another process maps them through
+ * the dma-buf fd, and another device gets the BAR1 bus address.
+ */
+static struct sg_table *gray_gpu_dmabuf_map(struct dma_buf_attachment *attach,
+					    enum dma_data_direction dir)
+{
+	struct gray_gpu_bo *bo = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	dma_addr_t addr;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = sg_alloc_table(sgt, 1, GFP_KERNEL);
+	if (ret)
+		goto err_free;
+
+	addr = dma_map_resource(attach->dev, bo->gpu->vram_base + bo->offset, bo->size, dir,
+				DMA_ATTR_SKIP_CPU_SYNC);
+	ret = dma_mapping_error(attach->dev, addr);
+	if (ret)
+		goto err_free_table;
+
+	/* MMIO has no struct page, importers only get the DMA address */
+	sg_set_page(sgt->sgl, NULL, bo->size, 0);
+	sg_dma_address(sgt->sgl) = addr;
+	sg_dma_len(sgt->sgl) = bo->size;
+
+	return sgt;
+
+err_free_table:
+	sg_free_table(sgt);
+err_free:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void gray_gpu_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+				  enum dma_data_direction dir)
+{
+	dma_unmap_resource(attach->dev, sg_dma_address(sgt->sgl), sg_dma_len(sgt->sgl), dir,
+			   DMA_ATTR_SKIP_CPU_SYNC);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void gray_gpu_dmabuf_release(struct dma_buf *dmabuf)
+{
+	gray_gpu_bo_put(dmabuf->priv);
+}
+
+/* vm_pgoff is relative to the buffer here, dma_buf_mmap() checked the range */
+static vm_fault_t gray_gpu_dmabuf_fault(struct vm_fault *vmf)
+{
+	struct gray_gpu_bo *bo = vmf->vma->vm_private_data;
+	vm_fault_t ret;
+	int idx;
+
+	if (!gray_gpu_enter(bo->gpu, &idx))
+		return VM_FAULT_SIGBUS;
+	ret = gray_gpu_insert_pfns(vmf->vma, vmf->address,
+				   ((bo->gpu->vram_base + bo->offset) >> PAGE_SHIFT) + vmf->pgoff);
+	gray_gpu_exit(idx);
+
+	return ret;
+}
+
+static const struct vm_operations_struct gray_gpu_dmabuf_vm_ops = {
+	.open = gray_gpu_vm_open,
+	.close = gray_gpu_vm_close,
+	.fault = gray_gpu_dmabuf_fault,
+};
+
+static int gray_gpu_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct gray_gpu_bo *bo = dmabuf->priv;
+
+	vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
 	vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	vma->vm_private_data = bo;
+	vma->vm_ops = &gray_gpu_dmabuf_vm_ops;
+	kref_get(&bo->ref);
+
+	return 0;
+}
+
+static int gray_gpu_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	struct gray_gpu_bo *bo = dmabuf->priv;
+
+	/* The BAR mapping goes away with the device */
+	if (READ_ONCE(bo->gpu->unplugged))
+		return -ENODEV;
+	iosys_map_set_vaddr_iomem(map, bo->gpu->vram + bo->offset);
+	return 0;
+}
+
+static const struct dma_buf_ops gray_gpu_dmabuf_ops = {
+	.map_dma_buf = gray_gpu_dmabuf_map,
+	.unmap_dma_buf = gray_gpu_dmabuf_unmap,
+	.release = gray_gpu_dmabuf_release,
+	.mmap = gray_gpu_dmabuf_mmap,
+	.vmap = gray_gpu_dmabuf_vmap,
+};
+
+/* The dma-buf holds its own reference on bo */
+struct dma_buf *gray_gpu_bo_export(struct gray_gpu_bo *bo, int flags)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct dma_buf *dmabuf;
+
+	exp_info.ops = &gray_gpu_dmabuf_ops;
+	exp_info.size = bo->size;
+	exp_info.flags = flags;
+	exp_info.priv = bo;
+
+	kref_get(&bo->ref);
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf))
+		gray_gpu_bo_put(bo);
+
+	return dmabuf;
+}
+
+/*
+ * Scanout needs the pixels in VRAM, so only buffers this device exported
+ * can be imported; returns a new reference.
+ */
+struct gray_gpu_bo *gray_gpu_bo_import(struct gray_gpu_device *gpu, struct dma_buf *dmabuf)
+{
+	struct gray_gpu_bo *bo;
+
+	if (dmabuf->ops != &gray_gpu_dmabuf_ops)
+		return ERR_PTR(-EINVAL);
+
+	bo = dmabuf->priv;
+	if (bo->gpu != gpu)
+		return ERR_PTR(-EINVAL);
+
+	kref_get(&bo->ref);
+	return bo;
+}
+
+static long gray_gpu_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct gray_gpu_file *gfile = file->private_data;
+	long ret;
+	int idx;
+
+	if (!gray_gpu_enter(gfile->gpu, &idx))
+		return -ENODEV;
+	ret = gray_gpu_do_ioctl(file, cmd, arg);
+	gray_gpu_exit(idx);
 
-	return io_remap_pfn_range(vma, vma->vm_start, pfn, size, vma->vm_page_prot);
+	return ret;
 }
 
 static const struct file_operations gray_gpu_fops = {
 	.owner = THIS_MODULE,
 	.open = gray_gpu_open,
 	.release = gray_gpu_release,
+	.read = gray_gpu_read,
+	.poll = gray_gpu_poll,
 	.mmap = gray_gpu_mmap,
 	.unlocked_ioctl = gray_gpu_ioctl,
 };
@@ -444,6 +3258,7 @@ static const struct file_operations gray_gpu_fops = {
 static int gray_gpu_init_device(struct gray_gpu_device *gpu)
 {
 	struct pci_dev *pdev = gpu->pdev;
+	unsigned int i;
 	int ret;
 
 	ret = pcim_enable_device(pdev);
@@ -511,10 +3326,40 @@ static int gray_gpu_init_device(struct gray_gpu_device *gpu)
 	gray_gpu_write_reg(gpu, REG_CONTROL, CTRL_RESET);
 	msleep(1);
 
+	gpu->num_heads = clamp_t(u32, gray_gpu_read_reg(gpu, REG_HEAD_COUNT), 1, GRAY_GPU_MAX_HEADS);
+	for (i = 0; i < gpu->num_heads; i++) {
+		gpu->heads[i].gpu = gpu;
+		gpu->heads[i].index = i;
+	}
+	gpu->num_overlays = min_t(u32, gray_gpu_read_reg(gpu, REG_OVERLAY_COUNT), GRAY_GPU_MAX_OVERLAYS);
+	dev_info(&pdev->dev, "%u scanout head(s), %u overlay(s) each\n", gpu->num_heads,
+		 gpu->num_overlays);
+
 	return 0;
 }
 			
 
+/* Every lock, list and wait queue, before any init step or error path can use them */
+static void gray_gpu_init_locks(struct gray_gpu_device *gpu)
+{
+	mutex_init(&gpu->mode_lock);
+	mutex_init(&gpu->cursor_lock);
+	mutex_init(&gpu->vram_lock);
+	spin_lock_init(&gpu->lock);
+	init_waitqueue_head(&gpu->flip_wq);
+	INIT_LIST_HEAD(&gpu->clients);
+	INIT_LIST_HEAD(&gpu->fenced_flips);
+	INIT_LIST_HEAD(&gpu->ready_flips);
+	INIT_WORK(&gpu->ready_work, gray_gpu_ready_flips_work);
+	atomic_set(&gpu->fenced_flip_count, 0);
+	mutex_init(&gpu->ring_lock);
+	init_waitqueue_head(&gpu->fence_wq);
+	spin_lock_init(&gpu->fence_lock);
+	INIT_LIST_HEAD(&gpu->fence_pending);
+	mutex_init(&gpu->dma_lock);
+	init_waitqueue_head(&gpu->dma_wq);
+}
+
 static int gray_gpu_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 {
 	struct gray_gpu_device *gpu;
@@ -522,45 +3367,73 @@ static int gray_gpu_pci_probe(struct pci_dev *pdev, const struct pci_device_id *
 
 	dev_info(&pdev->dev, "Probing GRAY GPU device\n");
 
-	gpu = devm_kzalloc(&pdev->dev, sizeof(*gpu), GFP_KERNEL);
+	gpu = kzalloc(sizeof(*gpu), GFP_KERNEL);
 	if(!gpu){
 		return -ENOMEM;
 	}
 
+	kref_init(&gpu->ref);
 	gpu->pdev = pdev;
+	gray_gpu_init_locks(gpu);
+
+	//Registered first so it runs last, after devm has freed the irqs
+	ret = devm_add_action_or_reset(&pdev->dev, gray_gpu_device_put_devm, gpu);
+	if(ret){
+		return ret;
+	}
 	pci_set_drvdata(pdev, gpu);
-	gray_gpu_dev = gpu;
 
 	ret = gray_gpu_init_device(gpu);
 	if(ret){
 		return ret;
 	}
 
-	ret = alloc_chrdev_region(&gpu->devt, 0, 1, GRAY_GPU_NAME);
+	if(gpu->vram_size < 2 * GRAY_GPU_RING_SIZE){
+		dev_err(&pdev->dev, "VRAM too small for the command ring\n");
+		return -ENODEV;
+	}
+	gray_gpu_init_ring(gpu);
+
+	ret = gray_gpu_init_vram(gpu);
 	if(ret){
-		dev_err(&pdev->dev, "Failed to allocate char device region\n");
 		return ret;
 	}
 
+	ret = gray_gpu_init_dma(gpu);
+	if(ret){
+		goto err_destroy_pool;
+	}
+
+	ret = gray_gpu_init_irq(gpu);
+	if(ret){
+		goto err_destroy_pool;
+	}
+
+	//Reserve a minor, the idr entry stays NULL until probe succeeds
+	mutex_lock(&gray_gpu_idr_lock);
+	ret = idr_alloc(&gray_gpu_idr, NULL, 0, GRAY_GPU_MAX_DEVICES, GFP_KERNEL);
+	mutex_unlock(&gray_gpu_idr_lock);
+	if(ret < 0){
+		dev_err(&pdev->dev, "No free char device minor\n");
+		goto err_destroy_pool;
+	}
+	gpu->minor = ret;
+	gpu->devt = MKDEV(MAJOR(gray_gpu_devt), gpu->minor);
+
 	cdev_init(&gpu->cdev, &gray_gpu_fops);
 	gpu->cdev.owner = THIS_MODULE;
 
 	ret = cdev_add(&gpu->cdev, gpu->devt, 1);
 	if(ret){
 		dev_err(&pdev->dev, "Failed to add char device\n");
-		goto err_unregister_chrdev;
-	}
-
-	gpu->class = class_create(GRAY_GPU_NAME);
-	if(IS_ERR(gpu->class)){
-		ret = PTR_ERR(gpu->class);
-		goto err_cdev_del;
+		goto err_remove_minor;
 	}
 
-	gpu->device = device_create(gpu->class, &pdev->dev, gpu->devt, NULL, GRAY_GPU_NAME);
+	gpu->device = device_create(gray_gpu_class, &pdev->dev, gpu->devt, gpu,
+				    GRAY_GPU_NAME "%d", gpu->minor);
 	if(IS_ERR(gpu->device)){
 		ret = PTR_ERR(gpu->device);
-		goto err_class_destroy;
+		goto err_cdev_del;
 	}
 
 	//setup default Framebuffer
@@ -574,10 +3447,12 @@ static int gray_gpu_pci_probe(struct pci_dev *pdev, const struct pci_device_id *
 	gpu->cursor_enabled = 0;
 	gpu->cursor_hotspot_x = 0;
 	gpu->cursor_hotspot_y = 0;
+	gpu->cursor_width = GRAY_GPU_CURSOR_SIZE;	/* the device's default image */
+	gpu->cursor_height = GRAY_GPU_CURSOR_SIZE;
 
-	gray_gpu_set_cursor_position(gpu, 0, 0);
-	gray_gpu_set_cursor_hotspot(gpu, 0, 0);
-	gray_gpu_enable_cursor(gpu, false);
+	gray_gpu_set_cursor_position(gpu, 0, 0, 0);
+	gray_gpu_set_cursor_hotspot(gpu, 0, 0, 0);
+	gray_gpu_enable_cursor(gpu, 0, false);
 
 	gpu->fb_count = 1;
 	gpu->fb_current = 0;
@@ -586,19 +3461,31 @@ static int gray_gpu_pci_probe(struct pci_dev *pdev, const struct pci_device_id *
 	gpu->vblank_count = 0;
 	gpu->fb_addresses[0] = 0; 
 
+	ret = gray_kms_init(gpu);
+	if(ret){
+		dev_err(&pdev->dev, "Failed to register the DRM device\n");
+		goto err_device_destroy;
+	}
+
+	mutex_lock(&gray_gpu_idr_lock);
+	idr_replace(&gray_gpu_idr, gpu, gpu->minor);
+	mutex_unlock(&gray_gpu_idr_lock);
+
 	dev_info(&pdev->dev, "Gray gpu loaded successfully\n");
-	dev_info(&pdev->dev, "Character device: /dev/%s\n", GRAY_GPU_NAME);
+	dev_info(&pdev->dev, "Character device: /dev/%s%d\n", GRAY_GPU_NAME, gpu->minor);
 
 	return 0;
 
 err_device_destroy:
-	device_destroy(gpu->class, gpu->devt);
-err_class_destroy:
-	class_destroy(gpu->class);
+	device_destroy(gray_gpu_class, gpu->devt);
 err_cdev_del:
 	cdev_del(&gpu->cdev);
-err_unregister_chrdev:
-	unregister_chrdev_region(gpu->devt, 1);
+err_remove_minor:
+	mutex_lock(&gray_gpu_idr_lock);
+	idr_remove(&gray_gpu_idr, gpu->minor);
+	mutex_unlock(&gray_gpu_idr_lock);
+err_destroy_pool:
+	gray_gpu_fini_vram(gpu);
 	return ret;
 }
 
@@ -607,16 +3494,28 @@ static void gray_gpu_pci_remove(struct pci_dev *pdev)
 	struct gray_gpu_device *gpu = pci_get_drvdata(pdev);
 	dev_info(&pdev->dev, "Removing gray GPU device\n");
 
+	//No new opens from here on
+	mutex_lock(&gray_gpu_idr_lock);
+	idr_remove(&gray_gpu_idr, gpu->minor);
+	mutex_unlock(&gray_gpu_idr_lock);
+
+	//Wait out ioctls and mmaps in flight, files left open get -ENODEV
+	WRITE_ONCE(gpu->unplugged, true);
+	synchronize_srcu(&gray_gpu_unplug_srcu);
+	gray_gpu_zap_mappings(gpu, 0);
+
+	gray_kms_fini(gpu);
+	gray_gpu_fini_fences(gpu);
+
 	//Disable display
-	gray_gpu_enable_display(gpu, false);
+	gray_gpu_enable_display(gpu, 0, false);
+	gray_gpu_set_irq_enable(gpu, 0);
 
-	//Clean up character device
-	device_destroy(gpu->class, gpu->devt);
-	class_destroy(gpu->class);
+	//Clean up character device, the region and class belong to the module
+	device_destroy(gray_gpu_class, gpu->devt);
 	cdev_del(&gpu->cdev);
-	unregister_chrdev_region(gpu->devt, 1);
 
-	gray_gpu_dev = NULL;
+	gray_gpu_fini_vram(gpu);
 }
 
 static const struct pci_device_id gray_gpu_pci_ids[] = {
@@ -632,8 +3531,48 @@ static struct pci_driver gray_gpu_pci_driver = {
 	.remove = gray_gpu_pci_remove,
 };
 
-module_pci_driver(gray_gpu_pci_driver);
+static int __init gray_gpu_module_init(void)
+{
+	int ret;
+
+	ret = alloc_chrdev_region(&gray_gpu_devt, 0, GRAY_GPU_MAX_DEVICES, GRAY_GPU_NAME);
+	if(ret){
+		pr_err(DRIVER_NAME ": Failed to allocate char device region\n");
+		return ret;
+	}
+
+	gray_gpu_class = class_create(GRAY_GPU_NAME);
+	if(IS_ERR(gray_gpu_class)){
+		ret = PTR_ERR(gray_gpu_class);
+		goto err_unregister_chrdev;
+	}
+
+	ret = pci_register_driver(&gray_gpu_pci_driver);
+	if(ret){
+		goto err_class_destroy;
+	}
+
+	return 0;
+
+err_class_destroy:
+	class_destroy(gray_gpu_class);
+err_unregister_chrdev:
+	unregister_chrdev_region(gray_gpu_devt, GRAY_GPU_MAX_DEVICES);
+	return ret;
+}
+
+static void __exit gray_gpu_module_exit(void)
+{
+	pci_unregister_driver(&gray_gpu_pci_driver);
+	class_destroy(gray_gpu_class);
+	unregister_chrdev_region(gray_gpu_devt, GRAY_GPU_MAX_DEVICES);
+	idr_destroy(&gray_gpu_idr);
+}
+
+module_init(gray_gpu_module_init);
+module_exit(gray_gpu_module_exit);
 
 MODULE_AUTHOR("Madhur Kumar");
 MODULE_DESCRIPTION(DRIVER_DESC);
 MODULE_LICENSE("GPL");
+MODULE_IMPORT_NS("DMA_BUF");
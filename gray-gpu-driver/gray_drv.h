@@ -0,0 +1,386 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Gray GPU: register map and device state shared by the character device
+ * (gray_drv.c) and the DRM/KMS front end (gray_kms.c)
+ */
+#ifndef _GRAY_DRV_H_
+#define _GRAY_DRV_H_
+
+#include <linux/types.h>
+#include <linux/pci.h>
+#include <linux/cdev.h>
+#include <linux/io.h>
+#include <linux/mm.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/genalloc.h>
+
+struct gray_kms;
+struct dma_buf;
+struct dma_fence;
+
+//Register offset
+#define REG_DEVICE_ID       0x00
+#define REG_STATUS          0x04
+#define REG_CONTROL         0x08
+#define REG_FB_ADDR         0x0C
+#define REG_FB_WIDTH        0x10
+#define REG_FB_HEIGHT       0x14
+#define REG_FB_BPP          0x18
+#define REG_FB_ENABLE       0x1C
+#define REG_FB_PITCH        0x20
+#define REG_CURSOR_X        0x24
+#define REG_CURSOR_Y        0x28
+#define REG_CURSOR_ENABLE   0x2C
+#define REG_CURSOR_HOTSPOT_X 0x30
+#define REG_CURSOR_HOTSPOT_Y 0x34
+#define REG_CURSOR_UPLOAD   0x38
+#define REG_FB_COUNT        0x3C   
+#define REG_FB_CURRENT      0x40  
+#define REG_FB_NEXT         0x44 
+#define REG_PAGE_FLIP       0x48  
+#define REG_FLIP_PENDING    0x4C  
+#define REG_VBLANK_COUNT    0x50 
+#define REG_IRQ_STATUS      0x54
+#define REG_IRQ_ENABLE      0x58
+#define REG_REFRESH_RATE    0x5C
+#define REG_RING_BASE       0x60
+#define REG_RING_SIZE       0x64
+#define REG_RING_HEAD       0x68
+#define REG_RING_TAIL       0x6C
+#define REG_RING_DOORBELL   0x70
+#define REG_FENCE_COMPLETED 0x74
+#define REG_DMA_DESC_LO     0x78
+#define REG_DMA_DESC_HI     0x7C
+#define REG_DMA_DESC_COUNT  0x80
+#define REG_DMA_START       0x84
+#define REG_DMA_STATUS      0x88
+#define REG_DMA_COMPLETED   0x8C
+#define REG_CURSOR_BASE     0x90
+#define REG_CURSOR_COMMIT   0x94
+#define REG_FB_NEXT_ADDR    0x98
+#define REG_HEAD_COUNT      0x9C
+
+/*
+ * Head n repeats the per-head registers (REG_FB_*, REG_CURSOR_*, flip and
+ * vblank count) at the same offsets n blocks up; block 0 is head 0.
+ */
+#define REG_HEAD_STRIDE     0x100
+#define REG_HEAD(n, reg)    ((n) * REG_HEAD_STRIDE + (reg))
+#define GRAY_GPU_MAX_HEADS  4
+
+/*
+ * Overlay planes, per head. The OVL_* registers of overlay n are staged
+ * until a mask with bit n is written to REG_OVERLAY_COMMIT.
+ */
+#define REG_OVERLAY_COMMIT  0xA0
+#define REG_OVERLAY_COUNT   0xA4
+
+/* Mode staged for the next flip, 32 bpp; latched together with the buffer */
+#define REG_FB_NEXT_SIZE    0xA8	/* (height << 16) | width */
+#define REG_FB_NEXT_PITCH   0xAC
+#define REG_OVERLAY(n, reg) (0xC0 + (n) * 0x20 + (reg))
+#define OVL_ADDR            0x00
+#define OVL_PITCH           0x04
+#define OVL_FORMAT          0x08
+#define OVL_SRC_SIZE        0x0C    /* (height << 16) | width */
+#define OVL_DST_POS         0x10    /* (y << 16) | x, both signed 16 bit */
+#define OVL_DST_SIZE        0x14    /* (height << 16) | width */
+#define OVL_ZPOS            0x18
+#define OVL_ENABLE          0x1C
+#define GRAY_GPU_MAX_OVERLAYS	2
+
+#define OVERLAY_FORMAT_XRGB8888	0
+#define OVERLAY_FORMAT_ARGB8888	1
+
+//REG_FB_CURRENT/REG_FB_NEXT value while scanning out a buffer object
+#define GRAY_GPU_FB_INDEX_BO	0xFFFFFFFF
+
+//Control register bits
+#define CTRL_RESET	(1<<0)
+#define CTRL_ENABLE	(1<<1)
+#define CTRL_DMA_RESET	(1<<2)	/* abort the DMA engine, self clearing */
+
+//Status register bits
+#define STATUS_READY	(1<<0)
+#define STATUS_VBLANK	(1<<1)
+#define STATUS_CURSOR_LOADED (1 << 2)
+
+//Interrupt bits (REG_IRQ_STATUS / REG_IRQ_ENABLE)
+#define IRQ_VBLANK	(1<<0)
+#define IRQ_FLIP_DONE	(1<<1)
+#define IRQ_CMD_DONE	(1<<2)
+#define IRQ_DMA_DONE	(1<<3)
+
+//DMA status bits
+#define DMA_STATUS_BUSY		(1<<0)
+#define DMA_STATUS_ERROR	(1<<1)
+
+#define GRAY_GPU_FLIP_TIMEOUT_MS	100
+
+/*
+ * VRAM below the cursor slot is handed out by a page granular gen_pool.
+ * Pool addresses are BAR1 bus addresses, as genalloc cannot hand out 0.
+ */
+#define GRAY_GPU_MAX_BOS	1024	/* per open file */
+#define GRAY_GPU_FAULT_AROUND	16	/* pages mapped per mmap fault */
+
+/* A buffer object: a VRAM range, alive while a handle or a flip holds it */
+struct gray_gpu_bo {
+	struct kref ref;
+	struct gray_gpu_device *gpu;
+	uint32_t offset;	/* VRAM offset, also the mmap offset */
+	uint32_t size;		/* page aligned */
+};
+
+/* A page flip target: a legacy framebuffer slot or a buffer object */
+struct gray_gpu_flip {
+	uint32_t fb_index;		/* GRAY_GPU_FB_INDEX_BO for bo */
+	struct gray_gpu_bo *bo;		/* reference owned by the flip */
+	uint32_t addr;			/* scanout VRAM offset inside bo */
+	struct dma_fence *done;		/* signalled once on screen or replaced */
+};
+
+//Flip queue, see gray_gpu_page_flip()
+#define GRAY_GPU_FLIP_QUEUE_LEN		3
+#define GRAY_GPU_PRESENT_FIFO		0
+#define GRAY_GPU_PRESENT_MAILBOX	1
+
+//MSI-X vectors exposed by the device, vector n for interrupt bit n
+#define GRAY_GPU_VECTOR_VBLANK	0
+#define GRAY_GPU_VECTOR_FLIP	1
+#define GRAY_GPU_VECTOR_CMD	2
+#define GRAY_GPU_VECTOR_DMA	3
+#define GRAY_GPU_VECTOR_HEAD_VBLANK(n)	((n) ? 2 + 2 * (n) : GRAY_GPU_VECTOR_VBLANK)
+#define GRAY_GPU_VECTOR_HEAD_FLIP(n)	((n) ? 3 + 2 * (n) : GRAY_GPU_VECTOR_FLIP)
+#define GRAY_GPU_NUM_VECTORS(heads)	(2 + 2 * (heads))
+
+//Vblank and flip done bits of head n, the head 0 ones are IRQ_VBLANK/IRQ_FLIP_DONE
+#define IRQ_HEAD_VBLANK(n)	(1u << GRAY_GPU_VECTOR_HEAD_VBLANK(n))
+#define IRQ_HEAD_FLIP_DONE(n)	(1u << GRAY_GPU_VECTOR_HEAD_FLIP(n))
+
+//Cursor images are staged in VRAM just below the ring, then committed
+#define GRAY_GPU_CURSOR_SIZE	64
+#define GRAY_GPU_CURSOR_SLOT	(GRAY_GPU_CURSOR_SIZE * GRAY_GPU_CURSOR_SIZE * 4)
+
+//Command ring at the top of VRAM; commands are little endian dwords
+#define GRAY_GPU_RING_SIZE	(64 * 1024)
+#define GRAY_GPU_MAX_BATCH	(16 * 1024)	/* bytes per submit */
+#define GRAY_GPU_FENCE_TIMEOUT_MS	1000
+
+#define CMD_HEADER(op, len)	(((op) << 24) | (len))
+#define CMD_OPCODE(hdr)		((hdr) >> 24)
+#define CMD_LENGTH(hdr)		((hdr) & 0xFFFF)
+#define CMD_NOP			0x00	/* payload ignored */
+#define CMD_SET_REG		0x01	/* (register, value) pairs */
+#define CMD_FENCE		0x02	/* kernel only: seqno */
+#define CMD_FILL		0x03	/* dst, dst_pitch, width, height, colour */
+#define CMD_COPY		0x04	/* src, src_pitch, dst, dst_pitch, width, height */
+#define CMD_BLEND		0x05	/* as COPY, ARGB blended over dst */
+#define CMD_COPY_KEY		0x06	/* as COPY plus colour key */
+#define CMD_WAIT_VBLANK		0x07	/* stall until the next vblank, optional head */
+
+//DMA engine, descriptors live in one coherent buffer reused per kick
+#define GRAY_GPU_DMA_MAX_DESC	1024
+#define GRAY_GPU_DMA_TIMEOUT_MS	1000
+#define DMA_DESC_TO_SYSTEM	(1<<0)	/* descriptor flag: VRAM -> system memory */
+#define GRAY_GPU_DMA_TO_USER	(1<<0)	/* ioctl flag: read VRAM back */
+
+/* Device descriptor layout, little endian */
+struct gray_gpu_dma_desc {
+	__le64 sys_addr;
+	__le32 vram_offset;
+	__le32 row_bytes;
+	__le32 rows;
+	__le32 sys_pitch;
+	__le32 vram_pitch;
+	__le32 flags;
+};
+
+/*
+ * Scanout state of heads past 0. Those are only driven by the KMS front
+ * end, head 0 keeps its state in the device for the character device.
+ */
+struct gray_gpu_head {
+	struct gray_gpu_device *gpu;
+	unsigned int index;
+	uint32_t fb_width;		/* mode_lock */
+	uint32_t fb_height;
+	uint32_t fb_pitch;
+	uint32_t flip_pending;		/* lock */
+	struct gray_gpu_bo *armed_bo;	/* lock */
+	struct gray_gpu_bo *scanout_bo;	/* lock */
+};
+
+struct gray_gpu_device {
+	struct pci_dev *pdev;
+
+	/*
+	 * The device struct outlives remove while files or buffer objects
+	 * hold a reference. Once remove sets unplugged, the registers and
+	 * BARs are off limits; see gray_gpu_enter().
+	 */
+	struct kref ref;
+	bool unplugged;
+
+	void __iomem *registers;
+	void __iomem *vram;
+	size_t vram_size;
+	size_t vram_usable;	/* VRAM below the ring, for framebuffers */
+
+	/*
+	 * mode_lock serialises display state changes: geometry, the legacy
+	 * layout, cursor and display enable. Geometry and fb_count are also
+	 * written under lock, so the flip path can check against them there.
+	 */
+	struct mutex mode_lock;
+
+	//Framebuffer info
+	uint32_t fb_width;
+	uint32_t fb_height;
+	uint32_t fb_bpp;
+	uint32_t fb_pitch;
+	uint32_t fb_size;
+ 
+	/* Cursor info */
+	uint32_t cursor_x;
+	uint32_t cursor_y;
+	uint32_t cursor_enabled;
+	uint32_t cursor_hotspot_x;
+	uint32_t cursor_hotspot_y;
+	uint32_t cursor_offset;		/* VRAM staging slot */
+	struct mutex cursor_lock;	/* one upload in the slot at a time */
+	uint32_t cursor_width;		/* image latched on head 0, cursor_lock */
+	uint32_t cursor_height;
+
+	//Multiple Framebuffer state
+	uint32_t fb_count;
+	uint32_t fb_current;
+	uint32_t fb_next;
+	uint32_t flip_pending;
+	uint32_t vblank_count;
+	uint32_t fb_addresses[4];
+
+	//Flips waiting for the device, free running head/tail
+	struct gray_gpu_flip flip_queue[GRAY_GPU_FLIP_QUEUE_LEN];
+	unsigned int flip_q_head;
+	unsigned int flip_q_tail;
+	uint32_t present_mode;
+	struct gray_gpu_bo *armed_bo;	/* target of the armed flip, lock */
+	struct gray_gpu_bo *scanout_bo;	/* on screen, lock */
+	struct dma_fence *armed_done;	/* fence of the armed flip, lock */
+	uint32_t armed_addr;		/* VRAM offset armed_bo is flipped to, lock */
+	uint64_t ring_flip_seq;		/* fence of a ring batch flipping, 0 if none, lock */
+	struct list_head fenced_flips;	/* waiting for an in-fence, lock */
+	struct list_head ready_flips;	/* in-fence done, waiting for queue room, lock */
+	struct work_struct ready_work;	/* feeds ready_flips, kicked as room frees up */
+	atomic_t fenced_flip_count;	/* parked or running, see flip_wq */
+
+	//Scanout heads, REG_HEAD_COUNT; heads[0] is unused
+	unsigned int num_heads;
+	struct gray_gpu_head heads[GRAY_GPU_MAX_HEADS];
+
+	//Overlay planes of head 0, REG_OVERLAY_COUNT; each holds its source, mode_lock
+	unsigned int num_overlays;
+	struct gray_gpu_bo *overlay_bo[GRAY_GPU_MAX_OVERLAYS];
+
+	//VRAM allocator, vram_lock orders allocations against legacy setup
+	struct gen_pool *vram_pool;
+	unsigned long vram_base;	/* pool address of VRAM offset 0 */
+	struct mutex vram_lock;
+	uint32_t legacy_size;		/* fixed framebuffers reserved at offset 0 */
+	struct inode *mapping_inode;	/* address_space shared by every open file */
+
+	//Interrupt state, lock protects flip state shared with the irq handler
+	spinlock_t lock;
+	wait_queue_head_t flip_wq;
+	uint32_t irq_enable;
+	unsigned int num_vectors;	/* allocated by init_irq */
+
+	//Open files, protected by lock; vblank irq is on while anyone listens
+	struct list_head clients;
+	uint32_t vblank_listeners;
+
+	//Command ring, ring_lock serialises submitters
+	struct mutex ring_lock;
+	void __iomem *ring;
+	uint32_t ring_offset;
+	uint32_t ring_head;	/* last head read back from the device */
+	uint32_t ring_tail;
+	uint64_t fence_seqno;	/* last fence emitted, ring_lock */
+	uint64_t fence_completed;	/* last fence executed, lock */
+	wait_queue_head_t fence_wq;
+
+	//sync_file fences, fence_lock is the lock of every dma_fence we create
+	spinlock_t fence_lock;
+	uint64_t ring_context;
+	struct list_head fence_pending;	/* ring fences in seqno order, fence_lock */
+
+	//DMA engine, dma_lock serialises transfers
+	struct mutex dma_lock;
+	struct gray_gpu_dma_desc *dma_desc;
+	dma_addr_t dma_desc_addr;
+	uint32_t dma_cookie;		/* last transfer started, dma_lock */
+	uint32_t dma_completed;		/* last transfer finished, lock */
+	uint32_t dma_status;		/* DMA_STATUS_* of dma_completed, lock */
+	wait_queue_head_t dma_wq;
+
+	//Character device
+	struct cdev cdev;
+	dev_t devt;
+	int minor;			/* /dev/gray-gpuN, key in gray_gpu_idr */
+	struct device *device;
+
+	//DRM/KMS front end, NULL when not built or not registered
+	struct gray_kms *kms;
+};
+
+static inline void gray_gpu_write_reg(struct gray_gpu_device *gpu, u32 offset, u32 value)
+{
+	iowrite32(value, gpu->registers + offset);
+}
+
+static inline u32 gray_gpu_read_reg(struct gray_gpu_device *gpu, u32 offset)
+{
+	return ioread32(gpu->registers + offset);
+}
+
+
+/* gray_drv.c */
+struct gray_gpu_bo *gray_gpu_bo_alloc(struct gray_gpu_device *gpu, uint32_t size);
+void gray_gpu_bo_put(struct gray_gpu_bo *bo);
+void gray_gpu_set_mode(struct gray_gpu_device *gpu, unsigned int head, uint32_t width,
+		       uint32_t height, uint32_t pitch);
+void gray_gpu_enable_display(struct gray_gpu_device *gpu, unsigned int head, bool enable);
+void gray_gpu_flip_now(struct gray_gpu_device *gpu, unsigned int head, struct gray_gpu_bo *bo,
+		       uint32_t addr);
+void gray_gpu_commit_cursor(struct gray_gpu_device *gpu, unsigned int head, uint32_t offset,
+			    uint32_t width, uint32_t height);
+void gray_gpu_set_cursor_position(struct gray_gpu_device *gpu, unsigned int head, uint32_t x,
+				  uint32_t y);
+void gray_gpu_set_cursor_hotspot(struct gray_gpu_device *gpu, unsigned int head, uint32_t x,
+				 uint32_t y);
+void gray_gpu_enable_cursor(struct gray_gpu_device *gpu, unsigned int head, bool enable);
+void gray_gpu_vblank_enable(struct gray_gpu_device *gpu, unsigned int head, bool enable);
+void gray_gpu_sync_irqs(struct gray_gpu_device *gpu);
+struct dma_buf *gray_gpu_bo_export(struct gray_gpu_bo *bo, int flags);
+struct gray_gpu_bo *gray_gpu_bo_import(struct gray_gpu_device *gpu, struct dma_buf *dmabuf);
+vm_fault_t gray_gpu_insert_pfns(struct vm_area_struct *vma, unsigned long addr, unsigned long pfn);
+
+/* gray_kms.c */
+#if IS_ENABLED(CONFIG_GRAY_GPU_KMS)
+int gray_kms_init(struct gray_gpu_device *gpu);
+void gray_kms_fini(struct gray_gpu_device *gpu);
+void gray_kms_vblank(struct gray_kms *kms, unsigned int head);
+void gray_kms_flip_done(struct gray_kms *kms, unsigned int head);
+#else
+static inline int gray_kms_init(struct gray_gpu_device *gpu) { return 0; }
+static inline void gray_kms_fini(struct gray_gpu_device *gpu) { }
+static inline void gray_kms_vblank(struct gray_kms *kms, unsigned int head) { }
+static inline void gray_kms_flip_done(struct gray_kms *kms, unsigned int head) { }
+#endif
+
+#endif /* _GRAY_DRV_H_ */
@@ -0,0 +1,612 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * DRM/KMS front end for the Gray GPU
+ *
+ * One output per device head: a CRTC with a primary and a cursor plane,
+ * driving its own virtual connector. GEM objects wrap the VRAM buffer
+ * objects of gray_drv.c, so a primary plane update is a buffer object flip
+ * (REG_FB_NEXT_ADDR + REG_PAGE_FLIP in the head's register block) and its
+ * event goes out from that head's flip-done interrupt. A cursor plane
+ * buffer is latched in place with REG_CURSOR_BASE + REG_CURSOR_COMMIT.
+ *
+ * The character device stays registered next to it and drives head 0, so
+ * mixing them on that display is last writer wins.
+ */
+#include <linux/module.h>
+#include <linux/pci.h>
+#include <linux/slab.h>
+#include <linux/dma-buf.h>
+
+#include <drm/drm_atomic.h>
+#include <drm/drm_atomic_helper.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_edid.h>
+#include <drm/drm_file.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_gem.h>
+#include <drm/drm_gem_atomic_helper.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_ioctl.h>
+#include <drm/drm_managed.h>
+#include <drm/drm_modeset_helper_vtables.h>
+#include <drm/drm_probe_helper.h>
+#include <drm/drm_simple_kms_helper.h>
+#include <drm/drm_vblank.h>
+
+#include "gray_drv.h"
+
+#define GRAY_KMS_MAX_WIDTH	1920	/* modes offered on the virtual connector */
+#define GRAY_KMS_MAX_HEIGHT	1200
+#define GRAY_KMS_DEF_WIDTH	800
+#define GRAY_KMS_DEF_HEIGHT	600
+
+/* Pipeline of one device head, CRTC index == head */
+struct gray_kms_output {
+	unsigned int head;
+	struct drm_plane primary;
+	struct drm_plane cursor;
+	struct drm_crtc crtc;
+	struct drm_encoder encoder;
+	struct drm_connector connector;
+
+	/* Sent when the armed flip latches, drm.event_lock */
+	struct drm_pending_vblank_event *event;
+};
+
+struct gray_kms {
+	struct drm_device drm;
+	struct gray_gpu_device *gpu;
+
+	struct gray_kms_output outputs[GRAY_GPU_MAX_HEADS];
+	unsigned int num_outputs;
+};
+
+static inline struct gray_kms *to_gray_kms(struct drm_device *drm)
+{
+	return container_of(drm, struct gray_kms, drm);
+}
+
+static inline struct gray_kms_output *to_gray_output(struct drm_crtc *crtc)
+{
+	return container_of(crtc, struct gray_kms_output, crtc);
+}
+
+/* A GEM object is a handle on a VRAM buffer object */
+struct gray_gem_object {
+	struct drm_gem_object base;
+	struct gray_gpu_bo *bo;
+};
+
+static inline struct gray_gem_object *to_gray_gem(struct drm_gem_object *obj)
+{
+	return container_of(obj, struct gray_gem_object, base);
+}
+
+static void gray_gem_free(struct drm_gem_object *obj)
+{
+	struct gray_gem_object *gem = to_gray_gem(obj);
+
+	drm_gem_object_release(obj);
+	/* A flip still scanning it out keeps the VRAM */
+	gray_gpu_bo_put(gem->bo);
+	kfree(gem);
+}
+
+/* drm_dev_unplug() zapped the mappings, a fault after it must not refill them */
+static vm_fault_t gray_gem_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct drm_gem_object *obj = vma->vm_private_data;
+	struct gray_gpu_bo *bo = to_gray_gem(obj)->bo;
+	unsigned long page = (vmf->address - vma->vm_start) >> PAGE_SHIFT;
+	vm_fault_t ret;
+	int idx;
+
+	if (!drm_dev_enter(obj->dev, &idx))
+		return VM_FAULT_SIGBUS;
+	ret = gray_gpu_insert_pfns(vma, vmf->address,
+				   ((bo->gpu->vram_base + bo->offset) >> PAGE_SHIFT) + page);
+	drm_dev_exit(idx);
+
+	return ret;
+}
+
+/* drm_gem_mmap() maps write-combined PFNs when there is no .mmap hook */
+static const struct vm_operations_struct gray_gem_vm_ops = {
+	.fault = gray_gem_fault,
+	.open = drm_gem_vm_open,
+	.close = drm_gem_vm_close,
+};
+
+/* PRIME goes through the same dma-buf exporter as the character device */
+static struct dma_buf *gray_gem_export(struct drm_gem_object *obj, int flags)
+{
+	return gray_gpu_bo_export(to_gray_gem(obj)->bo, flags);
+}
+
+static const struct drm_gem_object_funcs gray_gem_funcs = {
+	.free = gray_gem_free,
+	.export = gray_gem_export,
+	.vm_ops = &gray_gem_vm_ops,
+};
+
+/* Wrap a buffer object, taking over the caller's reference */
+static struct gray_gem_object *gray_gem_wrap(struct gray_kms *kms, struct gray_gpu_bo *bo)
+{
+	struct gray_gem_object *gem;
+	int ret;
+
+	gem = kzalloc(sizeof(*gem), GFP_KERNEL);
+	if (!gem) {
+		gray_gpu_bo_put(bo);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	gem->bo = bo;
+	gem->base.funcs = &gray_gem_funcs;
+	drm_gem_private_object_init(&kms->drm, &gem->base, bo->size);
+
+	ret = drm_gem_create_mmap_offset(&gem->base);
+	if (ret) {
+		drm_gem_object_put(&gem->base);
+		return ERR_PTR(ret);
+	}
+
+	return gem;
+}
+
+static struct gray_gem_object *gray_gem_create(struct gray_kms *kms, u64 size)
+{
+	struct gray_gpu_bo *bo;
+
+	if (size > kms->gpu->vram_usable)
+		return ERR_PTR(-ENOSPC);
+
+	bo = gray_gpu_bo_alloc(kms->gpu, size);
+	if (IS_ERR(bo))
+		return ERR_CAST(bo);
+
+	return gray_gem_wrap(kms, bo);
+}
+
+/* Only buffers exported by this device, from either front end, can be scanned out */
+static struct drm_gem_object *gray_gem_prime_import(struct drm_device *drm,
+						    struct dma_buf *dmabuf)
+{
+	struct gray_kms *kms = to_gray_kms(drm);
+	struct gray_gem_object *gem;
+	struct gray_gpu_bo *bo;
+
+	bo = gray_gpu_bo_import(kms->gpu, dmabuf);
+	if (IS_ERR(bo))
+		return ERR_CAST(bo);
+
+	gem = gray_gem_wrap(kms, bo);
+	if (IS_ERR(gem))
+		return ERR_CAST(gem);
+
+	return &gem->base;
+}
+
+static int gray_gem_dumb_create(struct drm_file *file, struct drm_device *drm,
+				struct drm_mode_create_dumb *args)
+{
+	struct gray_gem_object *gem;
+	u64 pitch, size;
+	int ret;
+
+	/* Scanout is always 32 bpp */
+	if (args->bpp != 32)
+		return -EINVAL;
+
+	pitch = (u64)args->width * 4;
+	size = pitch * args->height;
+	if (!size)
+		return -EINVAL;
+
+	gem = gray_gem_create(to_gray_kms(drm), size);
+	if (IS_ERR(gem))
+		return PTR_ERR(gem);
+
+	ret = drm_gem_handle_create(file, &gem->base, &args->handle);
+	drm_gem_object_put(&gem->base);
+	if (ret)
+		return ret;
+
+	args->pitch = pitch;
+	args->size = gem->base.size;
+	return 0;
+}
+
+static const uint32_t gray_primary_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+};
+
+static const uint32_t gray_cursor_formats[] = {
+	DRM_FORMAT_ARGB8888,
+};
+
+static int gray_primary_atomic_check(struct drm_plane *plane, struct drm_atomic_state *state)
+{
+	struct drm_plane_state *new = drm_atomic_get_new_plane_state(state, plane);
+	struct drm_crtc_state *crtc_state = NULL;
+
+	if (new->crtc)
+		crtc_state = drm_atomic_get_new_crtc_state(state, new->crtc);
+
+	/* The device scans out the whole mode from one VRAM address */
+	return drm_atomic_helper_check_plane_state(new, crtc_state, DRM_PLANE_NO_SCALING,
+						   DRM_PLANE_NO_SCALING, false, false);
+}
+
+static void gray_primary_atomic_update(struct drm_plane *plane, struct drm_atomic_state *state)
+{
+	struct drm_plane_state *new = drm_atomic_get_new_plane_state(state, plane);
+	struct gray_kms_output *out = container_of(plane, struct gray_kms_output, primary);
+	struct gray_gpu_device *gpu = to_gray_kms(plane->dev)->gpu;
+	struct drm_framebuffer *fb = new->fb;
+	struct drm_crtc_state *crtc_state;
+	struct gray_gpu_bo *bo;
+	uint32_t addr;
+
+	if (!new->visible)
+		return;
+
+	crtc_state = drm_atomic_get_new_crtc_state(state, new->crtc);
+	bo = to_gray_gem(fb->obj[0])->bo;
+	addr = bo->offset + fb->offsets[0] + (new->src.y1 >> 16) * fb->pitches[0] +
+	       (new->src.x1 >> 16) * 4;
+
+	gray_gpu_set_mode(gpu, out->head, crtc_state->mode.hdisplay, crtc_state->mode.vdisplay,
+			  fb->pitches[0]);
+
+	/* Take the event before arming, the flip may latch right away */
+	if (crtc_state->event && crtc_state->active && !drm_crtc_vblank_get(new->crtc)) {
+		spin_lock_irq(&plane->dev->event_lock);
+		out->event = crtc_state->event;
+		crtc_state->event = NULL;
+		spin_unlock_irq(&plane->dev->event_lock);
+	}
+
+	kref_get(&bo->ref);
+	gray_gpu_flip_now(gpu, out->head, bo, addr);
+}
+
+static const struct drm_plane_helper_funcs gray_primary_helper_funcs = {
+	.prepare_fb = drm_gem_plane_helper_prepare_fb,
+	.atomic_check = gray_primary_atomic_check,
+	.atomic_update = gray_primary_atomic_update,
+};
+
+static int gray_cursor_atomic_check(struct drm_plane *plane, struct drm_atomic_state *state)
+{
+	struct drm_plane_state *new = drm_atomic_get_new_plane_state(state, plane);
+	struct drm_framebuffer *fb = new->fb;
+	struct drm_crtc_state *crtc_state = NULL;
+	int ret;
+
+	if (new->crtc)
+		crtc_state = drm_atomic_get_new_crtc_state(state, new->crtc);
+
+	ret = drm_atomic_helper_check_plane_state(new, crtc_state, DRM_PLANE_NO_SCALING,
+						  DRM_PLANE_NO_SCALING, true, true);
+	if (ret || !fb)
+		return ret;
+
+	/* REG_CURSOR_COMMIT latches whole packed images */
+	if (fb->width > GRAY_GPU_CURSOR_SIZE || fb->height > GRAY_GPU_CURSOR_SIZE ||
+	    fb->pitches[0] != fb->width * 4 || new->src_x || new->src_y ||
+	    new->src_w >> 16 != fb->width || new->src_h >> 16 != fb->height)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void gray_cursor_atomic_update(struct drm_plane *plane, struct drm_atomic_state *state)
+{
+	struct drm_plane_state *old = drm_atomic_get_old_plane_state(state, plane);
+	struct drm_plane_state *new = drm_atomic_get_new_plane_state(state, plane);
+	struct gray_kms_output *out = container_of(plane, struct gray_kms_output, cursor);
+	struct gray_gpu_device *gpu = to_gray_kms(plane->dev)->gpu;
+	struct drm_framebuffer *fb = new->fb;
+	int x = new->crtc_x, y = new->crtc_y;
+
+	if (!new->visible) {
+		if (old->visible)
+			gray_gpu_enable_cursor(gpu, out->head, false);
+		return;
+	}
+
+	/* The device copies the image at commit, the buffer is free to go after */
+	if (fb != old->fb)
+		gray_gpu_commit_cursor(gpu, out->head,
+				       to_gray_gem(fb->obj[0])->bo->offset + fb->offsets[0],
+				       fb->width, fb->height);
+
+	/* Off the top or left edge: pin at 0 and move the hotspot instead */
+	gray_gpu_set_cursor_hotspot(gpu, out->head, x < 0 ? -x : 0, y < 0 ? -y : 0);
+	gray_gpu_set_cursor_position(gpu, out->head, max(x, 0), max(y, 0));
+
+	if (!old->visible)
+		gray_gpu_enable_cursor(gpu, out->head, true);
+}
+
+static const struct drm_plane_helper_funcs gray_cursor_helper_funcs = {
+	.atomic_check = gray_cursor_atomic_check,
+	.atomic_update = gray_cursor_atomic_update,
+};
+
+static const struct drm_plane_funcs gray_plane_funcs = {
+	.update_plane = drm_atomic_helper_update_plane,
+	.disable_plane = drm_atomic_helper_disable_plane,
+	.destroy = drm_plane_cleanup,
+	.reset = drm_atomic_helper_plane_reset,
+	.atomic_duplicate_state = drm_atomic_helper_plane_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_plane_destroy_state,
+};
+
+static enum drm_mode_status gray_crtc_mode_valid(struct drm_crtc *crtc,
+						 const struct drm_display_mode *mode)
+{
+	struct gray_gpu_device *gpu = to_gray_kms(crtc->dev)->gpu;
+
+	if ((u64)mode->hdisplay * mode->vdisplay * 4 > gpu->vram_usable)
+		return MODE_MEM;
+
+	return MODE_OK;
+}
+
+static int gray_crtc_atomic_check(struct drm_crtc *crtc, struct drm_atomic_state *state)
+{
+	struct drm_crtc_state *crtc_state = drm_atomic_get_new_crtc_state(state, crtc);
+
+	/* Nothing to scan out without a primary plane */
+	if (crtc_state->enable && !(crtc_state->plane_mask & drm_plane_mask(crtc->primary)))
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Events not taken by a primary flip go out at the next vblank */
+static void gray_crtc_atomic_flush(struct drm_crtc *crtc, struct drm_atomic_state *state)
+{
+	struct drm_pending_vblank_event *event = crtc->state->event;
+
+	if (!event)
+		return;
+
+	crtc->state->event = NULL;
+
+	spin_lock_irq(&crtc->dev->event_lock);
+	if (crtc->state->active && !drm_crtc_vblank_get(crtc))
+		drm_crtc_arm_vblank_event(crtc, event);
+	else
+		drm_crtc_send_vblank_event(crtc, event);
+	spin_unlock_irq(&crtc->dev->event_lock);
+}
+
+static void gray_crtc_atomic_enable(struct drm_crtc *crtc, struct drm_atomic_state *state)
+{
+	gray_gpu_enable_display(to_gray_kms(crtc->dev)->gpu, to_gray_output(crtc)->head, true);
+	drm_crtc_vblank_on(crtc);
+}
+
+static void gray_crtc_atomic_disable(struct drm_crtc *crtc, struct drm_atomic_state *state)
+{
+	drm_crtc_vblank_off(crtc);
+	/* Latches any armed flip at once, which sends its event */
+	gray_gpu_enable_display(to_gray_kms(crtc->dev)->gpu, to_gray_output(crtc)->head, false);
+
+	spin_lock_irq(&crtc->dev->event_lock);
+	if (crtc->state->event) {
+		drm_crtc_send_vblank_event(crtc, crtc->state->event);
+		crtc->state->event = NULL;
+	}
+	spin_unlock_irq(&crtc->dev->event_lock);
+}
+
+static const struct drm_crtc_helper_funcs gray_crtc_helper_funcs = {
+	.mode_valid = gray_crtc_mode_valid,
+	.atomic_check = gray_crtc_atomic_check,
+	.atomic_flush = gray_crtc_atomic_flush,
+	.atomic_enable = gray_crtc_atomic_enable,
+	.atomic_disable = gray_crtc_atomic_disable,
+};
+
+static int gray_crtc_enable_vblank(struct drm_crtc *crtc)
+{
+	gray_gpu_vblank_enable(to_gray_kms(crtc->dev)->gpu, to_gray_output(crtc)->head, true);
+	return 0;
+}
+
+static void gray_crtc_disable_vblank(struct drm_crtc *crtc)
+{
+	gray_gpu_vblank_enable(to_gray_kms(crtc->dev)->gpu, to_gray_output(crtc)->head, false);
+}
+
+static const struct drm_crtc_funcs gray_crtc_funcs = {
+	.set_config = drm_atomic_helper_set_config,
+	.page_flip = drm_atomic_helper_page_flip,
+	.destroy = drm_crtc_cleanup,
+	.reset = drm_atomic_helper_crtc_reset,
+	.atomic_duplicate_state = drm_atomic_helper_crtc_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_crtc_destroy_state,
+	.enable_vblank = gray_crtc_enable_vblank,
+	.disable_vblank = gray_crtc_disable_vblank,
+};
+
+static int gray_connector_get_modes(struct drm_connector *connector)
+{
+	int count;
+
+	count = drm_add_modes_noedid(connector, GRAY_KMS_MAX_WIDTH, GRAY_KMS_MAX_HEIGHT);
+	drm_set_preferred_mode(connector, GRAY_KMS_DEF_WIDTH, GRAY_KMS_DEF_HEIGHT);
+
+	return count;
+}
+
+static const struct drm_connector_helper_funcs gray_connector_helper_funcs = {
+	.get_modes = gray_connector_get_modes,
+};
+
+static const struct drm_connector_funcs gray_connector_funcs = {
+	.fill_modes = drm_helper_probe_single_connector_modes,
+	.destroy = drm_connector_cleanup,
+	.reset = drm_atomic_helper_connector_reset,
+	.atomic_duplicate_state = drm_atomic_helper_connector_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_connector_destroy_state,
+};
+
+static const struct drm_mode_config_funcs gray_mode_config_funcs = {
+	.fb_create = drm_gem_fb_create,
+	.atomic_check = drm_atomic_helper_check,
+	.atomic_commit = drm_atomic_helper_commit,
+};
+
+DEFINE_DRM_GEM_FOPS(gray_kms_fops);
+
+static const struct drm_driver gray_kms_driver = {
+	.driver_features = DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
+	.fops = &gray_kms_fops,
+	.dumb_create = gray_gem_dumb_create,
+	.gem_prime_import = gray_gem_prime_import,
+	.name = "gray-gpu",
+	.desc = "Gray GPU",
+	.major = 1,
+	.minor = 0,
+};
+
+/* Called from the vblank irq of a head */
+void gray_kms_vblank(struct gray_kms *kms, unsigned int head)
+{
+	drm_crtc_handle_vblank(&kms->outputs[head].crtc);
+}
+
+/* Called from the flip-done irq of a head once no flip is armed there */
+void gray_kms_flip_done(struct gray_kms *kms, unsigned int head)
+{
+	struct gray_kms_output *out = &kms->outputs[head];
+	unsigned long flags;
+
+	spin_lock_irqsave(&kms->drm.event_lock, flags);
+	if (out->event) {
+		drm_crtc_send_vblank_event(&out->crtc, out->event);
+		drm_crtc_vblank_put(&out->crtc);
+		out->event = NULL;
+	}
+	spin_unlock_irqrestore(&kms->drm.event_lock, flags);
+}
+
+/* Planes, CRTC, encoder and connector of one head; CRTCs must come in head order */
+static int gray_kms_output_init(struct gray_kms *kms, unsigned int head)
+{
+	struct gray_kms_output *out = &kms->outputs[head];
+	struct drm_device *drm = &kms->drm;
+	int ret;
+
+	out->head = head;
+
+	ret = drm_universal_plane_init(drm, &out->primary, BIT(head), &gray_plane_funcs,
+				       gray_primary_formats, ARRAY_SIZE(gray_primary_formats),
+				       NULL, DRM_PLANE_TYPE_PRIMARY, NULL);
+	if (ret)
+		return ret;
+	drm_plane_helper_add(&out->primary, &gray_primary_helper_funcs);
+
+	ret = drm_universal_plane_init(drm, &out->cursor, BIT(head), &gray_plane_funcs,
+				       gray_cursor_formats, ARRAY_SIZE(gray_cursor_formats),
+				       NULL, DRM_PLANE_TYPE_CURSOR, NULL);
+	if (ret)
+		return ret;
+	drm_plane_helper_add(&out->cursor, &gray_cursor_helper_funcs);
+
+	ret = drm_crtc_init_with_planes(drm, &out->crtc, &out->primary, &out->cursor,
+					&gray_crtc_funcs, NULL);
+	if (ret)
+		return ret;
+	drm_crtc_helper_add(&out->crtc, &gray_crtc_helper_funcs);
+
+	ret = drm_simple_encoder_init(drm, &out->encoder, DRM_MODE_ENCODER_VIRTUAL);
+	if (ret)
+		return ret;
+	out->encoder.possible_crtcs = drm_crtc_mask(&out->crtc);
+
+	ret = drm_connector_init(drm, &out->connector, &gray_connector_funcs,
+				 DRM_MODE_CONNECTOR_VIRTUAL);
+	if (ret)
+		return ret;
+	drm_connector_helper_add(&out->connector, &gray_connector_helper_funcs);
+
+	return drm_connector_attach_encoder(&out->connector, &out->encoder);
+}
+
+int gray_kms_init(struct gray_gpu_device *gpu)
+{
+	struct gray_kms *kms;
+	struct drm_device *drm;
+	unsigned int i;
+	int ret;
+
+	kms = devm_drm_dev_alloc(&gpu->pdev->dev, &gray_kms_driver, struct gray_kms, drm);
+	if (IS_ERR(kms))
+		return PTR_ERR(kms);
+
+	kms->gpu = gpu;
+	drm = &kms->drm;
+
+	ret = drmm_mode_config_init(drm);
+	if (ret)
+		return ret;
+
+	drm->mode_config.min_width = 1;
+	drm->mode_config.min_height = 1;
+	drm->mode_config.max_width = GRAY_KMS_MAX_WIDTH;
+	drm->mode_config.max_height = GRAY_KMS_MAX_HEIGHT;
+	drm->mode_config.cursor_width = GRAY_GPU_CURSOR_SIZE;
+	drm->mode_config.cursor_height = GRAY_GPU_CURSOR_SIZE;
+	drm->mode_config.preferred_depth = 24;
+	drm->mode_config.funcs = &gray_mode_config_funcs;
+
+	for (i = 0; i < gpu->num_heads; i++) {
+		ret = gray_kms_output_init(kms, i);
+		if (ret)
+			return ret;
+	}
+	kms->num_outputs = gpu->num_heads;
+
+	ret = drm_vblank_init(drm, kms->num_outputs);
+	if (ret)
+		return ret;
+
+	drm_mode_config_reset(drm);
+
+	/* The irq handlers look at gpu->kms from here on */
+	WRITE_ONCE(gpu->kms, kms);
+
+	ret = drm_dev_register(drm, 0);
+	if (ret) {
+		WRITE_ONCE(gpu->kms, NULL);
+		gray_gpu_sync_irqs(gpu);
+		return ret;
+	}
+
+	dev_info(&gpu->pdev->dev, "DRM device: /dev/dri/card%d, %u output(s)\n",
+		 drm->primary->index, kms->num_outputs);
+	return 0;
+}
+
+/* The drm device is freed by devres, before the irqs; no handler may still hold it */
+void gray_kms_fini(struct gray_gpu_device *gpu)
+{
+	struct gray_kms *kms = gpu->kms;
+
+	if (!kms)
+		return;
+
+	drm_dev_unplug(&kms->drm);
+	drm_atomic_helper_shutdown(&kms->drm);
+	WRITE_ONCE(gpu->kms, NULL);
+	gray_gpu_sync_irqs(gpu);
+}
@@ -0,0 +1,213 @@
+/*
+ * Microbenchmark for the Gray GPU blending kernels (gray-gpu-blend.h)
+ *
+ * Compares the original per-pixel composite_cursor() loop against the
+ * clipped row kernels, first checking that every variant is bit-identical
+ * to the original, then timing a 64x64 cursor and a full-frame overlay.
+ *
+ *   cc -O2 -o gray-gpu-blend-bench gray-gpu-blend-bench.c
+ *   ./gray-gpu-blend-bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gray-gpu-blend.h"
+
+#define FB_WIDTH    800
+#define FB_HEIGHT   600
+#define CURSOR_SIZE 64
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//The loop composite_cursor() used before the row kernels, kept as reference
+static void blend_reference(uint32_t *fb, int fb_width, int fb_height,
+        const uint32_t *img, int img_w, int img_h, int pos_x, int pos_y)
+{
+    for(int cy = 0; cy < img_h; cy++){
+        for(int cx = 0; cx < img_w; cx++){
+            int screen_x = pos_x + cx;
+            int screen_y = pos_y + cy;
+
+            if(screen_x < 0 || screen_x >= fb_width || screen_y < 0 || screen_y >= fb_height){
+                continue;
+            }
+
+            uint32_t cursor_pixel = img[cy * img_w + cx];
+            uint32_t alpha = (cursor_pixel >> 24) & 0xFF;
+
+            if(alpha > 0){
+                int fb_offset = screen_y * fb_width + screen_x;
+
+                if(alpha == 0xFF){
+                    fb[fb_offset] = cursor_pixel;
+                }else{
+                    uint32_t bg = fb[fb_offset];
+                    uint32_t bg_r = (bg >> 16) & 0xFF;
+                    uint32_t bg_g = (bg >> 8) & 0xFF;
+                    uint32_t bg_b = bg & 0xFF;
+
+                    uint32_t fg_r = (cursor_pixel >> 16) & 0xFF;
+                    uint32_t fg_g = (cursor_pixel >> 8) & 0xFF;
+                    uint32_t fg_b = cursor_pixel & 0xFF;
+
+                    uint32_t r_t = (fg_r * alpha + bg_r * (255 - alpha)) / 255;
+                    uint32_t g_t = (fg_g * alpha + bg_g * (255 - alpha)) / 255;
+                    uint32_t b_t = (fg_b * alpha + bg_b * (255 - alpha)) / 255;
+
+                    fb[fb_offset] = 0xFF000000 | (r_t << 16) | (g_t << 8) | b_t;
+                }
+            }
+        }
+    }
+}
+
+//Clip once, then hand whole rows to a span kernel
+static void blend_clipped(GrayBlendSpanFn fn, uint32_t *fb, int fb_width, int fb_height,
+        const uint32_t *img, int img_w, int img_h, int pos_x, int pos_y)
+{
+    int x1 = pos_x < 0 ? 0 : pos_x;
+    int y1 = pos_y < 0 ? 0 : pos_y;
+    int x2 = pos_x + img_w > fb_width ? fb_width : pos_x + img_w;
+    int y2 = pos_y + img_h > fb_height ? fb_height : pos_y + img_h;
+
+    for(int y = y1; y < y2; y++){
+        fn(fb + y * fb_width + x1, img + (y - pos_y) * img_w + (x1 - pos_x), x2 - x1);
+    }
+}
+
+typedef struct Kernel {
+    const char *name;
+    GrayBlendSpanFn fn;
+} Kernel;
+
+static int check_div255(void)
+{
+    for(uint32_t x = 0; x <= 255 * 255; x++){
+        if(gray_blend_div255(x) != x / 255){
+            printf("div255 mismatch at %u\n", x);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int check_kernel(const Kernel *k, uint32_t *img, uint32_t *ref, uint32_t *out, int w, int h)
+{
+    static const int pos[][2] = {
+        { 100, 100 }, { -20, -30 }, { FB_WIDTH - 13, FB_HEIGHT - 7 }, { 3, 5 }, { -63, 200 },
+    };
+
+    for(size_t p = 0; p < sizeof(pos) / sizeof(pos[0]); p++){
+        for(int i = 0; i < FB_WIDTH * FB_HEIGHT; i++){
+            ref[i] = out[i] = rng();
+        }
+        blend_reference(ref, FB_WIDTH, FB_HEIGHT, img, w, h, pos[p][0], pos[p][1]);
+        blend_clipped(k->fn, out, FB_WIDTH, FB_HEIGHT, img, w, h, pos[p][0], pos[p][1]);
+        if(memcmp(ref, out, FB_WIDTH * FB_HEIGHT * 4)){
+            printf("%s: MISMATCH at position %d,%d\n", k->name, pos[p][0], pos[p][1]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void fill_image(uint32_t *img, int n)
+{
+    for(int i = 0; i < n; i++){
+        uint32_t a;
+
+        //Mix of the three cases a cursor has: transparent, opaque, blended
+        switch(rng() % 4){
+        case 0:
+            a = 0;
+            break;
+        case 1:
+            a = 0xFF;
+            break;
+        default:
+            a = rng() & 0xFF;
+            break;
+        }
+        img[i] = (a << 24) | (rng() & 0xFFFFFF);
+    }
+}
+
+static void bench(const char *what, const Kernel *kernels, int nkernels,
+        uint32_t *fb, const uint32_t *img, int w, int h, int iters)
+{
+    double t0 = now_ns();
+
+    for(int i = 0; i < iters; i++){
+        blend_reference(fb, FB_WIDTH, FB_HEIGHT, img, w, h, i % 37, i % 29);
+    }
+    double ref_ns = (now_ns() - t0) / iters;
+    printf("%-22s %-10s %10.1f ns/op  %6.2fx\n", what, "reference", ref_ns, 1.0);
+
+    for(int k = 0; k < nkernels; k++){
+        t0 = now_ns();
+        for(int i = 0; i < iters; i++){
+            blend_clipped(kernels[k].fn, fb, FB_WIDTH, FB_HEIGHT, img, w, h, i % 37, i % 29);
+        }
+        double ns = (now_ns() - t0) / iters;
+        printf("%-22s %-10s %10.1f ns/op  %6.2fx\n", what, kernels[k].name, ns, ref_ns / ns);
+    }
+}
+
+int main(void)
+{
+    Kernel kernels[4];
+    int nkernels = 0;
+    int failed = 0;
+
+    kernels[nkernels++] = (Kernel){ "scalar", gray_blend_argb_span_scalar };
+#ifdef GRAY_BLEND_X86
+    kernels[nkernels++] = (Kernel){ "sse2", gray_blend_argb_span_sse2 };
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        kernels[nkernels++] = (Kernel){ "avx2", gray_blend_argb_span_avx2 };
+    }
+#endif
+#ifdef GRAY_BLEND_NEON
+    kernels[nkernels++] = (Kernel){ "neon", gray_blend_argb_span_neon };
+#endif
+
+    uint32_t *fb = malloc(FB_WIDTH * FB_HEIGHT * 4);
+    uint32_t *ref = malloc(FB_WIDTH * FB_HEIGHT * 4);
+    uint32_t *cursor = malloc(CURSOR_SIZE * CURSOR_SIZE * 4);
+    uint32_t *overlay = malloc(FB_WIDTH * FB_HEIGHT * 4);
+
+    fill_image(cursor, CURSOR_SIZE * CURSOR_SIZE);
+    fill_image(overlay, FB_WIDTH * FB_HEIGHT);
+
+    failed |= check_div255();
+    for(int k = 0; k < nkernels; k++){
+        failed |= check_kernel(&kernels[k], cursor, ref, fb, CURSOR_SIZE, CURSOR_SIZE);
+        failed |= check_kernel(&kernels[k], overlay, ref, fb, FB_WIDTH - 1, FB_HEIGHT - 3);
+    }
+    printf("bit-exact check: %s\n\n", failed ? "FAILED" : "ok");
+
+    bench("cursor 64x64", kernels, nkernels, fb, cursor, CURSOR_SIZE, CURSOR_SIZE, 20000);
+    bench("overlay 800x600", kernels, nkernels, fb, overlay, FB_WIDTH, FB_HEIGHT, 200);
+
+    free(fb);
+    free(ref);
+    free(cursor);
+    free(overlay);
+    return failed;
+}
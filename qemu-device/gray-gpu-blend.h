@@ -0,0 +1,239 @@
+/*
+ * Gray GPU ARGB8888 "over" blending kernels
+ *
+ * Blends a source ARGB row onto a destination row:
+ *   alpha == 0     destination is left untouched
+ *   otherwise      dst = 0xFF000000 | (src * a + dst * (255 - a)) / 255
+ *
+ * Every variant (scalar, SSE2, AVX2, NEON) produces bit-identical output.
+ * The division by 255 is exact for the whole 0..255*255 range:
+ *   x / 255 == (t + (t >> 8)) >> 8   with t = x + 1
+ *
+ * Callers clip once and hand whole rows to gray_blend_argb_rect(), so the
+ * kernels never check bounds per pixel. The header only depends on libc
+ * so it can be shared by the device model, overlay planes and the
+ * standalone benchmark (gray-gpu-blend-bench.c).
+ */
+#ifndef GRAY_GPU_BLEND_H
+#define GRAY_GPU_BLEND_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#define GRAY_BLEND_X86 1
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GRAY_BLEND_NEON 1
+#endif
+
+static inline uint32_t gray_blend_div255(uint32_t x)
+{
+    uint32_t t = x + 1;
+    return (t + (t >> 8)) >> 8;
+}
+
+static inline uint32_t gray_blend_pixel(uint32_t dst, uint32_t src)
+{
+    uint32_t a = src >> 24;
+    uint32_t ia = 255 - a;
+
+    if(a == 0){
+        return dst;
+    }
+
+    uint32_t r = gray_blend_div255(((src >> 16) & 0xFF) * a + ((dst >> 16) & 0xFF) * ia);
+    uint32_t g = gray_blend_div255(((src >> 8) & 0xFF) * a + ((dst >> 8) & 0xFF) * ia);
+    uint32_t b = gray_blend_div255((src & 0xFF) * a + (dst & 0xFF) * ia);
+
+    return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+static inline void gray_blend_argb_span_scalar(uint32_t *dst, const uint32_t *src, int n)
+{
+    for(int i = 0; i < n; i++){
+        dst[i] = gray_blend_pixel(dst[i], src[i]);
+    }
+}
+
+#ifdef GRAY_BLEND_X86
+
+//Blend 8 unpacked 16-bit channels (2 pixels) and divide by 255
+static inline __m128i gray_blend_sse2_half(__m128i s, __m128i d)
+{
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+    __m128i ia = _mm_sub_epi16(_mm_set1_epi16(255), a);
+    __m128i x = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia));
+    __m128i t = _mm_add_epi16(x, _mm_set1_epi16(1));
+
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static inline void gray_blend_argb_span_sse2(uint32_t *dst, const uint32_t *src, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i amask = _mm_set1_epi32((int)0xFF000000);
+    int i = 0;
+
+    for(; i + 4 <= n; i += 4){
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i sa = _mm_and_si128(s, amask);
+        __m128i transparent = _mm_cmpeq_epi32(sa, zero);
+        int tmask = _mm_movemask_epi8(transparent);
+
+        if(tmask == 0xFFFF){
+            continue;
+        }
+        if(_mm_movemask_epi8(_mm_cmpeq_epi32(sa, amask)) == 0xFFFF){
+            _mm_storeu_si128((__m128i *)(dst + i), s);
+            continue;
+        }
+
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i lo = gray_blend_sse2_half(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i hi = gray_blend_sse2_half(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        __m128i res = _mm_or_si128(_mm_packus_epi16(lo, hi), amask);
+
+        res = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, res));
+        _mm_storeu_si128((__m128i *)(dst + i), res);
+    }
+
+    gray_blend_argb_span_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i gray_blend_avx2_half(__m256i s, __m256i d)
+{
+    __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+    __m256i ia = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+    __m256i x = _mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, ia));
+    __m256i t = _mm256_add_epi16(x, _mm256_set1_epi16(1));
+
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline void gray_blend_argb_span_avx2(uint32_t *dst, const uint32_t *src, int n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i amask = _mm256_set1_epi32((int)0xFF000000);
+    int i = 0;
+
+    for(; i + 8 <= n; i += 8){
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i sa = _mm256_and_si256(s, amask);
+        __m256i transparent = _mm256_cmpeq_epi32(sa, zero);
+
+        if(_mm256_movemask_epi8(transparent) == -1){
+            continue;
+        }
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, amask)) == -1){
+            _mm256_storeu_si256((__m256i *)(dst + i), s);
+            continue;
+        }
+
+        //unpack/pack both work per 128-bit lane, so pixel order is preserved
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i lo = gray_blend_avx2_half(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+        __m256i hi = gray_blend_avx2_half(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+        __m256i res = _mm256_or_si256(_mm256_packus_epi16(lo, hi), amask);
+
+        res = _mm256_blendv_epi8(res, d, transparent);
+        _mm256_storeu_si256((__m256i *)(dst + i), res);
+    }
+
+    gray_blend_argb_span_sse2(dst + i, src + i, n - i);
+}
+
+#endif /* GRAY_BLEND_X86 */
+
+#ifdef GRAY_BLEND_NEON
+
+static inline uint8x8_t gray_blend_neon_half(uint8x8_t s, uint8x8_t d, uint8x8_t a)
+{
+    uint16x8_t x = vmlal_u8(vmull_u8(s, a), d, vmvn_u8(a));
+    uint16x8_t t = vaddq_u16(x, vdupq_n_u16(1));
+
+    return vshrn_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+}
+
+static inline void gray_blend_argb_span_neon(uint32_t *dst, const uint32_t *src, int n)
+{
+    const uint32x4_t amask = vdupq_n_u32(0xFF000000);
+    int i = 0;
+
+    for(; i + 4 <= n; i += 4){
+        uint32x4_t s = vld1q_u32(src + i);
+        uint32x4_t d = vld1q_u32(dst + i);
+        uint32x4_t a32 = vshrq_n_u32(s, 24);
+        uint32x4_t transparent = vceqq_u32(a32, vdupq_n_u32(0));
+        uint8x16_t a = vreinterpretq_u8_u32(vmulq_n_u32(a32, 0x01010101));
+        uint8x16_t s8 = vreinterpretq_u8_u32(s);
+        uint8x16_t d8 = vreinterpretq_u8_u32(d);
+        uint8x8_t lo = gray_blend_neon_half(vget_low_u8(s8), vget_low_u8(d8), vget_low_u8(a));
+        uint8x8_t hi = gray_blend_neon_half(vget_high_u8(s8), vget_high_u8(d8), vget_high_u8(a));
+        uint32x4_t res = vorrq_u32(vreinterpretq_u32_u8(vcombine_u8(lo, hi)), amask);
+
+        vst1q_u32(dst + i, vbslq_u32(transparent, d, res));
+    }
+
+    gray_blend_argb_span_scalar(dst + i, src + i, n - i);
+}
+
+#endif /* GRAY_BLEND_NEON */
+
+typedef void (*GrayBlendSpanFn)(uint32_t *dst, const uint32_t *src, int n);
+
+//The widest kernel the host supports
+static inline GrayBlendSpanFn gray_blend_argb_span_select(void)
+{
+#if defined(GRAY_BLEND_X86)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? gray_blend_argb_span_avx2
+                                          : gray_blend_argb_span_sse2;
+#elif defined(GRAY_BLEND_NEON)
+    return gray_blend_argb_span_neon;
+#else
+    return gray_blend_argb_span_scalar;
+#endif
+}
+
+/*
+ * Cached gray_blend_argb_span_select(). Render threads may race on the
+ * first call; every thread picks the same kernel and the pointer is
+ * accessed atomically, so the race is harmless. Callers that start
+ * threads should still call this once first.
+ */
+static inline GrayBlendSpanFn gray_blend_argb_span_fn(void)
+{
+    static GrayBlendSpanFn cached;
+    GrayBlendSpanFn fn = __atomic_load_n(&cached, __ATOMIC_ACQUIRE);
+
+    if(!fn){
+        fn = gray_blend_argb_span_select();
+        __atomic_store_n(&cached, fn, __ATOMIC_RELEASE);
+    }
+    return fn;
+}
+
+static inline void gray_blend_argb_span(uint32_t *dst, const uint32_t *src, int n)
+{
+    gray_blend_argb_span_fn()(dst, src, n);
+}
+
+/*
+ * Blend a w x h source rectangle onto dst. Strides are in pixels and
+ * the caller has already clipped the rectangle to both buffers.
+ */
+static inline void gray_blend_argb_rect(uint32_t *dst, int dst_stride,
+        const uint32_t *src, int src_stride, int w, int h)
+{
+    GrayBlendSpanFn fn = gray_blend_argb_span_fn();
+
+    for(int y = 0; y < h; y++){
+        fn(dst + (ptrdiff_t)y * dst_stride, src + (ptrdiff_t)y * src_stride, w);
+    }
+}
+
+#endif /* GRAY_GPU_BLEND_H */
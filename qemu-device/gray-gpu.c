@@ -1,10 +1,20 @@
 #include "qemu/osdep.h"
 #include "hw/pci/pci.h"
 #include "qemu/units.h"
+#include "qemu/host-utils.h"
+#include "qemu/bitops.h"
 #include "qemu/log.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
 #include "qom/object.h"
 #include "hw/pci/pci_device.h"
+#include "hw/pci/msix.h"
+#include "hw/qdev-properties.h"
 #include "ui/console.h"
+#include "gray-gpu-blend.h"
 #include <stdint.h>
 
 #define TYPE_GRAY_GPU "gray-gpu"
@@ -44,29 +54,248 @@ OBJECT_DECLARE_SIMPLE_TYPE(GrayGPUState, GRAY_GPU);
 #define REG_FLIP_PENDING    0x4C    //Page flip in progress
 #define REG_VBLANK_COUNT    0x50    //Vblank counter
 
+//Interrupt registers
+#define REG_IRQ_STATUS      0x54    //Pending interrupts, write 1 to clear
+#define REG_IRQ_ENABLE      0x58    //Interrupt enable mask
+#define REG_REFRESH_RATE    0x5C    //Vblank rate in Hz (read only)
+
+//Command ring registers
+#define REG_RING_BASE       0x60    //Ring offset in VRAM
+#define REG_RING_SIZE       0x64    //Ring size in bytes, power of two
+#define REG_RING_HEAD       0x68    //Next byte the device reads (read only)
+#define REG_RING_TAIL       0x6C    //End of submitted commands (read only)
+#define REG_RING_DOORBELL   0x70    //Write the new tail to kick the device
+#define REG_FENCE_COMPLETED 0x74    //Seqno of the last executed fence (read only)
+
+//DMA engine registers
+#define REG_DMA_DESC_LO     0x78    //Guest physical address of the descriptor list
+#define REG_DMA_DESC_HI     0x7C
+#define REG_DMA_DESC_COUNT  0x80    //Number of descriptors
+#define REG_DMA_START       0x84    //Write a cookie to start the transfer
+#define REG_DMA_STATUS      0x88    //DMA_STATUS_* (read only)
+#define REG_DMA_COMPLETED   0x8C    //Cookie of the last finished transfer (read only)
+
+//Bulk cursor upload: the image is staged in VRAM and latched with one write
+#define REG_CURSOR_BASE     0x90    //VRAM offset of the staged image
+#define REG_CURSOR_COMMIT   0x94    //Write (height << 16) | width to latch it
+
+//Flip to any VRAM offset instead of one of the REG_FB_COUNT slots
+#define REG_FB_NEXT_ADDR    0x98    //Sets REG_FB_NEXT to FB_INDEX_ADDR
+#define FB_INDEX_ADDR       0xFFFFFFFF
+
+/*
+ * Scanout heads. The registers above program head 0; head n has its own
+ * copy of the per-head ones (REG_FB_*, REG_CURSOR_*, REG_PAGE_FLIP,
+ * REG_FLIP_PENDING, REG_VBLANK_COUNT) at the same offsets in the block at
+ * n * REG_HEAD_STRIDE. Control, interrupts, ring and DMA stay in block 0.
+ */
+#define REG_HEAD_COUNT      0x9C    //Number of heads (read only)
+#define REG_HEAD_STRIDE     0x100
+#define GRAY_GPU_MAX_HEADS  4
+
+/*
+ * Overlay planes, per head like the registers above. The OVL_* registers
+ * of overlay n sit at REG_OVERLAY(n, reg) and only fill a staged copy;
+ * writing a mask of overlays to REG_OVERLAY_COMMIT latches them at once.
+ * Enabled overlays are stacked over the framebuffer by OVL_ZPOS (ties by
+ * index) and under the cursor, scaled to the destination size with
+ * nearest-neighbour sampling.
+ */
+#define REG_OVERLAY_COMMIT  0xA0    //Mask of overlays to latch
+#define REG_OVERLAY_COUNT   0xA4    //Overlays per head (read only)
+#define REG_OVERLAY_BASE    0xC0
+#define REG_OVERLAY_STRIDE  0x20
+#define REG_OVERLAY(n, reg) (REG_OVERLAY_BASE + (n) * REG_OVERLAY_STRIDE + (reg))
+#define OVL_ADDR            0x00    //VRAM offset of the first source pixel
+#define OVL_PITCH           0x04    //Source pitch in bytes
+#define OVL_FORMAT          0x08    //OVERLAY_FORMAT_*
+#define OVL_SRC_SIZE        0x0C    //(height << 16) | width
+#define OVL_DST_POS         0x10    //(y << 16) | x, both signed 16 bit
+#define OVL_DST_SIZE        0x14    //(height << 16) | width
+#define OVL_ZPOS            0x18
+#define OVL_ENABLE          0x1C
+#define GRAY_GPU_MAX_OVERLAYS   2
+
+#define OVERLAY_FORMAT_XRGB8888 0   //Opaque, alpha byte ignored
+#define OVERLAY_FORMAT_ARGB8888 1   //Blended like the cursor
+#define OVERLAY_SPAN            256 //Scaled pixels gathered per blend call
+
+/*
+ * Mode of the flip target. Writing either register stages a 32 bpp mode
+ * that takes effect when the next flip latches, so the old buffer is never
+ * shown with the new geometry.
+ */
+#define REG_FB_NEXT_SIZE    0xA8    //(height << 16) | width
+#define REG_FB_NEXT_PITCH   0xAC
+
 
 //Contorl register bit
 #define CTRL_RESET      (1 << 0)
 #define CTRL_ENABLE     (1 << 1)
+#define CTRL_DMA_RESET  (1 << 2)    //Abort the DMA engine, self clearing
 
 //Status register bit 
 #define STATUS_READY    (1 << 0)
 #define STATUS_VBLANK   (1 << 1)
 #define STATUS_CURSOR_LOADED    (1 << 2) //cursor image loaded
 
+//Interrupt bits, shared by REG_IRQ_STATUS and REG_IRQ_ENABLE
+#define IRQ_VBLANK      (1 << 0)
+#define IRQ_FLIP_DONE   (1 << 1)
+#define IRQ_CMD_DONE    (1 << 2)
+#define IRQ_DMA_DONE    (1 << 3)
+//Heads past 0 get their own vblank and flip done bits after the shared ones
+#define IRQ_HEAD_VBLANK(n)      ((n) ? 1u << (2 + 2 * (n)) : IRQ_VBLANK)
+#define IRQ_HEAD_FLIP_DONE(n)   ((n) ? 1u << (3 + 2 * (n)) : IRQ_FLIP_DONE)
+#define IRQ_ALL         ((1u << GRAY_GPU_MSIX_VECTORS) - 1)
 
-typedef struct GrayGPUState
+//DMA status bits
+#define DMA_STATUS_BUSY     (1 << 0)
+#define DMA_STATUS_ERROR    (1 << 1)    //Last transfer stopped on a bad descriptor
+
+/*
+ * DMA descriptors are 32 bytes, little endian, in guest memory:
+ *    0  u64 sys_addr     guest physical address of the first row
+ *    8  u32 vram_offset
+ *   12  u32 row_bytes
+ *   16  u32 rows
+ *   20  u32 sys_pitch
+ *   24  u32 vram_pitch
+ *   28  u32 flags        DMA_DESC_TO_SYSTEM copies VRAM to system memory
+ */
+#define DMA_DESC_SIZE       32
+#define DMA_DESC_TO_SYSTEM  (1 << 0)
+#define GRAY_GPU_DMA_MAX_DESC   4096
+
+/*
+ * Ring commands are little endian dwords: a header with the opcode in
+ * bits 31:24 and the payload length in dwords in bits 15:0, followed by
+ * the payload. Positions wrap modulo the ring size, so a command may
+ * straddle the end of the ring.
+ */
+#define CMD_OPCODE(hdr)     ((hdr) >> 24)
+#define CMD_LENGTH(hdr)     ((hdr) & 0xFFFF)
+#define CMD_NOP             0x00    //Payload ignored
+#define CMD_SET_REG         0x01    //(register, value) pairs
+#define CMD_FENCE           0x02    //seqno -> REG_FENCE_COMPLETED, raises IRQ_CMD_DONE
+
+/*
+ * Stall the ring until the next vblank of head 0, or of the head given in
+ * an optional payload dword. The commands after it then run right after
+ * that vblank's flip latch, before anything is scanned out, so a whole
+ * state change shows up in one frame. Without a running scanout on that
+ * head it does not wait.
+ */
+#define CMD_WAIT_VBLANK     0x07
+
+/*
+ * 2D engine, 32bpp only. Offsets and pitches are in bytes within VRAM and
+ * must be 4 byte aligned:
+ *   FILL      dst, dst_pitch, width, height, colour
+ *   COPY      src, src_pitch, dst, dst_pitch, width, height (any overlap)
+ *   BLEND     src, src_pitch, dst, dst_pitch, width, height (ARGB over dst)
+ *   COPY_KEY  src, src_pitch, dst, dst_pitch, width, height, key
+ *             (source pixels whose RGB equals the key's are skipped)
+ * BLEND and COPY_KEY work in place on dst, so src and dst must not overlap.
+ */
+#define CMD_FILL            0x03
+#define CMD_COPY            0x04
+#define CMD_BLEND           0x05
+#define CMD_COPY_KEY        0x06
+#define CMD_FILL_LEN        5
+#define CMD_COPY_LEN        6
+#define CMD_COPY_KEY_LEN    7
+
+#define GRAY_GPU_RING_MIN_SIZE  (4 * KiB)
+
+//MSI-X vectors, vector n fires for IRQ bit n; table and PBA live in BAR2
+#define GRAY_GPU_MSIX_BAR       2
+#define GRAY_GPU_VECTOR_VBLANK  0
+#define GRAY_GPU_VECTOR_FLIP    1
+#define GRAY_GPU_VECTOR_CMD     2
+#define GRAY_GPU_VECTOR_DMA     3
+#define GRAY_GPU_MSIX_VECTORS   (2 + 2 * GRAY_GPU_MAX_HEADS)
+
+//Render worker pool, see gray_gpu_workers_split()
+#define GRAY_GPU_MAX_WORKERS        16
+#define GRAY_GPU_AUTO_WORKERS       4       //cap for "render-threads=-1"
+#define GRAY_GPU_SPLIT_MIN_BYTES    (256 * KiB) //smaller jobs run inline
+#define GRAY_GPU_BAND_MIN_BYTES     (64 * KiB)
+
+#define GRAY_GPU_DEFAULT_REFRESH_RATE   60
+#define GRAY_GPU_MAX_REFRESH_RATE       240
+
+
+//One decoded 2D engine command
+typedef struct GrayGPUBlit
 {
-    PCIDevice parent_obj;
+    uint32_t op;
+    uint32_t src, src_pitch;
+    uint32_t dst, dst_pitch;
+    uint32_t width, height;
+    uint32_t color;     //fill colour or colour key
+}GrayGPUBlit;
 
-    //Memory Region
-    MemoryRegion registers;
-    MemoryRegion vram;
+//Runs rows [y1, y2) of a job on a worker or the main loop thread
+typedef void GrayGPUBandFn(GrayGPUState *g, const void *arg, uint32_t y1, uint32_t y2);
 
-    //Device status
-    uint32_t device_id;
-    uint32_t status;
-    uint32_t control;
+/*
+ * Worker threads sharing one job at a time. Jobs are split in bands of
+ * rows that workers claim under lock and run without the BQL. They write
+ * only VRAM or buffers the job owns, and read only device state that
+ * cannot change until the job is done: the decoded blit, which the ring
+ * waits on, or a head's scanout, framebuffer and overlays, read while the
+ * BQL holder waits for the shadow copy.
+ */
+typedef struct GrayGPUWorkers
+{
+    QemuThread threads[GRAY_GPU_MAX_WORKERS];
+    int nthreads;
+    QemuMutex lock;
+    QemuCond work_cond;     //a job was queued, or exiting
+    QemuCond done_cond;     //the last band finished
+    bool exiting;
+
+    //Current job, idle when rows_done == rows
+    GrayGPUBandFn *fn;
+    const void *arg;
+    uint32_t rows;
+    uint32_t band;
+    uint32_t next_row;
+    uint32_t rows_done;
+    bool async;             //kick the ring bottom half on completion
+}GrayGPUWorkers;
+
+//One overlay plane, see REG_OVERLAY()
+typedef struct GrayGPUOverlay
+{
+    uint32_t addr;
+    uint32_t pitch;
+    uint32_t format;
+    uint32_t src_width, src_height;
+    int32_t dst_x, dst_y;
+    uint32_t dst_width, dst_height;
+    uint32_t zpos;
+    uint32_t enable;
+}GrayGPUOverlay;
+
+//Damaged screen area, x2/y2 exclusive. Empty when x1 >= x2.
+typedef struct GrayGPURect
+{
+    int x1, y1;
+    int x2, y2;
+}GrayGPURect;
+
+/*
+ * One scanout head: mode, flip state, cursor, vblank timer and console.
+ * Heads only share VRAM and the device wide engines.
+ */
+typedef struct GrayGPUHead
+{
+    GrayGPUState *g;
+    uint32_t index;
+
+    //Mode
     uint32_t fb_addr;
     uint32_t fb_width;
     uint32_t fb_height;
@@ -81,6 +310,15 @@ typedef struct GrayGPUState
     uint32_t flip_pending;
     uint32_t vblank_count;
     uint32_t fb_addresses[4];
+    uint32_t fb_next_addr;  //flip target when fb_next == FB_INDEX_ADDR
+    uint32_t next_width;    //REG_FB_NEXT_SIZE/PITCH, applied by the flip latch
+    uint32_t next_height;
+    uint32_t next_pitch;
+    bool next_mode;
+
+    //Vblank
+    QEMUTimer *vblank_timer;
+    int64_t vblank_next;    //QEMU_CLOCK_VIRTUAL time of the next vblank
 
     //Cursor state
     uint32_t cursor_x;
@@ -90,71 +328,711 @@ typedef struct GrayGPUState
     uint32_t cursor_hotspot_y;
     uint32_t cursor_data[CURSOR_SIZE * CURSOR_SIZE]; //Argb format
     uint32_t cursor_upload_offset;
+    uint32_t cursor_base;   //VRAM offset REG_CURSOR_COMMIT copies from
+    bool cursor_define;     //image or hotspot changed, resend to the UI
+    bool cursor_moved;      //position changed, resend to the UI
+
+    //Overlay planes, the OVL_* registers write the staged copy
+    GrayGPUOverlay overlay_staged[GRAY_GPU_MAX_OVERLAYS];
+    GrayGPUOverlay overlays[GRAY_GPU_MAX_OVERLAYS];
+    uint32_t overlay_order[GRAY_GPU_MAX_OVERLAYS];  //enabled ones, bottom first
+    uint32_t overlay_count;
 
     //Display
     QemuConsole *console;
+    bool invalidate;    //register state changed, redraw everything
+    GrayGPURect damage; //union of areas changed since last refresh
+
+    //Surface currently handed to the console and what it was built from
+    DisplaySurface *scanout;
+    uint32_t scanout_addr;
+    uint32_t scanout_width;
+    uint32_t scanout_height;
+    uint32_t scanout_pitch;
+    bool scanout_shadow;
+    bool scanout_soft_cursor;   //cursor blended into the shadow, not sent to the UI
+}GrayGPUHead;
+
+typedef struct GrayGPUState
+{
+    PCIDevice parent_obj;
+
+    //Memory Region
+    MemoryRegion registers;
+    MemoryRegion vram;
     uint8_t *vram_ptr;
-    bool dirty;
+
+    //Device status
+    uint32_t device_id;
+    uint32_t status;        //STATUS_VBLANK follows head 0
+    uint32_t control;
+
+    //Scanout heads
+    GrayGPUHead heads[GRAY_GPU_MAX_HEADS];
+    uint32_t num_heads;     //"heads" property
+
+    //Vblank and interrupts
+    uint32_t refresh_rate;  //"refresh-rate" property, Hz, same for every head
+    uint32_t irq_status;
+    uint32_t irq_enable;
+    bool msix;              //"msix" property, falls back to INTx when unavailable
+
+    //Command ring, processed from a bottom half after a doorbell write
+    QEMUBH *ring_bh;
+    uint32_t ring_base;
+    uint32_t ring_size;
+    uint32_t ring_head;
+    uint32_t ring_tail;
+    uint32_t fence_completed;
+    bool ring_wait_vblank;  //stalled on CMD_WAIT_VBLANK
+    uint32_t ring_wait_head;    //head whose vblank resumes it
+
+    //DMA engine, runs a descriptor list from a bottom half
+    QEMUBH *dma_bh;
+    uint64_t dma_desc;
+    uint32_t dma_desc_count;
+    uint32_t dma_cookie;    //cookie of the transfer in flight
+    uint32_t dma_status;
+    uint32_t dma_completed;
+
+    //2D engine, a split blit runs on the workers while the ring waits
+    GrayGPUWorkers workers;
+    int32_t render_threads; //"render-threads" property, -1 picks from host CPUs
+    GrayGPUBlit blit;
+    bool blit_active;
 }GrayGPUState;
 
-static uint64_t gray_gpu_vram_read(void *opaque, hwaddr addr, unsigned size)
+static void gray_gpu_damage_rect(GrayGPUHead *s, int x, int y, int w, int h)
 {
-    GrayGPUState *g = GRAY_GPU(opaque);
-    if(addr + size > GRAY_GPU_VRAM_SIZE){
-        return 0;
+    GrayGPURect *d = &s->damage;
+    int x1 = MAX(x, 0);
+    int y1 = MAX(y, 0);
+    int x2 = MIN(x + w, (int)s->fb_width);
+    int y2 = MIN(y + h, (int)s->fb_height);
+
+    if(x1 >= x2 || y1 >= y2){
+        return;
     }
 
-    switch(size){
-        case 1:
-            return ldub_p(g->vram_ptr + addr);
-        case 2:
-            return lduw_p(g->vram_ptr + addr);
-        case 4:
-            return ldl_p(g->vram_ptr + addr);
-        case 8:
-            return ldq_p(g->vram_ptr + addr);
+    if(d->x1 >= d->x2){
+        d->x1 = x1;
+        d->y1 = y1;
+        d->x2 = x2;
+        d->y2 = y2;
+        return;
     }
-    return 0;
+
+    d->x1 = MIN(d->x1, x1);
+    d->y1 = MIN(d->y1, y1);
+    d->x2 = MAX(d->x2, x2);
+    d->y2 = MAX(d->y2, y2);
 }
 
-static void gray_gpu_vram_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
+static void gray_gpu_damage_cursor(GrayGPUHead *s)
 {
-    GrayGPUState *g = GRAY_GPU(opaque);
-    if(addr + size > GRAY_GPU_VRAM_SIZE){
+    //A UI-side cursor never touches the frame, nothing to redraw
+    if(!s->cursor_enabled || !s->scanout_soft_cursor){
         return;
     }
 
-    switch(size){
-        case 1:
-            stb_p(g->vram_ptr + addr, val);
+    gray_gpu_damage_rect(s, (int)s->cursor_x - (int)s->cursor_hotspot_x,
+            (int)s->cursor_y - (int)s->cursor_hotspot_y,
+            CURSOR_SIZE, CURSOR_SIZE);
+}
+
+static void gray_gpu_damage_overlay(GrayGPUHead *s, const GrayGPUOverlay *o)
+{
+    if(o->enable){
+        gray_gpu_damage_rect(s, o->dst_x, o->dst_y, o->dst_width, o->dst_height);
+    }
+}
+
+/*
+ * Damage the screen rows an overlay shows of source rows touched by VRAM
+ * [offset, offset + size), mapped through its vertical scaling
+ */
+static void gray_gpu_damage_overlay_vram(GrayGPUHead *s, const GrayGPUOverlay *o,
+        uint64_t offset, uint64_t size)
+{
+    if(offset + size <= o->addr){
+        return;
+    }
+
+    uint64_t sy1 = (offset > o->addr ? offset - o->addr : 0) / o->pitch;
+    uint64_t sy2 = MIN(DIV_ROUND_UP(offset + size - o->addr, o->pitch), o->src_height);
+
+    if(sy1 >= o->src_height){
+        return;
+    }
+
+    int y1 = sy1 * o->dst_height / o->src_height;
+    int y2 = DIV_ROUND_UP(sy2 * o->dst_height, o->src_height);
+
+    gray_gpu_damage_rect(s, o->dst_x, o->dst_y + y1, o->dst_width, y2 - y1);
+}
+
+/*
+ * Damage the scanlines of every head that shows part of VRAM
+ * [offset, offset + size), in its framebuffer or an overlay. All heads
+ * read the same dirty log, so the head that snapshots it passes what it
+ * found on to the others, e.g. a second head cloning the same buffer.
+ */
+static void gray_gpu_damage_vram(GrayGPUState *g, uint64_t offset, uint64_t size)
+{
+    for(uint32_t i = 0; i < g->num_heads; i++){
+        GrayGPUHead *s = &g->heads[i];
+
+        if(!s->fb_enable){
+            continue;
+        }
+
+        for(uint32_t j = 0; j < s->overlay_count; j++){
+            gray_gpu_damage_overlay_vram(s, &s->overlays[s->overlay_order[j]], offset, size);
+        }
+
+        if(s->fb_pitch == 0 || offset + size <= s->fb_addr){
+            continue;
+        }
+
+        uint64_t y1 = (offset > s->fb_addr ? offset - s->fb_addr : 0) / s->fb_pitch;
+        uint64_t y2 = DIV_ROUND_UP(offset + size - s->fb_addr, s->fb_pitch);
+
+        if(y1 >= s->fb_height){
+            continue;
+        }
+        gray_gpu_damage_rect(s, 0, y1, s->fb_width, MIN(y2, s->fb_height) - y1);
+    }
+}
+
+//INTx level; unused once the guest switched to MSI-X
+static void gray_gpu_update_irq(GrayGPUState *g)
+{
+    PCIDevice *pci_dev = PCI_DEVICE(g);
+
+    pci_set_irq(pci_dev, !msix_enabled(pci_dev) &&
+            (g->irq_status & g->irq_enable) != 0);
+}
+
+static void gray_gpu_raise_irq(GrayGPUState *g, uint32_t bits)
+{
+    PCIDevice *pci_dev = PCI_DEVICE(g);
+
+    /*
+     * With MSI-X every source has its own vector, so the event is fully
+     * described by the message and nothing is latched in REG_IRQ_STATUS.
+     */
+    if(msix_enabled(pci_dev)){
+        bits &= g->irq_enable;
+        for(int i = 0; i < GRAY_GPU_MSIX_VECTORS; i++){
+            if(bits & (1u << i)){
+                msix_notify(pci_dev, i);
+            }
+        }
+        return;
+    }
+
+    g->irq_status |= bits;
+    gray_gpu_update_irq(g);
+}
+
+//Scan out fb_next from now on; called at vblank, or at once with no scanout
+static void gray_gpu_latch_flip(GrayGPUHead *s)
+{
+    s->fb_current = s->fb_next;
+    s->fb_addr = s->fb_current == FB_INDEX_ADDR ? s->fb_next_addr
+                                                : s->fb_addresses[s->fb_current];
+    if(s->next_mode){
+        s->fb_width = s->next_width;
+        s->fb_height = s->next_height;
+        s->fb_bpp = 32;
+        s->fb_pitch = s->next_pitch;
+        s->next_mode = false;
+    }
+    s->flip_pending = 0;
+    s->invalidate = true;
+}
+
+static void gray_gpu_ring_process(void *opaque);
+
+static void gray_gpu_vblank(void *opaque)
+{
+    GrayGPUHead *s = opaque;
+    GrayGPUState *g = s->g;
+    uint32_t irqs = IRQ_HEAD_VBLANK(s->index);
+
+    s->vblank_count++;
+    if(s->index == 0){
+        g->status |= STATUS_VBLANK;
+    }
+
+    if(s->flip_pending){
+        gray_gpu_latch_flip(s);
+        irqs |= IRQ_HEAD_FLIP_DONE(s->index);
+    }
+    gray_gpu_raise_irq(g, irqs);
+
+    //Schedule from the previous deadline so the rate does not drift
+    s->vblank_next += NANOSECONDS_PER_SECOND / g->refresh_rate;
+    timer_mod(s->vblank_timer, s->vblank_next);
+
+    /*
+     * Run commands held by CMD_WAIT_VBLANK now rather than from a bottom
+     * half that could miss the frame. The timer is already re-armed, so a
+     * flip or another wait in them targets the next vblank.
+     */
+    if(g->ring_wait_vblank && g->ring_wait_head == s->index){
+        g->ring_wait_vblank = false;
+        gray_gpu_ring_process(g);
+    }
+}
+
+//Vblanks are only generated while the head is scanning out
+static void gray_gpu_vblank_start(GrayGPUHead *s)
+{
+    if(timer_pending(s->vblank_timer)){
+        return;
+    }
+    s->vblank_next = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+        NANOSECONDS_PER_SECOND / s->g->refresh_rate;
+    timer_mod(s->vblank_timer, s->vblank_next);
+}
+
+static void gray_gpu_vblank_stop(GrayGPUHead *s)
+{
+    GrayGPUState *g = s->g;
+
+    timer_del(s->vblank_timer);
+
+    //Nothing is scanning out, so a queued flip can take effect right away
+    if(s->flip_pending){
+        gray_gpu_latch_flip(s);
+        gray_gpu_raise_irq(g, IRQ_HEAD_FLIP_DONE(s->index));
+    }
+
+    //Same for a stalled ring; this may run from the ring itself, so defer
+    if(g->ring_wait_vblank && g->ring_wait_head == s->index){
+        g->ring_wait_vblank = false;
+        qemu_bh_schedule(g->ring_bh);
+    }
+}
+
+/*
+ * Latch a width x height image, packed rows of width pixels, from VRAM at
+ * cursor_base. Anything outside it is transparent.
+ */
+static void gray_gpu_cursor_commit(GrayGPUHead *s, uint32_t width, uint32_t height)
+{
+    GrayGPUState *g = s->g;
+    uint64_t size = (uint64_t)width * height * 4;
+
+    if(width == 0 || height == 0 || width > CURSOR_SIZE || height > CURSOR_SIZE ||
+            s->cursor_base & 3 || s->cursor_base + size > GRAY_GPU_VRAM_SIZE){
+        qemu_log_mask(LOG_GUEST_ERROR, "Invalid cursor commit %ux%u at 0x%x\n",
+                width, height, s->cursor_base);
+        return;
+    }
+
+    gray_gpu_damage_cursor(s);
+    memset(s->cursor_data, 0, sizeof(s->cursor_data));
+    for(uint32_t y = 0; y < height; y++){
+        memcpy(&s->cursor_data[y * CURSOR_SIZE],
+               g->vram_ptr + s->cursor_base + y * width * 4, width * 4);
+    }
+
+    s->cursor_upload_offset = 0;
+    g->status |= STATUS_CURSOR_LOADED;
+    s->cursor_define = true;
+    gray_gpu_damage_cursor(s);
+}
+
+static bool gray_gpu_blit_fits(uint32_t offset, uint32_t pitch, uint32_t width, uint32_t height);
+
+static bool gray_gpu_overlay_valid(const GrayGPUOverlay *o)
+{
+    if(o->format != OVERLAY_FORMAT_XRGB8888 && o->format != OVERLAY_FORMAT_ARGB8888){
+        return false;
+    }
+    if(o->src_width == 0 || o->src_height == 0 || o->dst_width == 0 || o->dst_height == 0){
+        return false;
+    }
+    return gray_gpu_blit_fits(o->addr, o->pitch, o->src_width, o->src_height);
+}
+
+/*
+ * Latch the staged registers of the overlays in mask. An invalid overlay
+ * keeps showing what it showed before.
+ */
+static void gray_gpu_overlay_commit(GrayGPUHead *s, uint32_t mask)
+{
+    for(uint32_t i = 0; i < GRAY_GPU_MAX_OVERLAYS; i++){
+        const GrayGPUOverlay *n = &s->overlay_staged[i];
+        GrayGPUOverlay *o = &s->overlays[i];
+
+        if(!(mask & (1u << i))){
+            continue;
+        }
+        if(n->enable && !gray_gpu_overlay_valid(n)){
+            qemu_log_mask(LOG_GUEST_ERROR, "Invalid overlay %u: %ux%u at 0x%x pitch %u format %u\n",
+                    i, n->src_width, n->src_height, n->addr, n->pitch, n->format);
+            continue;
+        }
+
+        gray_gpu_damage_overlay(s, o);
+        *o = *n;
+        gray_gpu_damage_overlay(s, o);
+    }
+
+    //Stack the enabled ones by zpos, the index breaks ties
+    s->overlay_count = 0;
+    for(uint32_t i = 0; i < GRAY_GPU_MAX_OVERLAYS; i++){
+        uint32_t j = s->overlay_count;
+
+        if(!s->overlays[i].enable){
+            continue;
+        }
+        while(j > 0 && s->overlays[s->overlay_order[j - 1]].zpos > s->overlays[i].zpos){
+            s->overlay_order[j] = s->overlay_order[j - 1];
+            j--;
+        }
+        s->overlay_order[j] = i;
+        s->overlay_count++;
+    }
+}
+
+static bool gray_gpu_ring_valid(GrayGPUState *g)
+{
+    return g->ring_size >= GRAY_GPU_RING_MIN_SIZE && is_power_of_2(g->ring_size) &&
+        (g->ring_base & 3) == 0 &&
+        (uint64_t)g->ring_base + g->ring_size <= GRAY_GPU_VRAM_SIZE;
+}
+
+//Claim and run one band of the current job. Called and returns with lock held.
+static bool gray_gpu_workers_run_band(GrayGPUState *g)
+{
+    GrayGPUWorkers *w = &g->workers;
+
+    if(w->next_row >= w->rows){
+        return false;
+    }
+
+    GrayGPUBandFn *fn = w->fn;
+    const void *arg = w->arg;
+    uint32_t y1 = w->next_row;
+    uint32_t y2 = MIN(y1 + w->band, w->rows);
+
+    w->next_row = y2;
+    qemu_mutex_unlock(&w->lock);
+    fn(g, arg, y1, y2);
+    qemu_mutex_lock(&w->lock);
+
+    w->rows_done += y2 - y1;
+    if(w->rows_done == w->rows){
+        qemu_cond_broadcast(&w->done_cond);
+        if(w->async){
+            qemu_bh_schedule(g->ring_bh);
+        }
+    }
+    return true;
+}
+
+static void *gray_gpu_worker_thread(void *opaque)
+{
+    GrayGPUState *g = opaque;
+    GrayGPUWorkers *w = &g->workers;
+
+    qemu_mutex_lock(&w->lock);
+    while(!w->exiting){
+        if(!gray_gpu_workers_run_band(g)){
+            qemu_cond_wait(&w->work_cond, &w->lock);
+        }
+    }
+    qemu_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static bool gray_gpu_workers_idle(GrayGPUState *g)
+{
+    GrayGPUWorkers *w = &g->workers;
+    bool idle;
+
+    qemu_mutex_lock(&w->lock);
+    idle = w->rows_done == w->rows;
+    qemu_mutex_unlock(&w->lock);
+    return idle;
+}
+
+//Block until the current job is done, helping out with unclaimed bands
+static void gray_gpu_workers_wait(GrayGPUState *g)
+{
+    GrayGPUWorkers *w = &g->workers;
+
+    if(w->nthreads == 0){
+        return;
+    }
+
+    qemu_mutex_lock(&w->lock);
+    while(w->rows_done != w->rows){
+        if(!gray_gpu_workers_run_band(g)){
+            qemu_cond_wait(&w->done_cond, &w->lock);
+        }
+    }
+    qemu_mutex_unlock(&w->lock);
+}
+
+/*
+ * Run fn over rows [0, rows). Small jobs, or every job without worker
+ * threads, run inline. Otherwise the rows are split in bands across the
+ * workers: a synchronous job is waited for (the caller helps), an async
+ * one returns true and schedules the ring bottom half when done. Only
+ * one job is in flight at a time; while the workers are busy further
+ * jobs run inline rather than wait.
+ */
+static bool gray_gpu_workers_split(GrayGPUState *g, GrayGPUBandFn *fn, const void *arg,
+        uint32_t rows, uint32_t row_bytes, bool async)
+{
+    GrayGPUWorkers *w = &g->workers;
+
+    if(w->nthreads == 0 || (uint64_t)rows * row_bytes < GRAY_GPU_SPLIT_MIN_BYTES){
+        fn(g, arg, 0, rows);
+        return false;
+    }
+
+    //A few bands per thread for balance, but not so thin they thrash
+    uint32_t band = MAX(rows / (w->nthreads * 4), 1);
+    band = MAX(band, DIV_ROUND_UP(GRAY_GPU_BAND_MIN_BYTES, row_bytes));
+
+    qemu_mutex_lock(&w->lock);
+    if(w->rows_done != w->rows){
+        qemu_mutex_unlock(&w->lock);
+        fn(g, arg, 0, rows);
+        return false;
+    }
+    w->fn = fn;
+    w->arg = arg;
+    w->rows = rows;
+    w->band = band;
+    w->next_row = 0;
+    w->rows_done = 0;
+    w->async = async;
+    qemu_cond_broadcast(&w->work_cond);
+    qemu_mutex_unlock(&w->lock);
+
+    if(!async){
+        gray_gpu_workers_wait(g);
+        return false;
+    }
+    return true;
+}
+
+static void gray_gpu_workers_init(GrayGPUState *g, int nthreads)
+{
+    GrayGPUWorkers *w = &g->workers;
+
+    qemu_mutex_init(&w->lock);
+    qemu_cond_init(&w->work_cond);
+    qemu_cond_init(&w->done_cond);
+    w->exiting = false;
+    w->rows = 0;
+    w->rows_done = 0;
+
+    for(w->nthreads = 0; w->nthreads < nthreads; w->nthreads++){
+        qemu_thread_create(&w->threads[w->nthreads], "gray-gpu-render",
+                gray_gpu_worker_thread, g, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void gray_gpu_workers_exit(GrayGPUState *g)
+{
+    GrayGPUWorkers *w = &g->workers;
+
+    gray_gpu_workers_wait(g);
+
+    qemu_mutex_lock(&w->lock);
+    w->exiting = true;
+    qemu_cond_broadcast(&w->work_cond);
+    qemu_mutex_unlock(&w->lock);
+
+    for(int i = 0; i < w->nthreads; i++){
+        qemu_thread_join(&w->threads[i]);
+    }
+    w->nthreads = 0;
+
+    qemu_cond_destroy(&w->done_cond);
+    qemu_cond_destroy(&w->work_cond);
+    qemu_mutex_destroy(&w->lock);
+}
+
+//Staged overlay registers, false if reg is not one of them
+static bool gray_gpu_overlay_read(GrayGPUHead *s, hwaddr reg, uint64_t *val)
+{
+    if(reg < REG_OVERLAY_BASE || reg >= REG_OVERLAY(GRAY_GPU_MAX_OVERLAYS, 0)){
+        return false;
+    }
+
+    const GrayGPUOverlay *o = &s->overlay_staged[(reg - REG_OVERLAY_BASE) / REG_OVERLAY_STRIDE];
+
+    switch((reg - REG_OVERLAY_BASE) % REG_OVERLAY_STRIDE){
+        case OVL_ADDR:
+            *val = o->addr;
+            break;
+        case OVL_PITCH:
+            *val = o->pitch;
             break;
-        case 2:
-            stw_p(g->vram_ptr + addr, val);
+        case OVL_FORMAT:
+            *val = o->format;
             break;
-        case 4:
-            stl_p(g->vram_ptr + addr, val);
+        case OVL_SRC_SIZE:
+            *val = (o->src_height << 16) | o->src_width;
             break;
-        case 8:
-            stl_p(g->vram_ptr + addr, val);
+        case OVL_DST_POS:
+            *val = ((uint32_t)(uint16_t)o->dst_y << 16) | (uint16_t)o->dst_x;
             break;
+        case OVL_DST_SIZE:
+            *val = (o->dst_height << 16) | o->dst_width;
+            break;
+        case OVL_ZPOS:
+            *val = o->zpos;
+            break;
+        case OVL_ENABLE:
+            *val = o->enable;
+            break;
+        default:
+            return false;
     }
 
-    g->dirty = true;
+    return true;
 }
 
+static bool gray_gpu_overlay_write(GrayGPUHead *s, hwaddr reg, uint64_t val)
+{
+    if(reg < REG_OVERLAY_BASE || reg >= REG_OVERLAY(GRAY_GPU_MAX_OVERLAYS, 0)){
+        return false;
+    }
+
+    GrayGPUOverlay *o = &s->overlay_staged[(reg - REG_OVERLAY_BASE) / REG_OVERLAY_STRIDE];
 
-static const MemoryRegionOps gray_gpu_vram_ops = {
-    .read = gray_gpu_vram_read,
-    .write = gray_gpu_vram_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
+    switch((reg - REG_OVERLAY_BASE) % REG_OVERLAY_STRIDE){
+        case OVL_ADDR:
+            o->addr = val;
+            break;
+        case OVL_PITCH:
+            o->pitch = val;
+            break;
+        case OVL_FORMAT:
+            o->format = val;
+            break;
+        case OVL_SRC_SIZE:
+            o->src_width = val & 0xFFFF;
+            o->src_height = (val >> 16) & 0xFFFF;
+            break;
+        case OVL_DST_POS:
+            o->dst_x = (int16_t)(val & 0xFFFF);
+            o->dst_y = (int16_t)(val >> 16);
+            break;
+        case OVL_DST_SIZE:
+            o->dst_width = val & 0xFFFF;
+            o->dst_height = (val >> 16) & 0xFFFF;
+            break;
+        case OVL_ZPOS:
+            o->zpos = val;
+            break;
+        case OVL_ENABLE:
+            o->enable = val != 0;
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+//Per-head registers, false if reg is not one of them
+static bool gray_gpu_head_read(GrayGPUHead *s, hwaddr reg, uint64_t *val)
+{
+    switch(reg){
+        case REG_FB_ADDR:
+            *val = s->fb_addr;
+            break;
+        case REG_FB_WIDTH:
+            *val = s->fb_width;
+            break;
+        case REG_FB_HEIGHT:
+            *val = s->fb_height;
+            break;
+        case REG_FB_BPP:
+            *val = s->fb_bpp;
+            break;
+        case REG_FB_ENABLE:
+            *val = s->fb_enable;
+            break;
+        case REG_FB_PITCH:
+            *val = s->fb_pitch;
+            break;
+        case REG_CURSOR_X:
+            *val = s->cursor_x;
+            break;
+        case REG_CURSOR_Y:
+            *val = s->cursor_y;
+            break;
+        case REG_CURSOR_ENABLE:
+            *val = s->cursor_enabled;
+            break;
+        case REG_CURSOR_HOTSPOT_X:
+            *val = s->cursor_hotspot_x;
+            break;
+        case REG_CURSOR_HOTSPOT_Y:
+            *val = s->cursor_hotspot_y;
+            break;
+        case REG_FB_COUNT:
+            *val = s->fb_count;
+            break;
+        case REG_FB_CURRENT:
+            *val = s->fb_current;
+            break;
+        case REG_FB_NEXT:
+            *val = s->fb_next;
+            break;
+        case REG_FLIP_PENDING:
+            *val = s->flip_pending;
+            break;
+        case REG_VBLANK_COUNT:
+            *val = s->vblank_count;
+            break;
+        case REG_CURSOR_BASE:
+            *val = s->cursor_base;
+            break;
+        case REG_FB_NEXT_ADDR:
+            *val = s->fb_next_addr;
+            break;
+        case REG_FB_NEXT_SIZE:
+            *val = s->next_mode ? (s->next_height << 16) | s->next_width
+                                : (s->fb_height << 16) | s->fb_width;
+            break;
+        case REG_FB_NEXT_PITCH:
+            *val = s->next_mode ? s->next_pitch : s->fb_pitch;
+            break;
+        case REG_OVERLAY_COUNT:
+            *val = GRAY_GPU_MAX_OVERLAYS;
+            break;
+        default:
+            return gray_gpu_overlay_read(s, reg, val);
+    }
+
+    return true;
+}
 
 //Register read handler
 static uint64_t gray_gpu_reg_read(void *opaque, hwaddr addr, unsigned size)
 {
     GrayGPUState *g = GRAY_GPU(opaque);
+    hwaddr head = addr / REG_HEAD_STRIDE;
     uint64_t val = 0;
 
+    if(head < g->num_heads &&
+            gray_gpu_head_read(&g->heads[head], addr % REG_HEAD_STRIDE, &val)){
+        return val;
+    }
+
     switch(addr){
         case REG_DEVICE_ID:
             val = g->device_id;
@@ -165,65 +1043,232 @@ static uint64_t gray_gpu_reg_read(void *opaque, hwaddr addr, unsigned size)
         case REG_CONTROL:
             val = g->control;
             break;
+        case REG_IRQ_STATUS:
+            val = g->irq_status;
+            break;
+        case REG_IRQ_ENABLE:
+            val = g->irq_enable;
+            break;
+        case REG_REFRESH_RATE:
+            val = g->refresh_rate;
+            break;
+        case REG_RING_BASE:
+            val = g->ring_base;
+            break;
+        case REG_RING_SIZE:
+            val = g->ring_size;
+            break;
+        case REG_RING_HEAD:
+            val = g->ring_head;
+            break;
+        case REG_RING_TAIL:
+            val = g->ring_tail;
+            break;
+        case REG_FENCE_COMPLETED:
+            val = g->fence_completed;
+            break;
+        case REG_DMA_DESC_LO:
+            val = (uint32_t)g->dma_desc;
+            break;
+        case REG_DMA_DESC_HI:
+            val = g->dma_desc >> 32;
+            break;
+        case REG_DMA_DESC_COUNT:
+            val = g->dma_desc_count;
+            break;
+        case REG_DMA_STATUS:
+            val = g->dma_status;
+            break;
+        case REG_DMA_COMPLETED:
+            val = g->dma_completed;
+            break;
+        case REG_HEAD_COUNT:
+            val = g->num_heads;
+            break;
+        default:
+            qemu_log_mask(LOG_GUEST_ERROR, "Invalid register read at 0x%lx\n", addr);
+            break;    }
+
+    return val;
+}
+
+//CTRL_RESET state of one head, the cursor image and position survive it
+static void gray_gpu_head_reset(GrayGPUHead *s)
+{
+    s->fb_width = 800;
+    s->fb_height = 600;
+    s->fb_pitch = s->fb_width * 4;
+    s->fb_enable = 0;
+    s->fb_addr = 0;
+    s->invalidate = true;
+    timer_del(s->vblank_timer);
+    s->flip_pending = 0;
+    s->fb_current = 0;
+    s->fb_next = 0;
+    s->next_mode = false;
+    s->cursor_base = 0;
+    memset(s->overlay_staged, 0, sizeof(s->overlay_staged));
+    memset(s->overlays, 0, sizeof(s->overlays));
+    s->overlay_count = 0;
+}
+
+//Per-head registers, false if reg is not one of them
+static bool gray_gpu_head_write(GrayGPUHead *s, hwaddr reg, uint64_t val)
+{
+    switch(reg){
         case REG_FB_ADDR:
-            val = g->fb_addr;
+            s->fb_addr = val;
+            s->invalidate = true;
             break;
         case REG_FB_WIDTH:
-            val = g->fb_width;
+            s->fb_width = val;
+            s->fb_pitch = s->fb_width * (s->fb_pitch/8);
+            s->invalidate = true;
             break;
         case REG_FB_HEIGHT:
-            val = g->fb_height;
+            s->fb_height = val;
+            s->invalidate = true;
             break;
         case REG_FB_BPP:
-            val = g->fb_bpp;
+            s->fb_bpp = val;
+            s->fb_pitch = s->fb_width * (s->fb_bpp/8);
+            s->invalidate = true;
             break;
         case REG_FB_ENABLE:
-            val = g->fb_enable;
+            s->fb_enable = val;
+            if(val){
+                //if framebuffer is enabledd update the display
+                s->invalidate = true;
+                gray_gpu_vblank_start(s);
+            }else{
+                gray_gpu_vblank_stop(s);
+            }
             break;
         case REG_FB_PITCH:
-            val = g->fb_pitch;
+            s->fb_pitch = val;
+            s->invalidate = true;
             break;
+        //Cursor changes only damage the old and new cursor area
         case REG_CURSOR_X:
-            val = g->cursor_x;
+            gray_gpu_damage_cursor(s);
+            s->cursor_x = val;
+            s->cursor_moved = true;
+            gray_gpu_damage_cursor(s);
             break;
         case REG_CURSOR_Y:
-            val = g->cursor_y;
+            gray_gpu_damage_cursor(s);
+            s->cursor_y = val;
+            s->cursor_moved = true;
+            gray_gpu_damage_cursor(s);
             break;
         case REG_CURSOR_ENABLE:
-            val = g->cursor_enabled;
+            gray_gpu_damage_cursor(s);
+            s->cursor_enabled = val;
+            s->cursor_define = true;
+            gray_gpu_damage_cursor(s);
             break;
         case REG_CURSOR_HOTSPOT_X:
-            val = g->cursor_hotspot_x;
+            gray_gpu_damage_cursor(s);
+            s->cursor_hotspot_x = val;
+            s->cursor_define = true;
+            gray_gpu_damage_cursor(s);
             break;
         case REG_CURSOR_HOTSPOT_Y:
-            val = g->cursor_hotspot_y;
+            gray_gpu_damage_cursor(s);
+            s->cursor_hotspot_y = val;
+            s->cursor_define = true;
+            gray_gpu_damage_cursor(s);
             break;
-        case REG_FB_COUNT:
-            val = g->fb_count;
+        case REG_CURSOR_UPLOAD:
+             if (s->cursor_upload_offset < CURSOR_SIZE * CURSOR_SIZE) {
+                s->cursor_data[s->cursor_upload_offset] = val;
+                s->cursor_upload_offset++;
+                if (s->cursor_upload_offset >= CURSOR_SIZE * CURSOR_SIZE) {
+                    s->cursor_upload_offset = 0; /* Reset for next upload */
+                    s->g->status |= STATUS_CURSOR_LOADED;
+                    s->cursor_define = true;
+                    gray_gpu_damage_cursor(s);
+                }
+            }
             break;
-        case REG_FB_CURRENT:
-            val = g->fb_current;
+        case REG_CURSOR_BASE:
+            s->cursor_base = val;
+            break;
+        case REG_CURSOR_COMMIT:
+            gray_gpu_cursor_commit(s, val & 0xFFFF, val >> 16);
+            break;
+        case REG_FB_COUNT:
+            if(val <= 4){
+
+                int i;
+                uint32_t fb_size;
+
+                s->fb_count = val;
+                fb_size = s->fb_width * s->fb_height * (s->fb_bpp / 8);
+                for( i = 0; i < s->fb_count; i++){
+                    s->fb_addresses[i] = i * fb_size;
+                }
+                s->fb_current = 0;
+                s->fb_next = 0;
+                s->invalidate = true;
+            }
             break;
         case REG_FB_NEXT:
-            val = g->fb_next;
+            if(val < s->fb_count){
+                s->fb_next = val;
+            }
             break;
-        case REG_FLIP_PENDING:
-            val = g->flip_pending;
+        case REG_FB_NEXT_ADDR:
+            s->fb_next_addr = val;
+            s->fb_next = FB_INDEX_ADDR;
             break;
-        case REG_VBLANK_COUNT:
-            val = g->vblank_count;
+        case REG_FB_NEXT_SIZE:
+            if(!s->next_mode){
+                s->next_pitch = s->fb_pitch;
+            }
+            s->next_width = val & 0xFFFF;
+            s->next_height = val >> 16;
+            s->next_mode = true;
             break;
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR, "Invalid register read at 0x%lx\n", addr);
-            break;    }
+        case REG_FB_NEXT_PITCH:
+            if(!s->next_mode){
+                s->next_width = s->fb_width;
+                s->next_height = s->fb_height;
+            }
+            s->next_pitch = val;
+            s->next_mode = true;
+            break;
+        case REG_PAGE_FLIP:
+            //Latched at the next vblank, REG_FB_NEXT may still change until then
+            if(val && (s->fb_next < s->fb_count || s->fb_next == FB_INDEX_ADDR) &&
+                    !s->flip_pending){
+                s->flip_pending = 1;
+                if(!timer_pending(s->vblank_timer)){
+                    gray_gpu_latch_flip(s);
+                    gray_gpu_raise_irq(s->g, IRQ_HEAD_FLIP_DONE(s->index));
+                }
+            }
+            break;
+        case REG_OVERLAY_COMMIT:
+            gray_gpu_overlay_commit(s, val);
+            break;
+        default:
+            return gray_gpu_overlay_write(s, reg, val);
+    }
 
-    return val;
+    return true;
 }
 
 static void gray_gpu_reg_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
 {
     GrayGPUState *g = GRAY_GPU(opaque);
-    
+    hwaddr head = addr / REG_HEAD_STRIDE;
+
+    if(head < g->num_heads &&
+            gray_gpu_head_write(&g->heads[head], addr % REG_HEAD_STRIDE, val)){
+        return;
+    }
+
     switch(addr){
         case REG_DEVICE_ID:
             //Read only
@@ -235,109 +1280,432 @@ static void gray_gpu_reg_write(void *opaque, hwaddr addr, uint64_t val, unsigned
             g->control = val;
             if(val & CTRL_RESET){
                 //Reset device
-                g->fb_width = 800;
-                g->fb_height = 600;
-                g->fb_pitch = g->fb_width * 4;
-                g->fb_enable = 0;
-                g->fb_addr = 0;
+                for(uint32_t i = 0; i < g->num_heads; i++){
+                    gray_gpu_head_reset(&g->heads[i]);
+                }
                 g->control &= ~CTRL_RESET;
-                g->dirty = true;
+                g->irq_enable = 0;
+                g->irq_status = 0;
+                g->status &= ~STATUS_VBLANK;
+                gray_gpu_update_irq(g);
+                gray_gpu_workers_wait(g);
+                g->blit_active = false;
+                qemu_bh_cancel(g->ring_bh);
+                g->ring_base = 0;
+                g->ring_size = 0;
+                g->ring_head = 0;
+                g->ring_tail = 0;
+                g->fence_completed = 0;
+                g->ring_wait_vblank = false;
+                qemu_bh_cancel(g->dma_bh);
+                g->dma_desc = 0;
+                g->dma_desc_count = 0;
+                g->dma_status = 0;
+                g->dma_completed = 0;
+            }
+            if(val & CTRL_DMA_RESET){
+                /*
+                 * Drop a transfer that has not run yet. Once this write
+                 * returns the engine touches no guest memory, so the
+                 * driver may release the pages of a timed out transfer.
+                 */
+                qemu_bh_cancel(g->dma_bh);
+                g->dma_status = 0;
+                g->irq_status &= ~IRQ_DMA_DONE;
+                g->control &= ~CTRL_DMA_RESET;
+                gray_gpu_update_irq(g);
             }
             break;
-        case REG_FB_ADDR:
-            g->fb_addr = val;
-            g->dirty = true;
+        case REG_IRQ_STATUS:
+            g->irq_status &= ~val;
+            if(!(g->irq_status & IRQ_VBLANK)){
+                g->status &= ~STATUS_VBLANK;
+            }
+            gray_gpu_update_irq(g);
             break;
-        case REG_FB_WIDTH:
-            g->fb_width = val;
-            g->fb_pitch = g->fb_width * (g->fb_pitch/8);
-            g->dirty = true;
+        case REG_IRQ_ENABLE:
+            g->irq_enable = val & IRQ_ALL;
+            gray_gpu_update_irq(g);
             break;
-        case REG_FB_HEIGHT:
-            g->fb_height = val;
-            g->dirty = true;
+        //Reprogramming the ring discards anything not yet executed
+        case REG_RING_BASE:
+            g->ring_base = val;
+            g->ring_head = 0;
+            g->ring_tail = 0;
+            g->ring_wait_vblank = false;
             break;
-        case REG_FB_BPP:
-            g->fb_bpp = val;
-            g->fb_pitch = g->fb_width * (g->fb_bpp/8);
-            g->dirty = true;
+        case REG_RING_SIZE:
+            g->ring_size = val;
+            g->ring_head = 0;
+            g->ring_tail = 0;
+            g->ring_wait_vblank = false;
             break;
-        case REG_FB_ENABLE:
-            g->fb_enable = val;
-            if(val){
-                //if framebuffer is enabledd update the display
-                qemu_console_resize(g->console, g->fb_width, g->fb_height);
-                g->dirty = true;
+        case REG_RING_DOORBELL:
+            if(!gray_gpu_ring_valid(g)){
+                qemu_log_mask(LOG_GUEST_ERROR, "Doorbell with invalid ring 0x%x+0x%x\n",
+                        g->ring_base, g->ring_size);
+                break;
             }
+            g->ring_tail = val & (g->ring_size - 1) & ~3u;
+            qemu_bh_schedule(g->ring_bh);
             break;
-        case REG_FB_PITCH:
-            g->fb_pitch = val;
-            g->dirty = true;
-            break;
-        case REG_CURSOR_X:
-            g->cursor_x = val;
-            g->dirty = true;
-            break;
-        case REG_CURSOR_Y:
-            g->cursor_y = val;
-            g->dirty = true;
-            break;
-        case REG_CURSOR_ENABLE:
-            g->cursor_enabled = val;
-            g->dirty = true;
+        case REG_DMA_DESC_LO:
+            g->dma_desc = deposit64(g->dma_desc, 0, 32, val);
             break;
-        case REG_CURSOR_HOTSPOT_X:
-            g->cursor_hotspot_x = val;
+        case REG_DMA_DESC_HI:
+            g->dma_desc = deposit64(g->dma_desc, 32, 32, val);
             break;
-        case REG_CURSOR_HOTSPOT_Y:
-            g->cursor_hotspot_y = val;
+        case REG_DMA_DESC_COUNT:
+            g->dma_desc_count = val;
             break;
-        case REG_CURSOR_UPLOAD:
-             if (g->cursor_upload_offset < CURSOR_SIZE * CURSOR_SIZE) {
-                g->cursor_data[g->cursor_upload_offset] = val;
-                g->cursor_upload_offset++;
-                if (g->cursor_upload_offset >= CURSOR_SIZE * CURSOR_SIZE) {
-                    g->cursor_upload_offset = 0; /* Reset for next upload */
-                    g->status |= STATUS_CURSOR_LOADED;
-                    g->dirty = true;
-                }
+        case REG_DMA_START:
+            if(g->dma_status & DMA_STATUS_BUSY){
+                qemu_log_mask(LOG_GUEST_ERROR, "DMA started while busy\n");
+                break;
             }
+            g->dma_cookie = val;
+            g->dma_status = DMA_STATUS_BUSY;
+            qemu_bh_schedule(g->dma_bh);
             break;
-        case REG_FB_COUNT:
-            if(val <= 4){
+        default:
+            qemu_log_mask(LOG_GUEST_ERROR, "Invalid regiseter write at 0x%lx = 0x%lx\n", addr, val);
+            break;
+    }
+}
 
-                int i;
-                uint32_t fb_size;
+static uint32_t gray_gpu_ring_dword(GrayGPUState *g, uint32_t pos)
+{
+    return ldl_le_p(g->vram_ptr + g->ring_base + (pos & (g->ring_size - 1)));
+}
 
-                g->fb_count = val;
-                fb_size = g->fb_width * g->fb_height * (g->fb_bpp / 8);
-                for( i = 0; i < g->fb_count; i++){
-                    g->fb_addresses[i] = i * fb_size;
-                }
-                g->fb_current = 0;
-                g->fb_next = 0;
-                g->dirty = true;
+//Byte extent of a width x height rectangle starting at offset
+static uint64_t gray_gpu_blit_extent(uint32_t pitch, uint32_t width, uint32_t height)
+{
+    return (uint64_t)(height - 1) * pitch + (uint64_t)width * 4;
+}
+
+static bool gray_gpu_blit_fits(uint32_t offset, uint32_t pitch, uint32_t width, uint32_t height)
+{
+    if((offset | pitch) & 3 || pitch < width * 4){
+        return false;
+    }
+    return offset + gray_gpu_blit_extent(pitch, width, height) <= GRAY_GPU_VRAM_SIZE;
+}
+
+static bool gray_gpu_blit_overlaps(const GrayGPUBlit *b)
+{
+    uint64_t src_end = b->src + gray_gpu_blit_extent(b->src_pitch, b->width, b->height);
+    uint64_t dst_end = b->dst + gray_gpu_blit_extent(b->dst_pitch, b->width, b->height);
+
+    return b->op != CMD_FILL && src_end > b->dst && dst_end > b->src;
+}
+
+static bool gray_gpu_blit_valid(const GrayGPUBlit *b)
+{
+    if(b->width == 0 || b->height == 0 || b->width > GRAY_GPU_VRAM_SIZE / 4){
+        return false;
+    }
+    if(!gray_gpu_blit_fits(b->dst, b->dst_pitch, b->width, b->height)){
+        return false;
+    }
+    if(b->op == CMD_FILL){
+        return true;
+    }
+    if(!gray_gpu_blit_fits(b->src, b->src_pitch, b->width, b->height)){
+        return false;
+    }
+
+    //In place kernels cannot cope with the source changing under them
+    return b->op == CMD_COPY || !gray_gpu_blit_overlaps(b);
+}
+
+static void gray_gpu_fill_span(uint32_t *dst, uint32_t color, uint32_t n)
+{
+    //Grey levels and black/white collapse to a plain memset
+    if(color == (color & 0xFF) * 0x01010101u){
+        memset(dst, color & 0xFF, n * 4);
+        return;
+    }
+    for(uint32_t i = 0; i < n; i++){
+        dst[i] = color;
+    }
+}
+
+static void gray_gpu_key_span(uint32_t *dst, const uint32_t *src, uint32_t key, uint32_t n)
+{
+    key &= 0xFFFFFF;
+    for(uint32_t i = 0; i < n; i++){
+        uint32_t p = src[i];
+        dst[i] = (p & 0xFFFFFF) == key ? dst[i] : p;
+    }
+}
+
+/*
+ * Run rows [y1, y2) of a validated blit. COPY walks the rows bottom up when
+ * the destination starts above the source so overlapping scrolls work.
+ */
+static void gray_gpu_blit_rows(GrayGPUState *g, const GrayGPUBlit *b, uint32_t y1, uint32_t y2)
+{
+    uint8_t *vram = g->vram_ptr;
+    size_t row_bytes = (size_t)b->width * 4;
+
+    switch(b->op){
+        case CMD_FILL:
+        {
+            uint32_t *first = (uint32_t *)(vram + b->dst + (size_t)y1 * b->dst_pitch);
+
+            //Build one row, then let memcpy replicate it
+            gray_gpu_fill_span(first, b->color, b->width);
+            for(uint32_t y = y1 + 1; y < y2; y++){
+                memcpy(vram + b->dst + (size_t)y * b->dst_pitch, first, row_bytes);
             }
             break;
-        case REG_FB_NEXT:
-            if(val < g->fb_count){
-                g->fb_next = val;
+        }
+        case CMD_COPY:
+            if(b->dst > b->src){
+                for(uint32_t y = y2; y-- > y1;){
+                    memmove(vram + b->dst + (size_t)y * b->dst_pitch,
+                            vram + b->src + (size_t)y * b->src_pitch, row_bytes);
+                }
+            }else{
+                for(uint32_t y = y1; y < y2; y++){
+                    memmove(vram + b->dst + (size_t)y * b->dst_pitch,
+                            vram + b->src + (size_t)y * b->src_pitch, row_bytes);
+                }
             }
             break;
-        case REG_PAGE_FLIP:
-            if(val && g->fb_next < g->fb_count && !g->flip_pending){
-                g->flip_pending = 1;
-                g->fb_current = g->fb_next;
-                g->fb_addr = g->fb_addresses[g->fb_current];
-                g->flip_pending = 0;
-                g->vblank_count++;
-                g->dirty = true;
+        case CMD_BLEND:
+            gray_blend_argb_rect((uint32_t *)(vram + b->dst + (size_t)y1 * b->dst_pitch),
+                    b->dst_pitch / 4,
+                    (const uint32_t *)(vram + b->src + (size_t)y1 * b->src_pitch),
+                    b->src_pitch / 4, b->width, y2 - y1);
+            break;
+        case CMD_COPY_KEY:
+            for(uint32_t y = y1; y < y2; y++){
+                gray_gpu_key_span((uint32_t *)(vram + b->dst + (size_t)y * b->dst_pitch),
+                        (const uint32_t *)(vram + b->src + (size_t)y * b->src_pitch),
+                        b->color, b->width);
             }
             break;
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR, "Invalid regiseter write at 0x%lx = 0x%lx\n", addr, val);
+    }
+}
+
+static void gray_gpu_blit_band(GrayGPUState *g, const void *arg, uint32_t y1, uint32_t y2)
+{
+    gray_gpu_blit_rows(g, arg, y1, y2);
+}
+
+static void gray_gpu_blit_finish(GrayGPUState *g)
+{
+    GrayGPUBlit *b = &g->blit;
+
+    //The display only sees VRAM changes through dirty logging
+    memory_region_set_dirty(&g->vram, b->dst,
+            gray_gpu_blit_extent(b->dst_pitch, b->width, b->height));
+    g->blit_active = false;
+}
+
+/*
+ * Decode a 2D engine command at pos (first payload dword) and start it.
+ * Returns true while it is still running on the workers.
+ */
+static bool gray_gpu_blit(GrayGPUState *g, uint32_t op, uint32_t pos, uint32_t len)
+{
+    GrayGPUBlit b = { .op = op };
+    uint32_t need = op == CMD_FILL ? CMD_FILL_LEN :
+                    op == CMD_COPY_KEY ? CMD_COPY_KEY_LEN : CMD_COPY_LEN;
+
+    if(len < need){
+        qemu_log_mask(LOG_GUEST_ERROR, "Short 2D command 0x%x, %u dwords\n", op, len);
+        return false;
+    }
+
+    if(op == CMD_FILL){
+        b.dst = gray_gpu_ring_dword(g, pos);
+        b.dst_pitch = gray_gpu_ring_dword(g, pos + 4);
+        b.width = gray_gpu_ring_dword(g, pos + 8);
+        b.height = gray_gpu_ring_dword(g, pos + 12);
+        b.color = gray_gpu_ring_dword(g, pos + 16);
+    }else{
+        b.src = gray_gpu_ring_dword(g, pos);
+        b.src_pitch = gray_gpu_ring_dword(g, pos + 4);
+        b.dst = gray_gpu_ring_dword(g, pos + 8);
+        b.dst_pitch = gray_gpu_ring_dword(g, pos + 12);
+        b.width = gray_gpu_ring_dword(g, pos + 16);
+        b.height = gray_gpu_ring_dword(g, pos + 20);
+        if(op == CMD_COPY_KEY){
+            b.color = gray_gpu_ring_dword(g, pos + 24);
+        }
+    }
+
+    if(!gray_gpu_blit_valid(&b)){
+        qemu_log_mask(LOG_GUEST_ERROR,
+                "Invalid 2D command 0x%x: src 0x%x/%u dst 0x%x/%u %ux%u\n", op,
+                b.src, b.src_pitch, b.dst, b.dst_pitch, b.width, b.height);
+        return false;
+    }
+
+    /*
+     * Bands run in any order, so an overlapping copy (a scroll) only stays
+     * correct when done in one pass.
+     */
+    g->blit = b;
+    if(gray_gpu_blit_overlaps(&b)){
+        gray_gpu_blit_rows(g, &g->blit, 0, b.height);
+    }else if(gray_gpu_workers_split(g, gray_gpu_blit_band, &g->blit,
+                b.height, b.width * 4, true)){
+        g->blit_active = true;
+        return true;
+    }
+    gray_gpu_blit_finish(g);
+    return false;
+}
+
+//Execute everything between head and the last doorbell tail
+static void gray_gpu_ring_process(void *opaque)
+{
+    GrayGPUState *g = GRAY_GPU(opaque);
+
+    //Commands after a split blit wait for it, the last band kicks us again
+    if(g->blit_active){
+        if(!gray_gpu_workers_idle(g)){
+            return;
+        }
+        gray_gpu_blit_finish(g);
+    }
+
+    if(!gray_gpu_ring_valid(g)){
+        return;
+    }
+
+    uint32_t mask = g->ring_size - 1;
+
+    while(g->ring_head != g->ring_tail && !g->blit_active && !g->ring_wait_vblank){
+        uint32_t avail = (g->ring_tail - g->ring_head) & mask;
+        uint32_t hdr = gray_gpu_ring_dword(g, g->ring_head);
+        uint32_t len = CMD_LENGTH(hdr);
+        uint32_t pos = g->ring_head + 4;
+
+        if((len + 1) * 4 > avail){
+            qemu_log_mask(LOG_GUEST_ERROR, "Truncated ring command 0x%x at 0x%x\n",
+                    hdr, g->ring_head);
+            g->ring_head = g->ring_tail;
+            break;
+        }
+
+        switch(CMD_OPCODE(hdr)){
+            case CMD_NOP:
+                break;
+            case CMD_SET_REG:
+                for(uint32_t i = 0; i + 1 < len; i += 2){
+                    uint32_t reg = gray_gpu_ring_dword(g, pos + i * 4);
+                    uint32_t val = gray_gpu_ring_dword(g, pos + (i + 1) * 4);
+
+                    //The ring cannot reprogram or reset itself, or start DMA
+                    if(reg == REG_CONTROL ||
+                            (reg >= REG_RING_BASE && reg <= REG_DMA_COMPLETED)){
+                        qemu_log_mask(LOG_GUEST_ERROR, "Ring write to 0x%x ignored\n", reg);
+                        continue;
+                    }
+                    gray_gpu_reg_write(g, reg, val, 4);
+                }
+                break;
+            case CMD_FILL:
+            case CMD_COPY:
+            case CMD_BLEND:
+            case CMD_COPY_KEY:
+                gray_gpu_blit(g, CMD_OPCODE(hdr), pos, len);
+                break;
+            case CMD_FENCE:
+                if(len >= 1){
+                    g->fence_completed = gray_gpu_ring_dword(g, pos);
+                    gray_gpu_raise_irq(g, IRQ_CMD_DONE);
+                }
+                break;
+            case CMD_WAIT_VBLANK:
+                g->ring_wait_head = len >= 1 ? gray_gpu_ring_dword(g, pos) : 0;
+                g->ring_wait_vblank = g->ring_wait_head < g->num_heads &&
+                    timer_pending(g->heads[g->ring_wait_head].vblank_timer);
+                break;
+            default:
+                qemu_log_mask(LOG_GUEST_ERROR, "Unknown ring command 0x%x\n", hdr);
+                break;
+        }
+
+        g->ring_head = (g->ring_head + (len + 1) * 4) & mask;
+    }
+}
+
+//Run one DMA descriptor, false if it is invalid or the bus access failed
+static bool gray_gpu_dma_desc(GrayGPUState *g, const uint8_t *desc)
+{
+    PCIDevice *pci_dev = PCI_DEVICE(g);
+    uint64_t sys_addr = ldq_le_p(desc);
+    uint32_t vram_offset = ldl_le_p(desc + 8);
+    uint32_t row_bytes = ldl_le_p(desc + 12);
+    uint32_t rows = ldl_le_p(desc + 16);
+    uint32_t sys_pitch = ldl_le_p(desc + 20);
+    uint32_t vram_pitch = ldl_le_p(desc + 24);
+    uint32_t flags = ldl_le_p(desc + 28);
+
+    if(row_bytes == 0 || rows == 0){
+        return true;
+    }
+
+    uint64_t extent = (uint64_t)(rows - 1) * vram_pitch + row_bytes;
+    if((rows > 1 && (vram_pitch < row_bytes || sys_pitch < row_bytes)) ||
+            vram_offset + extent > GRAY_GPU_VRAM_SIZE){
+        qemu_log_mask(LOG_GUEST_ERROR,
+                "Invalid DMA descriptor: vram 0x%x %ux%u pitch %u/%u\n",
+                vram_offset, row_bytes, rows, vram_pitch, sys_pitch);
+        return false;
+    }
+
+    for(uint32_t y = 0; y < rows; y++){
+        dma_addr_t addr = sys_addr + (uint64_t)y * sys_pitch;
+        uint8_t *vram = g->vram_ptr + vram_offset + (uint64_t)y * vram_pitch;
+        MemTxResult res = flags & DMA_DESC_TO_SYSTEM ?
+            pci_dma_write(pci_dev, addr, vram, row_bytes) :
+            pci_dma_read(pci_dev, addr, vram, row_bytes);
+
+        if(res != MEMTX_OK){
+            qemu_log_mask(LOG_GUEST_ERROR, "DMA bus error at 0x%" PRIx64 "\n", addr);
+            return false;
+        }
+    }
+
+    //Device writes to VRAM bypass the dirty log
+    if(!(flags & DMA_DESC_TO_SYSTEM)){
+        memory_region_set_dirty(&g->vram, vram_offset, extent);
+    }
+    return true;
+}
+
+//Walk the descriptor list, then report completion with the start cookie
+static void gray_gpu_dma_process(void *opaque)
+{
+    GrayGPUState *g = GRAY_GPU(opaque);
+    uint8_t desc[DMA_DESC_SIZE];
+    bool ok = g->dma_desc_count <= GRAY_GPU_DMA_MAX_DESC;
+
+    if(!ok){
+        qemu_log_mask(LOG_GUEST_ERROR, "DMA list too long: %u descriptors\n",
+                g->dma_desc_count);
+    }
+
+    for(uint32_t i = 0; ok && i < g->dma_desc_count; i++){
+        if(pci_dma_read(PCI_DEVICE(g), g->dma_desc + (uint64_t)i * DMA_DESC_SIZE,
+                    desc, sizeof(desc)) != MEMTX_OK){
+            qemu_log_mask(LOG_GUEST_ERROR, "Cannot fetch DMA descriptor %u\n", i);
+            ok = false;
             break;
+        }
+        ok = gray_gpu_dma_desc(g, desc);
     }
+
+    g->dma_status = ok ? 0 : DMA_STATUS_ERROR;
+    g->dma_completed = g->dma_cookie;
+    gray_gpu_raise_irq(g, IRQ_DMA_DONE);
 }
 
 static const MemoryRegionOps gray_gpu_reg_ops = {
@@ -346,9 +1714,9 @@ static const MemoryRegionOps gray_gpu_reg_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
-static void init_default_cursor(GrayGPUState *g)
+static void init_default_cursor(GrayGPUHead *s)
 {
-    memset(g->cursor_data, 0, sizeof(g->cursor_data));
+    memset(s->cursor_data, 0, sizeof(s->cursor_data));
     
     /* Simple white arrow cursor with black outline */
     for (int y = 0; y < 16; y++) {
@@ -359,107 +1727,283 @@ static void init_default_cursor(GrayGPUState *g)
                 (x == 5 && y > 5 && y < 12)) { /* Stem */
                 
                 /* Black outline */
-                g->cursor_data[y * CURSOR_SIZE + x] = 0xFF000000;
+                s->cursor_data[y * CURSOR_SIZE + x] = 0xFF000000;
                 
                 /* White fill inside */
                 if (x > 0 && y > 0 && x < 9) {
-                    g->cursor_data[y * CURSOR_SIZE + x + 1] = 0xFFFFFFFF;
+                    s->cursor_data[y * CURSOR_SIZE + x + 1] = 0xFFFFFFFF;
                 }
             }
         }
     }
     
-    g->cursor_hotspot_x = 0;
-    g->cursor_hotspot_y = 0;
+    s->cursor_hotspot_x = 0;
+    s->cursor_hotspot_y = 0;
+}
+
+//Blend the cursor into fb (stride in pixels), touching only pixels inside clip
+static void composite_cursor(GrayGPUHead *s, uint32_t *fb, int stride,
+        const GrayGPURect *clip)
+{
+    if(!s->cursor_enabled || !s->fb_enable){
+        return;
+    }
+
+    int cursor_screen_x = s->cursor_x - s->cursor_hotspot_x;
+    int cursor_screen_y = s->cursor_y - s->cursor_hotspot_y;
+
+    //Clip once, then blend whole rows
+    int x1 = MAX(cursor_screen_x, clip->x1);
+    int y1 = MAX(cursor_screen_y, clip->y1);
+    int x2 = MIN(cursor_screen_x + CURSOR_SIZE, clip->x2);
+    int y2 = MIN(cursor_screen_y + CURSOR_SIZE, clip->y2);
+
+    if(x1 >= x2 || y1 >= y2){
+        return;
+    }
+
+    gray_blend_argb_rect(fb + y1 * stride + x1, stride,
+            s->cursor_data + (y1 - cursor_screen_y) * CURSOR_SIZE + (x1 - cursor_screen_x),
+            CURSOR_SIZE, x2 - x1, y2 - y1);
 }
 
-static void composite_cursor(GrayGPUState *g, uint32_t *fb)
+/*
+ * Blend the part of an overlay inside clip into fb (stride in pixels).
+ * Runs on the render workers, so it only reads the overlay and VRAM.
+ */
+static void composite_overlay(GrayGPUState *g, const GrayGPUOverlay *o, uint32_t *fb,
+        int stride, const GrayGPURect *clip)
 {
-    if(!g->cursor_enabled || !g->fb_enable){
+    int x1 = MAX(o->dst_x, clip->x1);
+    int y1 = MAX(o->dst_y, clip->y1);
+    int x2 = MIN(o->dst_x + (int)o->dst_width, clip->x2);
+    int y2 = MIN(o->dst_y + (int)o->dst_height, clip->y2);
+
+    if(x1 >= x2 || y1 >= y2){
         return;
     }
 
-    int cursor_screen_x = g->cursor_x - g->cursor_hotspot_x;
-    int cursor_screen_y = g->cursor_y - g->cursor_hotspot_y;
+    GrayBlendSpanFn blend = gray_blend_argb_span_fn();
+    bool opaque = o->format == OVERLAY_FORMAT_XRGB8888;
+    bool scaled = o->src_width != o->dst_width;
+    uint32_t span[OVERLAY_SPAN];
 
-    for(int cy = 0; cy < CURSOR_SIZE; cy++){
-        for(int cx = 0; cx < CURSOR_SIZE; cx++){
-            int screen_x = cursor_screen_x + cx;
-            int screen_y = cursor_screen_y + cy;
+    for(int y = y1; y < y2; y++){
+        uint32_t sy = (uint64_t)(y - o->dst_y) * o->src_height / o->dst_height;
+        const uint32_t *src = (const uint32_t *)(g->vram_ptr + o->addr + (uint64_t)sy * o->pitch);
+        uint32_t *dst = fb + (ptrdiff_t)y * stride;
 
-            if(screen_x < 0 || screen_x >= (int)g->fb_width || screen_y < 0 || screen_y >= (int)g->fb_height){
-                continue;
+        if(!scaled){
+            if(opaque){
+                memcpy(dst + x1, src + (x1 - o->dst_x), (x2 - x1) * 4);
+            }else{
+                blend(dst + x1, src + (x1 - o->dst_x), x2 - x1);
             }
+            continue;
+        }
 
-            uint32_t cursor_pixel = g->cursor_data[cy * CURSOR_SIZE + cx];
-            uint32_t alpha = (cursor_pixel >> 24) & 0xFF;
-
-            if(alpha > 0){
-                int fb_offset = screen_y * g->fb_width + screen_x;
-
-                if(alpha == 0xFF){
-                    fb[fb_offset] = cursor_pixel;
-                }else{
-                    uint32_t bg = fb[fb_offset];
-                    uint32_t bg_r = (bg >> 16) & 0xFF;
-                    uint32_t bg_g = (bg >> 8) & 0xFF;
-                    uint32_t bg_b = bg & 0xFF;
-
-                    uint32_t fg_r = (cursor_pixel >> 16) & 0xFF;
-                    uint32_t fg_g = (cursor_pixel >> 8) & 0xFF;
-                    uint32_t fg_b = cursor_pixel & 0xFF;
-                    
-                    uint32_t r_t = (fg_r * alpha + bg_r * (255 - alpha)) / 255;
-                    uint32_t g_t = (fg_g * alpha + bg_g * (255 - alpha)) / 255;
-                    uint32_t b_t = (fg_b * alpha + bg_b * (255 - alpha)) / 255;
-                    
-                    fb[fb_offset] = 0xFF000000 | (r_t << 16) | (g_t << 8) | b_t;
-                }
+        //Gather scaled pixels a span at a time, then copy or blend them
+        for(int x = x1; x < x2; x += OVERLAY_SPAN){
+            int n = MIN(x2 - x, OVERLAY_SPAN);
+
+            for(int i = 0; i < n; i++){
+                span[i] = src[(uint64_t)(x + i - o->dst_x) * o->src_width / o->dst_width];
             }
+            if(opaque){
+                memcpy(dst + x, span, n * 4);
+            }else{
+                blend(dst + x, span, n);
+            }
+        }
+    }
+}
+
+//The UI draws the cursor when it can, otherwise it is blended in the shadow
+static bool gray_gpu_need_soft_cursor(GrayGPUHead *s)
+{
+    return s->cursor_enabled && !dpy_cursor_define_supported(s->console);
+}
+
+/*
+ * The console normally scans out straight from VRAM and the cursor is
+ * handed to the UI. Overlays, or a UI without cursor support, need a
+ * private shadow copy to composite into, so the guest framebuffer is
+ * never written by the device.
+ */
+static bool gray_gpu_need_shadow(GrayGPUHead *s)
+{
+    return s->overlay_count > 0 || gray_gpu_need_soft_cursor(s);
+}
+
+//Pass cursor image and position to the UI as a real pointer
+static void gray_gpu_update_hw_cursor(GrayGPUHead *s)
+{
+    if(s->cursor_define){
+        QEMUCursor *c = cursor_alloc(CURSOR_SIZE, CURSOR_SIZE);
+
+        c->hot_x = MIN(s->cursor_hotspot_x, CURSOR_SIZE - 1);
+        c->hot_y = MIN(s->cursor_hotspot_y, CURSOR_SIZE - 1);
+        memcpy(c->data, s->cursor_data, CURSOR_DATA_SIZE);
+        dpy_cursor_define(s->console, c);
+        cursor_unref(c);
+        s->cursor_moved = true;
+        s->cursor_define = false;
+    }
+
+    if(s->cursor_moved){
+        dpy_mouse_set(s->console, s->cursor_x, s->cursor_y,
+                s->cursor_enabled != 0);
+        s->cursor_moved = false;
+    }
+}
+
+//(Re)build the console surface if the mode, flip target or cursor path changed
+static bool gray_gpu_scanout_setup(GrayGPUHead *s)
+{
+    bool shadow = gray_gpu_need_shadow(s);
+    bool soft_cursor = gray_gpu_need_soft_cursor(s);
+    DisplaySurface *surface;
+
+    if(s->scanout && s->scanout == qemu_console_surface(s->console) &&
+            s->scanout_addr == s->fb_addr &&
+            s->scanout_width == s->fb_width &&
+            s->scanout_height == s->fb_height &&
+            s->scanout_pitch == s->fb_pitch &&
+            s->scanout_shadow == shadow &&
+            s->scanout_soft_cursor == soft_cursor){
+        return false;
+    }
+
+    if(shadow){
+        surface = qemu_create_displaysurface(s->fb_width, s->fb_height);
+    }else{
+        surface = qemu_create_displaysurface_from(s->fb_width, s->fb_height,
+                PIXMAN_a8r8g8b8, s->fb_pitch, s->g->vram_ptr + s->fb_addr);
+    }
+    dpy_gfx_replace_surface(s->console, surface);
+
+    s->scanout = surface;
+    s->scanout_addr = s->fb_addr;
+    s->scanout_width = s->fb_width;
+    s->scanout_height = s->fb_height;
+    s->scanout_pitch = s->fb_pitch;
+    s->scanout_shadow = shadow;
+    s->scanout_soft_cursor = soft_cursor;
+    s->cursor_define = !soft_cursor;
+    return true;
+}
+
+/*
+ * Rebuild rows [y1, y2) of a head's damage rect in the shadow: copy them
+ * from the scanout buffer, then stack the overlays on top
+ */
+static void gray_gpu_shadow_band(GrayGPUState *g, const void *arg, uint32_t y1, uint32_t y2)
+{
+    const GrayGPUHead *s = arg;
+    const GrayGPURect *d = &s->damage;
+    GrayGPURect band = { d->x1, d->y1 + y1, d->x2, d->y1 + y2 };
+    uint8_t *src = g->vram_ptr + s->fb_addr;
+    uint8_t *dst = surface_data(s->scanout);
+    int dst_stride = surface_stride(s->scanout);
+
+    for(int y = band.y1; y < band.y2; y++){
+        memcpy(dst + y * dst_stride + d->x1 * 4,
+               src + y * s->fb_pitch + d->x1 * 4,
+               (d->x2 - d->x1) * 4);
+    }
+
+    for(uint32_t i = 0; i < s->overlay_count; i++){
+        composite_overlay(g, &s->overlays[s->overlay_order[i]], (uint32_t *)dst,
+                dst_stride / 4, &band);
+    }
+}
+
+/*
+ * Guest stores land straight in RAM, so ask the dirty log which rows of
+ * the width x height rectangle at addr changed since the last refresh.
+ * The snapshot stops at the end of the last row: only that much was
+ * checked against VRAM, the pitch padding after it may lie past the end.
+ */
+static void gray_gpu_scan_dirty(GrayGPUState *g, uint32_t addr, uint32_t pitch,
+        uint32_t width, uint32_t height)
+{
+    DirtyBitmapSnapshot *snap = memory_region_snapshot_and_clear_dirty(
+            &g->vram, addr, gray_gpu_blit_extent(pitch, width, height), DIRTY_MEMORY_VGA);
+    int dirty_y1 = -1;
+
+    for(int y = 0; y <= (int)height; y++){
+        bool line_dirty = y < (int)height &&
+            memory_region_snapshot_get_dirty(&g->vram, snap,
+                    addr + (uint64_t)y * pitch, width * 4);
+
+        if(line_dirty && dirty_y1 < 0){
+            dirty_y1 = y;
+        }else if(!line_dirty && dirty_y1 >= 0){
+            gray_gpu_damage_vram(g, addr + (uint64_t)dirty_y1 * pitch,
+                    (uint64_t)(y - dirty_y1) * pitch);
+            dirty_y1 = -1;
         }
     }
+    g_free(snap);
 }
 
 static void gray_gpu_update_display(void *opaque)
 {
-    GrayGPUState *g = GRAY_GPU(opaque);
-    DisplaySurface *surface = qemu_console_surface(g->console);
+    GrayGPUHead *s = opaque;
+    GrayGPUState *g = s->g;
+    GrayGPURect *d = &s->damage;
+
+    if(!s->fb_enable || !g->vram_ptr){
+        return;
+    }
 
-    if(!g->fb_enable || !surface || !g->vram_ptr){
+    if(s->fb_width == 0 || s->fb_height == 0 || s->fb_bpp != 32){
         return;
     }
 
-    //Simple framebuffer copy - copy from vram offset to display
-    if(g->fb_width > 0 && g->fb_height > 0 && g->dirty){
-        uint8_t *fb_data = g->vram_ptr + g->fb_addr;
+    uint64_t fb_size = (uint64_t)s->fb_pitch * s->fb_height;
+    if(s->fb_pitch < s->fb_width * 4 || s->fb_addr + fb_size > GRAY_GPU_VRAM_SIZE){
+        return;
+    }
 
-        //Create displaysimple-gpu-drv.c surface from framebuffer data
-        if(g->fb_bpp == 32){
+    if(gray_gpu_scanout_setup(s) || s->invalidate){
+        gray_gpu_damage_rect(s, 0, 0, s->fb_width, s->fb_height);
+        s->invalidate = false;
+    }
 
-            //Create a temporary buffer for compositing cursor
-            uint32_t *temp_buffer = g_malloc(g->fb_width * g->fb_height * 4);
-            memcpy(temp_buffer, fb_data, g->fb_width * g->fb_height * 4);
+    if(!s->scanout_soft_cursor){
+        gray_gpu_update_hw_cursor(s);
+    }
 
-            //Comosite cursor onto the framebuffer
-            composite_cursor(g, temp_buffer);
+    gray_gpu_scan_dirty(g, s->fb_addr, s->fb_pitch, s->fb_width, s->fb_height);
+    for(uint32_t i = 0; i < s->overlay_count; i++){
+        const GrayGPUOverlay *o = &s->overlays[s->overlay_order[i]];
 
-            DisplaySurface *fb_surface = qemu_create_displaysurface_from(
-                    g->fb_width, g->fb_height, PIXMAN_a8r8g8b8,
-                    g->fb_pitch, (uint8_t*)temp_buffer);
-            dpy_gfx_replace_surface(g->console, fb_surface);
+        gray_gpu_scan_dirty(g, o->addr, o->pitch, o->src_width, o->src_height);
+    }
 
-            g_free(temp_buffer);
-        }
+    if(d->x1 >= d->x2){
+        return;
+    }
 
-        dpy_gfx_update(g->console, 0, 0, g->fb_width, g->fb_height);
-        g->dirty = false;
+    if(s->scanout_shadow){
+        //Rebuild only the damaged area of the shadow, then blend the cursor
+        gray_gpu_workers_split(g, gray_gpu_shadow_band, s, d->y2 - d->y1,
+                (d->x2 - d->x1) * 4, false);
+        if(s->scanout_soft_cursor){
+            composite_cursor(s, (uint32_t *)surface_data(s->scanout),
+                    surface_stride(s->scanout) / 4, d);
+        }
     }
+
+    dpy_gfx_update(s->console, d->x1, d->y1, d->x2 - d->x1, d->y2 - d->y1);
+    memset(d, 0, sizeof(*d));
 }
 
 static void gray_gpu_invalidate_display(void *opaque)
 {
-    GrayGPUState *g = GRAY_GPU(opaque);
-    g->dirty = true;
+    GrayGPUHead *s = opaque;
+    s->invalidate = true;
 }
 
 static const GraphicHwOps gray_gpu_ops = { 
@@ -467,50 +2011,166 @@ static const GraphicHwOps gray_gpu_ops = {
     .gfx_update = gray_gpu_update_display,
 };
 
+//Power-on state of a head, with its own vblank timer and console
+static void gray_gpu_head_init(GrayGPUState *g, uint32_t index)
+{
+    GrayGPUHead *s = &g->heads[index];
+
+    s->g = g;
+    s->index = index;
+    s->fb_width = 800;
+    s->fb_height = 600;
+    s->fb_bpp = 32;
+    s->fb_pitch = s->fb_width * 4;
+    s->fb_enable = 0;
+    s->fb_addr = 0;
+    s->invalidate = false;
+
+    //Initialize cursor 
+    s->cursor_enabled = 0;
+    s->cursor_x = 0;
+    s->cursor_y = 0;
+    s->cursor_upload_offset = 0;
+    s->cursor_base = 0;
+    s->cursor_define = true;
+    init_default_cursor(s);
+    s->overlay_count = 0;
+    
+    //Initialize Mutliple framebuffer state
+    s->fb_count = 1;        //start with single buffer
+    s->fb_current = 0;
+    s->fb_next = 0;
+    s->flip_pending = 0;
+    s->vblank_count = 0;
+    s->fb_addresses[0] = 0; //first framebuffer at offset 0;
+    s->fb_next_addr = 0;
+    s->next_mode = false;
+
+    s->vblank_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, gray_gpu_vblank, s);
+    s->console = graphic_console_init(DEVICE(g), index, &gray_gpu_ops, s);
+    qemu_console_resize(s->console, s->fb_width, s->fb_height);
+}
+
 static void gray_gpu_realize(PCIDevice *pci_dev, Error **errp){
     GrayGPUState *g = GRAY_GPU(pci_dev);
 
+    if(g->refresh_rate == 0 || g->refresh_rate > GRAY_GPU_MAX_REFRESH_RATE){
+        error_setg(errp, "refresh-rate must be between 1 and %d Hz",
+                GRAY_GPU_MAX_REFRESH_RATE);
+        return;
+    }
+
+    if(g->render_threads < -1 || g->render_threads > GRAY_GPU_MAX_WORKERS){
+        error_setg(errp, "render-threads must be -1 (auto) or between 0 and %d",
+                GRAY_GPU_MAX_WORKERS);
+        return;
+    }
+
+    if(g->num_heads == 0 || g->num_heads > GRAY_GPU_MAX_HEADS){
+        error_setg(errp, "heads must be between 1 and %d", GRAY_GPU_MAX_HEADS);
+        return;
+    }
+
     g->device_id = GRAY_GPU_DEVICE_ID;
     g->status = STATUS_READY;
     g->control = 0;
-    g->fb_width = 800;
-    g->fb_height = 600;
-    g->fb_bpp = 32;
-    g->fb_pitch = g->fb_width * 4;
-    g->fb_enable = 0;
-    g->fb_addr = 0;
-    g->dirty = false;
 
-    //Initialize cursor 
-    g->cursor_enabled = 0;
-    g->cursor_x = 0;
-    g->cursor_y = 0;
-    g->cursor_upload_offset = 0;
-    init_default_cursor(g);
-    
-    //Initialize Mutliple framebuffer state
-    g->fb_count = 1;        //start with single buffer
-    g->fb_current = 0;
-    g->fb_next = 0;
-    g->flip_pending = 0;
-    g->vblank_count = 0;
-    g->fb_addresses[0] = 0; //first framebuffer at offset 0;
+    g->irq_status = 0;
+    g->irq_enable = 0;
+
+    g->ring_base = 0;
+    g->ring_size = 0;
+    g->ring_head = 0;
+    g->ring_tail = 0;
+    g->fence_completed = 0;
+    g->ring_wait_vblank = false;
+    g->ring_wait_head = 0;
+
+    g->dma_desc = 0;
+    g->dma_desc_count = 0;
+    g->dma_status = 0;
+    g->dma_completed = 0;
 
     memory_region_init_io(&g->registers, OBJECT(g), &gray_gpu_reg_ops, g,
             "gray-gpu-registers", GRAY_GPU_REG_SIZE);
-    g->vram_ptr = g_malloc0(GRAY_GPU_VRAM_SIZE);
-    memory_region_init_io(&g->vram, OBJECT(g), &gray_gpu_vram_ops, g,
-            "gray-gpu-vram", GRAY_GPU_VRAM_SIZE);
+
+    //VRAM is plain guest RAM; track guest writes with the VGA dirty log
+    if(!memory_region_init_ram(&g->vram, OBJECT(g), "gray-gpu-vram",
+                GRAY_GPU_VRAM_SIZE, errp)){
+        return;
+    }
+    g->vram_ptr = memory_region_get_ram_ptr(&g->vram);
+    memory_region_set_log(&g->vram, true, DIRTY_MEMORY_VGA);
 
     pci_dev->config[PCI_INTERRUPT_PIN] = 1;
 
     pci_register_bar(pci_dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY, &g->registers);
     pci_register_bar(pci_dev, 1, PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_PREFETCH, &g->vram);
 
-    g->console = graphic_console_init(DEVICE(pci_dev), 0, &gray_gpu_ops, g);
-    qemu_console_resize(g->console, g->fb_width, g->fb_height);
+    if(g->msix){
+        Error *err = NULL;
+
+        if(msix_init_exclusive_bar(pci_dev, GRAY_GPU_MSIX_VECTORS,
+                    GRAY_GPU_MSIX_BAR, &err)){
+            warn_report_err(err);
+            g->msix = false;
+        }else{
+            for(int i = 0; i < GRAY_GPU_MSIX_VECTORS; i++){
+                msix_vector_use(pci_dev, i);
+            }
+        }
+    }
+
+    g->ring_bh = qemu_bh_new_guarded(gray_gpu_ring_process, g,
+            &DEVICE(g)->mem_reentrancy_guard);
+    g->dma_bh = qemu_bh_new_guarded(gray_gpu_dma_process, g,
+            &DEVICE(g)->mem_reentrancy_guard);
+
+    //One host core stays with the main loop, which also helps on sync jobs
+    int nthreads = g->render_threads;
+    if(nthreads < 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 1 ? MIN(cpus - 1, GRAY_GPU_AUTO_WORKERS) : 0;
+    }
+    g->blit_active = false;
+    gray_blend_argb_span_fn();  //resolve the blend kernel before any worker runs
+    gray_gpu_workers_init(g, nthreads);
+
+    for(uint32_t i = 0; i < g->num_heads; i++){
+        gray_gpu_head_init(g, i);
+    }
+}
+
+static void gray_gpu_exit(PCIDevice *pci_dev)
+{
+    GrayGPUState *g = GRAY_GPU(pci_dev);
+
+    for(uint32_t i = 0; i < g->num_heads; i++){
+        timer_free(g->heads[i].vblank_timer);
+        g->heads[i].vblank_timer = NULL;
+    }
+    gray_gpu_workers_exit(g);
+    qemu_bh_delete(g->ring_bh);
+    g->ring_bh = NULL;
+    qemu_bh_delete(g->dma_bh);
+    g->dma_bh = NULL;
+    if(g->msix){
+        msix_unuse_all_vectors(pci_dev);
+        msix_uninit_exclusive_bar(pci_dev);
+    }
+    for(uint32_t i = 0; i < g->num_heads; i++){
+        graphic_console_close(g->heads[i].console);
+    }
 }
 
+static const Property gray_gpu_properties[] = {
+    DEFINE_PROP_UINT32("refresh-rate", GrayGPUState, refresh_rate,
+            GRAY_GPU_DEFAULT_REFRESH_RATE),
+    DEFINE_PROP_BOOL("msix", GrayGPUState, msix, true),
+    DEFINE_PROP_INT32("render-threads", GrayGPUState, render_threads, -1),
+    DEFINE_PROP_UINT32("heads", GrayGPUState, num_heads, 1),
+};
+
 
 static void gray_gpu_class_init(ObjectClass *klass, const void *data)
 {
@@ -518,7 +2178,7 @@ static void gray_gpu_class_init(ObjectClass *klass, const void *data)
     PCIDeviceClass *k = PCI_DEVICE_CLASS(klass);
 
     k->realize = gray_gpu_realize;
-    //k->exit = gray_gpu_exit;
+    k->exit = gray_gpu_exit;
     k->vendor_id = GRAY_GPU_VENDOR_ID;
     k->device_id = GRAY_GPU_DEVICE_ID;
     k->class_id = PCI_CLASS_DISPLAY_VGA;
@@ -526,6 +2186,7 @@ static void gray_gpu_class_init(ObjectClass *klass, const void *data)
     k->subsystem_id = GRAY_GPU_DEVICE_ID;
     
     dc->desc = "Gray GPU Device for Learning";
+    device_class_set_props(dc, gray_gpu_properties);
     set_bit(DEVICE_CATEGORY_DISPLAY, dc->categories);
 }
 
@@ -12,6 +12,12 @@
 #define IOCTL_GET_VRAM_SIZE 0x1002
 #define IOCTL_SETUP_MULTI_FB 0x1007
 #define IOCTL_PAGE_FLIP     0x1008
+#define IOCTL_SUBMIT        0x100E
+#define IOCTL_WAIT_FENCE    0x100F
+
+/* Ring command header: opcode in bits 31:24, payload dwords in 15:0 */
+#define CMD_HEADER(op, len) (((uint32_t)(op) << 24) | (len))
+#define CMD_FILL            0x03
 
 struct fb_params {
     uint32_t width;
@@ -31,6 +37,32 @@ struct flip_request {
     uint32_t wait_vblank;
 };
 
+struct submit_request {
+    uint64_t cmds;
+    uint32_t size;
+    uint32_t flags;
+    uint64_t fence;
+};
+
+struct wait_fence_request {
+    uint64_t fence;
+    uint32_t timeout_ms;
+    uint32_t pad;
+};
+
+/* Append a solid fill of a width x height rectangle at byte offset dst */
+static uint32_t *emit_fill(uint32_t *cmd, uint32_t dst, uint32_t pitch,
+                           uint32_t width, uint32_t height, uint32_t color)
+{
+    *cmd++ = CMD_HEADER(CMD_FILL, 5);
+    *cmd++ = dst;
+    *cmd++ = pitch;
+    *cmd++ = width;
+    *cmd++ = height;
+    *cmd++ = color;
+    return cmd;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -38,8 +70,11 @@ int main(int argc, char *argv[])
     struct multi_fb_setup setup = {2, 800, 600, 32}; /* 2 framebuffers for double buffering */
     struct flip_request flip;
     uint32_t vram_size;
+    uint32_t fb_bytes;
     uint32_t *framebuffer;
-    uint32_t *fb0, *fb1;
+    uint32_t cmds[12];
+    struct submit_request submit;
+    struct wait_fence_request wait;
     const char *device_name; 
     
     if (argc > 1) {
@@ -75,17 +110,16 @@ int main(int argc, char *argv[])
     }
     printf("Double buffering setup: %dx%d@%dbpp\n", setup.width, setup.height, setup.bpp);
     
-    framebuffer = mmap(NULL, vram_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    /* Only the two framebuffers are mappable, not the whole of VRAM */
+    fb_bytes = setup.width * 4 * setup.height * 2;
+    framebuffer = mmap(NULL, fb_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (framebuffer == MAP_FAILED) {
-        perror("Failed to map VRAM");
+        perror("Failed to map framebuffers");
         close(fd);
         return 1;
     }
-    printf("VRAM mapped successfully\n");
+    printf("Framebuffers mapped successfully\n");
     
-   
-    fb0 = framebuffer;                                    /* First framebuffer at offset 0 */
-    fb1 = framebuffer + (setup.width * setup.height);    /* Second framebuffer after first */
     
     if (ioctl(fd, IOCTL_ENABLE_DISP, 1) < 0) {
         perror("Failed to enable display");
@@ -98,25 +132,38 @@ int main(int argc, char *argv[])
     for (int frame = 0; ; frame++) { 
         /* Use double buffering - alternate between fb0 and fb1 */
         int current_fb = frame % 2;
-        uint32_t *back_buffer = (current_fb == 0) ? fb0 : fb1;
-        
-        /* Clear back buffer */
-        memset(back_buffer, 0, setup.width * setup.height * 4);
+        uint32_t pitch = setup.width * 4;
+        uint32_t back_offset = current_fb * pitch * setup.height;
         
         /* Calculate rectangle position */
         int rect_x = (frame * 2) % (setup.width - 100);
         int rect_y = 250;
         
-        /* Draw colorful rectangle to back buffer */
         uint32_t color = 0xFF000000 | 
                         ((frame * 4) % 256) << 16 |   
                         ((frame * 2) % 256) << 8 |    
                         ((frame * 1) % 256);       
         
-        for (int y = rect_y; y < rect_y + 100 && y < setup.height; y++) {
-            for (int x = rect_x; x < rect_x + 100 && x < setup.width; x++) {
-                back_buffer[y * setup.width + x] = color;
-            }
+        /* Clear the back buffer and draw the rectangle on the GPU's 2D engine */
+        uint32_t *cmd = cmds;
+        cmd = emit_fill(cmd, back_offset, pitch, setup.width, setup.height, 0);
+        cmd = emit_fill(cmd, back_offset + rect_y * pitch + rect_x * 4, pitch, 100, 100, color);
+        
+        submit.cmds = (uintptr_t)cmds;
+        submit.size = (cmd - cmds) * 4;
+        submit.flags = 0;
+        if (ioctl(fd, IOCTL_SUBMIT, &submit) < 0) {
+            perror("Command submit failed");
+            break;
+        }
+        
+        /* Both fills must land before the buffer is shown */
+        wait.fence = submit.fence;
+        wait.timeout_ms = 100;
+        wait.pad = 0;
+        if (ioctl(fd, IOCTL_WAIT_FENCE, &wait) < 0) {
+            perror("Fence wait failed");
+            break;
         }
         
         /* Page flip to display the new frame */
@@ -134,7 +181,7 @@ int main(int argc, char *argv[])
     ioctl(fd, IOCTL_ENABLE_DISP, 0);
     printf("Display disabled\n");
     
-    munmap(framebuffer, vram_size);
+    munmap(framebuffer, fb_bytes);
     close(fd);
     
     printf("Test completed successfully!\n");